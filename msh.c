@@ -6,23 +6,41 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-//#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <elf.h>
+#include <glob.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-// If ENABLE_LOGGING is non-zero and non-empty,
-// a lot of logging staff comes into stderr,
-// so it is not expected to be turned on when an ordinary msh user runs it.
-#define ENABLE_LOGGING 0
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define MSH_X86_LEXERS
+#endif
 
 // Main exit point from the program which should free all resources allocated with malloc.
 static void free_and_exit( int retcode );
@@ -43,22 +61,193 @@ typedef enum process_type_t
 
 static process_type_t my_process_type = PROCESS_TYPE_NONE;
 
-// Some reporting to console macros. If logging is enabled, LOG lets us see,
-// what staff is going on inside msh execution.
-#define ERROR( ... )                \
-  {                                 \
-    fprintf( stderr, __VA_ARGS__ ); \
-    fprintf( stderr, "\n" );        \
-    fflush( stderr );               \
+// In one-shot mode (msh -c) there is no shell process: the liner runs the given
+// line by itself and exits with the last command's status. Nobody else needs
+// our state, so nothing is shared through files.
+static bool one_shot_mode = false;
+
+// Logging. Every message is recorded as a binary event into a preallocated
+// ring buffer: format string pointer, arguments and a timestamp. Text is only
+// made from them when the ring is dumped - by logdump builtin or at exit.
+// Recording doesn't take any locks and doesn't call stdio,
+// so it is safe inside signal handlers.
+//
+// MSH_LOG_LEVEL variable sets the level on startup:
+// - "off" (0): nothing is recorded;
+// - "error" (1), the default: ERROR messages are recorded;
+// - "debug" (2): LOG messages are recorded as well and the ring is dumped on exit
+//   into MSH_LOG_FILE (or stderr), a lot of staff is going on inside msh execution.
+typedef enum log_level_t
+{
+  LOG_LEVEL_OFF = 0,
+  LOG_LEVEL_ERROR,
+  LOG_LEVEL_DEBUG
+} log_level_t;
+
+static log_level_t log_level = LOG_LEVEL_ERROR;
+
+#define LOG_RING_SIZE 512
+#define LOG_MAX_ARGS 5
+#define LOG_STRINGS_SIZE 96
+
+typedef struct log_event_t
+{
+  // Number of the event plus one, written last - so a half-written event
+  // (interrupted by a signal, or overwritten) can be recognized and skipped.
+  unsigned long sequence;
+  struct timespec timestamp;
+  pid_t pid;
+  process_type_t process_type;
+  log_level_t level;
+  const char * format;
+  unsigned args_count;
+  // Bit i is set if args[i] is an offset of a string inside strings.
+  unsigned string_args_mask;
+  long long args[LOG_MAX_ARGS];
+  // String arguments are copied here, as they can be freed before the dump.
+  char strings[LOG_STRINGS_SIZE];
+  size_t strings_len;
+} log_event_t;
+
+static log_event_t log_ring[LOG_RING_SIZE];
+static unsigned long log_ring_head = 0;
+
+// Events recorded before the last fork() belong to the parent process.
+static unsigned long log_ring_fork_head = 0;
+
+static log_event_t * log_begin_event( log_level_t level, const char * format )
+{
+  unsigned long ievent = __atomic_fetch_add( &log_ring_head, 1, __ATOMIC_RELAXED );
+  log_event_t * event = &log_ring[ievent % LOG_RING_SIZE];
+  __atomic_store_n( &event->sequence, 0, __ATOMIC_RELAXED );
+  clock_gettime( CLOCK_MONOTONIC, &event->timestamp );
+  event->pid = getpid();
+  event->process_type = my_process_type;
+  event->level = level;
+  event->format = format;
+  event->args_count = 0;
+  event->string_args_mask = 0;
+  event->strings_len = 0;
+  // Temporarily keep the number of the event here.
+  event->args[0] = (long long)ievent;
+  return event;
+}
+
+static void log_add_integer_arg( log_event_t * event, long long arg )
+{
+  if ( event->args_count < LOG_MAX_ARGS )
+  {
+    event->args[event->args_count++] = arg;
+  }
+}
+
+static void log_add_string_arg( log_event_t * event, const char * arg )
+{
+  if ( event->args_count >= LOG_MAX_ARGS )
+  {
+    return;
+  }
+  if ( arg == NULL )
+  {
+    arg = "(null)";
+  }
+  size_t offset = event->strings_len;
+  if ( offset == LOG_STRINGS_SIZE )
+  {
+    // No room left, the argument is the empty string ending the buffer.
+    offset = LOG_STRINGS_SIZE - 1;
+  }
+  while ( *arg && event->strings_len + 1 < LOG_STRINGS_SIZE )
+  {
+    event->strings[event->strings_len++] = *arg++;
+  }
+  if ( event->strings_len < LOG_STRINGS_SIZE )
+  {
+    event->strings[event->strings_len++] = '\0';
+  }
+  event->string_args_mask |= 1u << event->args_count;
+  event->args[event->args_count++] = (long long)offset;
+}
+
+static void log_commit_event( log_event_t * event, unsigned long ievent )
+{
+  __atomic_store_n( &event->sequence, ievent + 1, __ATOMIC_RELEASE );
+}
+
+// Arguments are saved according to their types: strings are copied, everything else
+// is kept as an integer (msh doesn't log floating point numbers).
+#define LOG_ARG( event, x )                                               \
+  _Generic( ( x ), char * : log_add_string_arg, const char * : log_add_string_arg, \
+            default : log_add_integer_arg )( event, ( x ) );
+#define LOG_ARGS_0( event )
+#define LOG_ARGS_1( event, a ) LOG_ARG( event, a )
+#define LOG_ARGS_2( event, a, b ) LOG_ARGS_1( event, a ) LOG_ARG( event, b )
+#define LOG_ARGS_3( event, a, b, c ) LOG_ARGS_2( event, a, b ) LOG_ARG( event, c )
+#define LOG_ARGS_4( event, a, b, c, d ) LOG_ARGS_3( event, a, b, c ) LOG_ARG( event, d )
+#define LOG_ARGS_5( event, a, b, c, d, e ) LOG_ARGS_4( event, a, b, c, d ) LOG_ARG( event, e )
+#define LOG_COUNT_ARGS_( dummy, a, b, c, d, e, count, ... ) count
+#define LOG_COUNT_ARGS( ... ) LOG_COUNT_ARGS_( dummy, ##__VA_ARGS__, 5, 4, 3, 2, 1, 0 )
+#define LOG_ARGS_SELECT_( count ) LOG_ARGS_##count
+#define LOG_ARGS_SELECT( count ) LOG_ARGS_SELECT_( count )
+
+#define LOG_RECORD( level, format, ... )                                                \
+  {                                                                                     \
+    log_event_t * log_event_ = log_begin_event( level, format );                        \
+    unsigned long log_event_number_ = (unsigned long)log_event_->args[0];               \
+    LOG_ARGS_SELECT( LOG_COUNT_ARGS( __VA_ARGS__ ) )( log_event_, ##__VA_ARGS__ )       \
+    log_commit_event( log_event_, log_event_number_ );                                  \
   }
 
-#if ENABLE_LOGGING
+// Print the error for the user right away with a single write(2) and record it.
+static void print_error( const char * format, ... ) __attribute__( ( format( printf, 1, 2 ) ) );
+
+// Some reporting to console macros. ERROR is always shown to the user,
+// LOG lets us see, what staff is going on inside msh execution.
+// When the level is lower, LOG costs just one predictable branch.
+#define ERROR( format, ... )                                   \
+  {                                                            \
+    if ( log_level >= LOG_LEVEL_ERROR )                        \
+    {                                                          \
+      LOG_RECORD( LOG_LEVEL_ERROR, format, ##__VA_ARGS__ )     \
+    }                                                          \
+    print_error( format, ##__VA_ARGS__ );                      \
+  }
+
+#define LOG( format, ... )                                     \
+  {                                                            \
+    if ( __builtin_expect( log_level >= LOG_LEVEL_DEBUG, 0 ) ) \
+    {                                                          \
+      LOG_RECORD( LOG_LEVEL_DEBUG, format, ##__VA_ARGS__ )     \
+    }                                                          \
+  }
+
+static void print_error( const char * format, ... )
+{
+  char message[512];
+  va_list args;
+  va_start( args, format );
+  int message_len = vsnprintf( message, sizeof( message ) - 1, format, args );
+  va_end( args );
+  if ( message_len < 0 )
+  {
+    return;
+  }
+  if ( ( size_t )message_len > sizeof( message ) - 2 )
+  {
+    message_len = sizeof( message ) - 2;
+  }
+  message[message_len++] = '\n';
+  if ( write( STDERR_FILENO, message, ( size_t )message_len ) == -1 )
+  {
+    // Nowhere to report it.
+  }
+}
 
-// Auxiliary function used in logging, mostly to identify our current process.
-static const char * get_my_process_name()
+// Auxiliary function used in logging, mostly to identify the process.
+static const char * get_process_name( process_type_t process_type )
 {
   const char * process_name = NULL;
-  switch ( my_process_type )
+  switch ( process_type )
   {
     case PROCESS_TYPE_SHELL:
       process_name = "Shell:\t";
@@ -76,24 +265,366 @@ static const char * get_my_process_name()
   return process_name;
 }
 
-#define LOG( ... )                                  \
-  {                                                 \
-    fprintf( stderr, "%s", get_my_process_name() ); \
-    ERROR( __VA_ARGS__ );                           \
+// Make text of the event, substituting saved arguments into its format.
+static void format_log_event( const log_event_t * event, char * buf, size_t buf_size )
+{
+  size_t len = 0;
+  unsigned iarg = 0;
+  const char * c = event->format;
+  while ( *c && len + 1 < buf_size )
+  {
+    if ( *c != '%' )
+    {
+      buf[len++] = *c++;
+      continue;
+    }
+    if ( c[1] == '%' )
+    {
+      buf[len++] = '%';
+      c += 2;
+      continue;
+    }
+
+    // Copy conversion specification to format a single argument with it.
+    char spec[16];
+    size_t spec_len = 0;
+    bool is_long = false;
+    spec[spec_len++] = *c++;
+    while ( *c && strchr( "-+ #0123456789.hlzjt", *c ) && spec_len + 2 < sizeof( spec ) )
+    {
+      is_long = is_long || *c == 'l' || *c == 'z';
+      spec[spec_len++] = *c++;
+    }
+    char conversion = *c ? *c++ : 'd';
+    spec[spec_len++] = conversion;
+    spec[spec_len] = '\0';
+
+    long long arg = iarg < event->args_count ? event->args[iarg] : 0;
+    bool is_string = iarg < event->args_count && ( event->string_args_mask & ( 1u << iarg ) );
+    iarg++;
+
+    int written;
+    if ( conversion == 's' )
+    {
+      written = snprintf( buf + len, buf_size - len, spec, is_string ? event->strings + arg : "?" );
+    }
+    else if ( strchr( "uxXo", conversion ) )
+    {
+      written = is_long ? snprintf( buf + len, buf_size - len, spec, (unsigned long)arg ) :
+                          snprintf( buf + len, buf_size - len, spec, (unsigned)arg );
+    }
+    else
+    {
+      written = is_long ? snprintf( buf + len, buf_size - len, spec, (long)arg ) :
+                          snprintf( buf + len, buf_size - len, spec, (int)arg );
+    }
+    if ( written > 0 )
+    {
+      len += ( size_t )written < buf_size - len ? ( size_t )written : buf_size - len - 1;
+    }
+  }
+  buf[len] = '\0';
+}
+
+// Format and write all complete events with numbers starting from first_event into fd.
+static void dump_log_ring( int fd, unsigned long first_event )
+{
+  unsigned long head = __atomic_load_n( &log_ring_head, __ATOMIC_ACQUIRE );
+  if ( head > LOG_RING_SIZE && first_event < head - LOG_RING_SIZE )
+  {
+    first_event = head - LOG_RING_SIZE;
   }
 
-#else
-#define LOG( ... ) ;
-#endif
+  unsigned long ievent;
+  for ( ievent = first_event; ievent < head; ievent++ )
+  {
+    const log_event_t * event = &log_ring[ievent % LOG_RING_SIZE];
+    if ( __atomic_load_n( &event->sequence, __ATOMIC_ACQUIRE ) != ievent + 1 )
+    {
+      continue;
+    }
+    char message[512];
+    format_log_event( event, message, sizeof( message ) );
+    char line[640];
+    int line_len = snprintf( line,
+                             sizeof( line ),
+                             "[%5ld.%06ld] %s%s(%d) %s\n",
+                             event->timestamp.tv_sec,
+                             event->timestamp.tv_nsec / 1000,
+                             event->level == LOG_LEVEL_ERROR ? "ERROR " : "",
+                             get_process_name( event->process_type ),
+                             event->pid,
+                             message );
+    if ( line_len > 0 &&
+         write( fd, line, ( size_t )line_len < sizeof( line ) ? ( size_t )line_len : sizeof( line ) - 1 ) ==
+             -1 )
+    {
+      break;
+    }
+  }
+}
 
-// Prompt that is print, while we are running msh in interactive mode.
-#define PROMPT "msh> "
-static void print_prompt()
+// Called on exit: in debug level this process' own events are saved.
+static void dump_log_ring_on_exit( const char * log_filename )
 {
-  printf( PROMPT );
-  fflush( stdout );
+  if ( log_level < LOG_LEVEL_DEBUG )
+  {
+    return;
+  }
+  int fd = STDERR_FILENO;
+  if ( log_filename != NULL )
+  {
+    fd = open( log_filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+    if ( fd == -1 )
+    {
+      fd = STDERR_FILENO;
+    }
+  }
+  dump_log_ring( fd, log_ring_fork_head );
+  if ( fd != STDERR_FILENO )
+  {
+    close( fd );
+  }
+}
+
+// Called in a child right after fork().
+static void log_process_started()
+{
+  log_ring_fork_head = __atomic_load_n( &log_ring_head, __ATOMIC_ACQUIRE );
+}
+
+static void init_log_level( const char * level_name )
+{
+  if ( level_name == NULL )
+  {
+    return;
+  }
+  if ( strcmp( level_name, "off" ) == 0 || strcmp( level_name, "0" ) == 0 )
+  {
+    log_level = LOG_LEVEL_OFF;
+  }
+  else if ( strcmp( level_name, "error" ) == 0 || strcmp( level_name, "1" ) == 0 )
+  {
+    log_level = LOG_LEVEL_ERROR;
+  }
+  else if ( strcmp( level_name, "debug" ) == 0 || strcmp( level_name, "2" ) == 0 )
+  {
+    log_level = LOG_LEVEL_DEBUG;
+  }
+  else
+  {
+    ERROR( "Unknown MSH_LOG_LEVEL %s", level_name );
+  }
+}
+
+// Execution tracer. If MSH_TRACE variable names a file on startup, msh processes
+// record spans and instant events into memory and flush them into that file
+// in Chrome trace-event JSON format (opens in chrome://tracing or Perfetto).
+// All msh processes append to the same file, each process is a thread track
+// inside one "msh" process track. The JSON array is left without closing ']',
+// which the trace viewers accept, so any process can append at any moment.
+#define TRACE_BUFFER_SIZE 1024
+#define TRACE_DETAIL_SIZE 32
+
+typedef struct trace_event_t
+{
+  // Event names are always string literals.
+  const char * name;
+  // Phase as in Chrome trace format: 'B'/'E' - span on the thread,
+  // 'b'/'e' - asynchronous span with id, 'i' - instant event.
+  char phase;
+  long id;
+  pid_t tid;
+  struct timespec timestamp;
+  char detail[TRACE_DETAIL_SIZE];
+} trace_event_t;
+
+static int trace_fd = -1;
+static pid_t trace_pid = 0;
+static trace_event_t trace_events[TRACE_BUFFER_SIZE];
+static size_t trace_events_count = 0;
+static size_t trace_events_dropped = 0;
+
+// Record an event, it is safe to call from signal handlers:
+// a slot is taken atomically and events are never flushed from here.
+static void trace_event( const char * name, char phase, long id, const char * detail )
+{
+  if ( trace_fd == -1 )
+  {
+    return;
+  }
+
+  size_t ievent = __atomic_fetch_add( &trace_events_count, 1, __ATOMIC_RELAXED );
+  if ( ievent >= TRACE_BUFFER_SIZE )
+  {
+    __atomic_fetch_sub( &trace_events_count, 1, __ATOMIC_RELAXED );
+    trace_events_dropped++;
+    return;
+  }
+
+  trace_event_t * event = &trace_events[ievent];
+  clock_gettime( CLOCK_MONOTONIC, &event->timestamp );
+  event->name = name;
+  event->phase = phase;
+  event->id = id;
+  event->tid = getpid();
+  event->detail[0] = '\0';
+  if ( detail != NULL )
+  {
+    strncat( event->detail, detail, TRACE_DETAIL_SIZE - 1 );
+  }
+}
+
+#define TRACE_BEGIN( name, detail ) trace_event( name, 'B', 0, detail )
+#define TRACE_END( name ) trace_event( name, 'E', 0, NULL )
+#define TRACE_ASYNC_BEGIN( name, id, detail ) trace_event( name, 'b', id, detail )
+#define TRACE_ASYNC_END( name, id ) trace_event( name, 'e', id, NULL )
+#define TRACE_INSTANT( name, detail ) trace_event( name, 'i', 0, detail )
+
+// Write string escaped for JSON into buf, returns number of bytes written.
+static size_t trace_escape( char * buf, size_t buf_size, const char * str )
+{
+  size_t len = 0;
+  for ( ; *str && len + 2 < buf_size; str++ )
+  {
+    if ( *str == '"' || *str == '\\' )
+    {
+      buf[len++] = '\\';
+    }
+    buf[len++] = isprint( *str ) ? *str : '?';
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+// Write all the recorded events into the trace file.
+static void trace_flush()
+{
+  if ( trace_fd == -1 || trace_events_count == 0 )
+  {
+    return;
+  }
+
+  // Every event is written with a separate write(), as the file is opened with O_APPEND,
+  // events from different processes never mix up.
+  size_t ievent;
+  for ( ievent = 0; ievent < trace_events_count; ievent++ )
+  {
+    trace_event_t * event = &trace_events[ievent];
+    char detail[2 * TRACE_DETAIL_SIZE];
+    trace_escape( detail, sizeof( detail ), event->detail );
+
+    char record[256];
+    int record_len = snprintf( record,
+                               sizeof( record ),
+                               "{\"name\":\"%s\",\"cat\":\"msh\",\"ph\":\"%c\",\"ts\":%ld.%03ld,"
+                               "\"pid\":%d,\"tid\":%d,\"id\":%ld%s%s%s%s},\n",
+                               event->name,
+                               event->phase,
+                               event->timestamp.tv_sec * 1000000 + event->timestamp.tv_nsec / 1000,
+                               event->timestamp.tv_nsec % 1000,
+                               trace_pid,
+                               event->tid,
+                               event->id,
+                               event->phase == 'i' ? ",\"s\":\"t\"" : "",
+                               detail[0] ? ",\"args\":{\"detail\":\"" : "",
+                               detail,
+                               detail[0] ? "\"}" : "" );
+    if ( write( trace_fd, record, ( size_t )record_len ) != record_len )
+    {
+      break;
+    }
+  }
+  trace_events_count = 0;
+
+  if ( trace_events_dropped > 0 )
+  {
+    LOG( "Tracer dropped %lu events", trace_events_dropped );
+    trace_events_dropped = 0;
+  }
+}
+
+// Name the thread track of the current process.
+static void trace_name_thread( const char * thread_name )
+{
+  if ( trace_fd == -1 )
+  {
+    return;
+  }
+  char name[2 * TRACE_DETAIL_SIZE];
+  trace_escape( name, sizeof( name ), thread_name );
+  char record[256];
+  int record_len = snprintf( record,
+                             sizeof( record ),
+                             "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                             "\"args\":{\"name\":\"%s %d\"}},\n",
+                             trace_pid,
+                             getpid(),
+                             name,
+                             getpid() );
+  if ( write( trace_fd, record, ( size_t )record_len ) != record_len )
+  {
+    LOG( "Failed to write trace metadata" );
+  }
+}
+
+// Called in a child right after fork(), the events inherited from the parent
+// belong to the parent and will be flushed by it.
+static void trace_process_started( const char * thread_name )
+{
+  trace_events_count = 0;
+  trace_events_dropped = 0;
+  trace_name_thread( thread_name );
+}
+
+// Start tracing into trace_filename, does nothing if it is NULL.
+static void trace_init( const char * trace_filename )
+{
+  if ( trace_filename == NULL || *trace_filename == '\0' )
+  {
+    return;
+  }
+  trace_fd = open( trace_filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644 );
+  if ( trace_fd == -1 )
+  {
+    ERROR( "Failed to open trace file %s", trace_filename );
+    return;
+  }
+  trace_pid = getpid();
+
+  char record[128];
+  int record_len = snprintf( record,
+                             sizeof( record ),
+                             "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                             "\"args\":{\"name\":\"msh %d\"}},\n",
+                             trace_pid,
+                             trace_pid );
+  if ( write( trace_fd, record, ( size_t )record_len ) != record_len )
+  {
+    ERROR( "Failed to write trace file %s", trace_filename );
+  }
+  trace_name_thread( "shell" );
 }
 
+// Prompt that is print, while we are running msh in interactive mode.
+// It is rendered from the MSH_PROMPT format every time (see print_prompt()).
+#define DEFAULT_PROMPT "msh> "
+#define PROMPT_SIZE 256
+static char prompt[PROMPT_SIZE] = DEFAULT_PROMPT;
+static void print_prompt();
+
+// Status of the last line run in the shell, shown by %? in the prompt.
+static int last_line_status = 0;
+
+// The helper process finding the git branch for the prompt, -1 if there is none.
+static pid_t prompt_helper_pid = -1;
+
+// The helper process reading ahead the predicted command, -1 if there is none.
+static pid_t prefetch_helper_pid = -1;
+
+// Set when the git branch of the prompt could have changed in the same directory.
+static bool prompt_branch_stale = true;
+
 // The maximum command-line size we support (taken from sample repository).
 #define MAX_COMMAND_SIZE 255
 
@@ -101,9 +632,9 @@ static void print_prompt()
 // plus the command name is also a token, for simplicity.
 #define MAX_NUM_ARGUMENTS 11
 
-// Suffix we will to PATH environmental variable,
-// to specify where to search for executable file
-#define SEARCH_PATH_SUFFIX ":/usr/local/bin:/usr/bin:/bin"
+// Default value of PATH variable in the shell, it specifies where to search
+// for executable files: current working directory goes first (as ".").
+#define DEFAULT_SEARCH_PATH ".:/usr/local/bin:/usr/bin:/bin"
 
 // Structures for preserving current command lines history.
 #define MAX_COMMANDS_HISTORY_SIZE 50
@@ -111,6 +642,8 @@ static void print_prompt()
 // the first free spot, or the spot which is next to be rewritten.
 static char command_history[MAX_COMMANDS_HISTORY_SIZE][MAX_COMMAND_SIZE];
 static size_t command_history_finish = 0;
+// Lines ever saved, the history keeps the last MAX_COMMANDS_HISTORY_SIZE of them.
+static size_t history_lines_count = 0;
 
 // The same principle of circular buffer is applied here, as in command_history.
 // Structures for saving pid of processes spawned with fork().
@@ -134,854 +667,9183 @@ static void add_pid_to_history( pid_t pid )
   pids_history_finish = ( pids_history_finish + 1 ) % MAX_PIDS_HISTORY_SIZE;
 }
 
-// Special codes for a worker to exit.
-// It worth noting that when any command from execvp returns with the same code,
-// our worker returns with EXIT_FAILURE (=1),
-// which should not be equal to the special codes below.
-typedef enum worker_exit_code_t
+// Resource usage of finished commands. The liner takes it from wait4() when
+// reaping its worker and passes it to the shell in the pid storage file,
+// next to the pids, as a line of text (see format_process_record()).
+// The shell keeps the records in one more circular buffer.
+// A liner executing its last command in place (see start_worker()) leaves
+// an "X" line instead, with the record started, for the shell to complete.
+#define MAX_PROCESS_RECORDS 64
+#define PROCESS_RECORD_COMMAND_SIZE 32
+#define PROCESS_RECORD_LINE_SIZE 256
+
+typedef struct process_record_t
 {
-  MSH_EXIT_ALL = 4,
-  MSH_EXIT_BG = 5
-} worker_exit_code_t;
-
-// This flag will be set, if worker's job is finished - so that in the main flow
-// (not signal handling) the liner will now if he still need to pause().
-static bool last_worker_exited = true;
-
-// The same flag for being sure we have to put shell into sleep.
-static bool last_liner_exited = true;
-
-// Some kind of limitation, but no idea how to surpass it in an easy way.
-// In a nutshell, we have to share C-string of the current working directory
-// between different processes of msh. We are doing it through file sharing.
-#define MAX_CWD_SIZE 255
-
-static pid_t msh_pgid = -1;
-
-#define CWD_STORAGE_FILENAME_SIZE 30
-static char cwd_storage_filename[CWD_STORAGE_FILENAME_SIZE] = "/tmp/msh_cwd_";
-
-// Set new current working directory.
-static void set_cwd( char * new_cwd )
+  pid_t pid;
+  // Status as returned by wait4(): exit code or the killing signal.
+  int status;
+  // CLOCK_REALTIME in microseconds.
+  long long start_us;
+  long long end_us;
+  long long user_us;
+  long long system_us;
+  long max_rss_kb;
+  long major_faults;
+  // The command line, cut to fit.
+  char command[PROCESS_RECORD_COMMAND_SIZE];
+} process_record_t;
+
+static process_record_t process_records[MAX_PROCESS_RECORDS];
+// Records ever added, the next one goes to process_records_count % MAX_PROCESS_RECORDS.
+static size_t process_records_count = 0;
+
+static void add_process_record( const process_record_t * record )
 {
-  FILE * f = fopen( cwd_storage_filename, "w" );
-  fprintf( f, "%s", new_cwd );
-  fclose( f );
+  process_records[process_records_count % MAX_PROCESS_RECORDS] = *record;
+  process_records_count++;
 }
 
-// Will try to change current working directory to new_dir,
-// returning 0 on success, -1 on failure.
-static int try_change_directory( char * new_dir )
+// Returns the latest record of the pid or NULL.
+static const process_record_t * find_process_record( pid_t pid )
 {
-  LOG( "Changing directory to %s", new_dir );
-  int exit_code = chdir( new_dir );
-  if ( exit_code != 0 )
+  size_t irecord;
+  for ( irecord = process_records_count; irecord > 0 && process_records_count - irecord < MAX_PROCESS_RECORDS;
+        irecord-- )
   {
-    ERROR( "cd: Error occured\n" );
-    return -1;
+    const process_record_t * record = &process_records[( irecord - 1 ) % MAX_PROCESS_RECORDS];
+    if ( record->pid == pid )
+    {
+      return record;
+    }
   }
+  return NULL;
+}
 
-  char * cwd = get_current_dir_name();
-  set_cwd( cwd );
-  free( cwd );
-  return 0;
+static void format_process_record( const process_record_t * record, char * line, size_t line_size )
+{
+  snprintf( line,
+            line_size,
+            "R %d %d %lld %lld %lld %lld %ld %ld %s\n",
+            record->pid,
+            record->status,
+            record->start_us,
+            record->end_us,
+            record->user_us,
+            record->system_us,
+            record->max_rss_kb,
+            record->major_faults,
+            record->command );
 }
 
-// Update this process' current working directory,
-// taken from file cwd_storage_filename.
-static void update_cwd()
+static bool parse_process_record( const char * line, process_record_t * record )
 {
-  FILE * f = fopen( cwd_storage_filename, "r" );
-  char * cwd = (char *)malloc( MAX_CWD_SIZE );
-  memset( cwd, 0, MAX_CWD_SIZE );
-  int fscanf_result = fscanf( f, "%s", cwd );
-  if ( fscanf_result <= 0 )
+  int command_offset = 0;
+  if ( sscanf( line,
+               "%*c %d %d %lld %lld %lld %lld %ld %ld %n",
+               &record->pid,
+               &record->status,
+               &record->start_us,
+               &record->end_us,
+               &record->user_us,
+               &record->system_us,
+               &record->max_rss_kb,
+               &record->major_faults,
+               &command_offset ) != 8 ||
+       command_offset == 0 )
   {
-    ERROR( "Bad format for current working directory" );
-    if ( my_process_type != PROCESS_TYPE_SHELL )
-    {
-      free_and_exit( EXIT_FAILURE );
-    }
+    return false;
   }
-  fclose( f );
-
-  int chdir_ret_code = chdir( cwd );
-  if ( chdir_ret_code == -1 )
+  const char * command = line + command_offset;
+  size_t command_len = strcspn( command, "\n" );
+  if ( command_len >= PROCESS_RECORD_COMMAND_SIZE )
   {
-    ERROR( "Error with chdir" );
-    if ( my_process_type != PROCESS_TYPE_SHELL )
-    {
-      free_and_exit( EXIT_FAILURE );
-    }
+    command_len = PROCESS_RECORD_COMMAND_SIZE - 1;
   }
-  free( cwd );
+  memcpy( record->command, command, command_len );
+  record->command[command_len] = '\0';
+  return true;
 }
 
-// Another kind of dirty hack decision to use files for sharing info between
-// liner and shell. With sockets the code would become much-much more complicated
-// (and it is over 1k LOC already!)
-#define PID_STORAGE_FILENAME_SIZE 40
-static char pid_storage_suffix[PID_STORAGE_FILENAME_SIZE] = "/tmp/msh_pid_";
+static long long get_realtime_us()
+{
+  struct timespec now;
+  clock_gettime( CLOCK_REALTIME, &now );
+  return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-// Shared between liner and shell - C-string with command line tokens and semicolons,
+static long long timeval_to_us( const struct timeval * time )
+{
+  return (long long)time->tv_sec * 1000000 + time->tv_usec;
+}
+
+// Fills in how the process ended, from what wait4() has reported.
+static void complete_process_record( process_record_t * record, int status, const struct rusage * usage )
+{
+  record->status = status;
+  record->end_us = get_realtime_us();
+  record->user_us = timeval_to_us( &usage->ru_utime );
+  record->system_us = timeval_to_us( &usage->ru_stime );
+  record->max_rss_kb = usage->ru_maxrss;
+  record->major_faults = usage->ru_majflt;
+}
+
+/*
+ * Live metrics.
+ *
+ * The interactive shell publishes its counters in /dev/shm/msh.<pid>,
+ * for `msh --top` to show all the shells running on the host.
+ * The segment is mapped before the first fork(), so liners and workers
+ * update the very same counters. Each field is a separate 64-bit word
+ * changed atomically, so a reader never sees it half-written and nobody
+ * waits for anybody.
+ */
+
+#define METRICS_DIR "/dev/shm"
+#define METRICS_PREFIX "msh."
+#define METRICS_FILENAME_SIZE 64
+#define METRICS_MAGIC 0x6d73686dU
+// Has to change together with metrics_t, readers skip segments of other versions.
+#define METRICS_VERSION 1
+
+typedef struct metrics_t
+{
+  uint32_t magic;
+  uint32_t version;
+  int64_t pid;
+  int64_t start_us;
+  // Counters, they only grow.
+  uint64_t lines;
+  uint64_t forks;
+  uint64_t execs;
+  uint64_t exec_failures;
+  uint64_t sigchlds;
+  uint64_t reaps;
+  // From the liner's exit to the shell reading its pid storage file,
+  // only for the liners which have not replaced themselves with their last command.
+  uint64_t reap_latency_us;
+  // Gauges, set by the shell only.
+  uint64_t reap_latency_max_us;
+  uint64_t live_jobs;
+  uint64_t suspended_jobs;
+  uint64_t history_size;
+} metrics_t;
+
+// NULL when the metrics are not published, as in one-shot mode.
+static metrics_t * metrics = NULL;
+static char metrics_filename[METRICS_FILENAME_SIZE] = "";
+
+#define METRICS_ADD( counter, value )                                                  \
+  {                                                                                    \
+    if ( metrics != NULL )                                                             \
+    {                                                                                  \
+      __atomic_fetch_add( &metrics->counter, ( uint64_t )( value ), __ATOMIC_RELAXED ); \
+    }                                                                                  \
+  }
+
+#define METRICS_SET( gauge, value )                                                \
+  {                                                                                \
+    if ( metrics != NULL )                                                         \
+    {                                                                              \
+      __atomic_store_n( &metrics->gauge, ( uint64_t )( value ), __ATOMIC_RELAXED ); \
+    }                                                                              \
+  }
+
+// Creates the shell's segment, without it msh works the same, just unobserved.
+static void metrics_init()
+{
+  snprintf( metrics_filename,
+            sizeof( metrics_filename ),
+            "%s/%s%d",
+            METRICS_DIR,
+            METRICS_PREFIX,
+            getpid() );
+  int fd = open( metrics_filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+  if ( fd == -1 )
+  {
+    LOG( "Failed to create metrics segment %s", metrics_filename );
+    metrics_filename[0] = '\0';
+    return;
+  }
+  void * segment = MAP_FAILED;
+  if ( ftruncate( fd, sizeof( metrics_t ) ) == 0 )
+  {
+    segment = mmap( NULL, sizeof( metrics_t ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  }
+  close( fd );
+  if ( segment == MAP_FAILED )
+  {
+    LOG( "Failed to map metrics segment %s", metrics_filename );
+    unlink( metrics_filename );
+    metrics_filename[0] = '\0';
+    return;
+  }
+  metrics = (metrics_t *)segment;
+  metrics->version = METRICS_VERSION;
+  metrics->pid = getpid();
+  metrics->start_us = get_realtime_us();
+  // Readers take the segment into account only after the magic is there.
+  __atomic_store_n( &metrics->magic, METRICS_MAGIC, __ATOMIC_RELEASE );
+}
+
+// Called by the shell on exit, its children have the segment mapped
+// until they are gone, but nobody can find it anymore.
+static void metrics_remove()
+{
+  if ( metrics_filename[0] != '\0' )
+  {
+    unlink( metrics_filename );
+    metrics_filename[0] = '\0';
+  }
+}
+
+// The shell reaped a liner which has left at exit_us.
+static void metrics_add_reap( long long exit_us )
+{
+  if ( metrics == NULL )
+  {
+    return;
+  }
+  long long latency_us = get_realtime_us() - exit_us;
+  if ( latency_us < 0 )
+  {
+    latency_us = 0;
+  }
+  METRICS_ADD( reaps, 1 );
+  METRICS_ADD( reap_latency_us, latency_us );
+  if ( (uint64_t)latency_us > metrics->reap_latency_max_us )
+  {
+    METRICS_SET( reap_latency_max_us, latency_us );
+  }
+}
+
+/*
+ * Viewer of the metrics, `msh --top [interval_ms [iterations]]`,
+ * or the same arguments to msh started through a link named mshtop.
+ */
+
+#define TOP_MAX_SHELLS 256
+#define TOP_DEFAULT_INTERVAL_MS 1000
+
+// Takes a copy of the segment at filename, returns false if it is not one of a live msh.
+static bool read_metrics_segment( const char * filename, metrics_t * values )
+{
+  int fd = open( filename, O_RDONLY | O_CLOEXEC );
+  if ( fd == -1 )
+  {
+    return false;
+  }
+  struct stat segment_stat;
+  void * segment = MAP_FAILED;
+  if ( fstat( fd, &segment_stat ) == 0 && (size_t)segment_stat.st_size >= sizeof( metrics_t ) )
+  {
+    segment = mmap( NULL, sizeof( metrics_t ), PROT_READ, MAP_SHARED, fd, 0 );
+  }
+  close( fd );
+  if ( segment == MAP_FAILED )
+  {
+    return false;
+  }
+  const metrics_t * shared = (const metrics_t *)segment;
+  bool valid = __atomic_load_n( &shared->magic, __ATOMIC_ACQUIRE ) == METRICS_MAGIC &&
+               shared->version == METRICS_VERSION;
+  if ( valid )
+  {
+    // Word by word, the same way the writers change them.
+    const uint64_t * source = (const uint64_t *)segment;
+    uint64_t * destination = (uint64_t *)values;
+    size_t iword;
+    for ( iword = 0; iword < sizeof( metrics_t ) / sizeof( uint64_t ); iword++ )
+    {
+      destination[iword] = __atomic_load_n( &source[iword], __ATOMIC_RELAXED );
+    }
+  }
+  munmap( segment, sizeof( metrics_t ) );
+  // The segment of a shell which was killed before it could remove it.
+  return valid && ( kill( (pid_t)values->pid, 0 ) == 0 || errno == EPERM );
+}
+
+static int compare_metrics_by_pid( const void * first, const void * second )
+{
+  int64_t first_pid = ( (const metrics_t *)first )->pid;
+  int64_t second_pid = ( (const metrics_t *)second )->pid;
+  return ( first_pid > second_pid ) - ( first_pid < second_pid );
+}
+
+// Reads the segments of all the shells on the host, sorted by pid.
+static size_t read_all_metrics( metrics_t * shells, size_t max_shells )
+{
+  DIR * dir = opendir( METRICS_DIR );
+  if ( dir == NULL )
+  {
+    return 0;
+  }
+  size_t shells_count = 0;
+  size_t prefix_len = strlen( METRICS_PREFIX );
+  struct dirent * entry;
+  while ( shells_count < max_shells && ( entry = readdir( dir ) ) != NULL )
+  {
+    if ( strncmp( entry->d_name, METRICS_PREFIX, prefix_len ) != 0 ||
+         strspn( entry->d_name + prefix_len, "0123456789" ) == 0 )
+    {
+      continue;
+    }
+    char filename[METRICS_FILENAME_SIZE + NAME_MAX];
+    snprintf( filename, sizeof( filename ), "%s/%s", METRICS_DIR, entry->d_name );
+    if ( read_metrics_segment( filename, &shells[shells_count] ) )
+    {
+      shells_count++;
+    }
+  }
+  closedir( dir );
+  qsort( shells, shells_count, sizeof( metrics_t ), compare_metrics_by_pid );
+  return shells_count;
+}
+
+// Rate of the counter over the seconds since its previous value, "-" for no seconds.
+static void format_top_rate(
+    char * buf, size_t buf_size, uint64_t value, uint64_t previous_value, double seconds )
+{
+  if ( seconds <= 0 )
+  {
+    snprintf( buf, buf_size, "-" );
+    return;
+  }
+  snprintf( buf, buf_size, "%.1f", (double)( value - previous_value ) / seconds );
+}
+
+// Without the previous sample of the shell, there are no rates yet.
+static void print_top_line( const metrics_t * shell, const metrics_t * previous, double seconds )
+{
+  static const metrics_t no_metrics;
+  if ( previous == NULL )
+  {
+    previous = &no_metrics;
+    seconds = 0;
+  }
+  long long uptime_s = ( get_realtime_us() - shell->start_us ) / 1000000;
+  char uptime[32];
+  snprintf( uptime,
+            sizeof( uptime ),
+            "%lld:%02lld:%02lld",
+            uptime_s / 3600,
+            uptime_s / 60 % 60,
+            uptime_s % 60 );
+
+  char lines_rate[16];
+  char forks_rate[16];
+  char execs_rate[16];
+  char sigchlds_rate[16];
+  format_top_rate( lines_rate, sizeof( lines_rate ), shell->lines, previous->lines, seconds );
+  format_top_rate( forks_rate, sizeof( forks_rate ), shell->forks, previous->forks, seconds );
+  format_top_rate( execs_rate, sizeof( execs_rate ), shell->execs, previous->execs, seconds );
+  format_top_rate( sigchlds_rate, sizeof( sigchlds_rate ), shell->sigchlds, previous->sigchlds, seconds );
+
+  double reap_average_ms = shell->reaps ? (double)shell->reap_latency_us / (double)shell->reaps / 1000 : 0;
+  printf( "%7lld %10s %7llu %7s %7s %7s %6llu %5llu %5llu %9s %8.2f %8.2f %5llu\n",
+          (long long)shell->pid,
+          uptime,
+          (unsigned long long)shell->lines,
+          lines_rate,
+          forks_rate,
+          execs_rate,
+          (unsigned long long)shell->exec_failures,
+          (unsigned long long)shell->live_jobs,
+          (unsigned long long)shell->suspended_jobs,
+          sigchlds_rate,
+          reap_average_ms,
+          (double)shell->reap_latency_max_us / 1000,
+          (unsigned long long)shell->history_size );
+}
+
+// Shows the shells every interval_ms, until interrupted or for the given number of iterations.
+static int run_top( int interval_ms, int iterations )
+{
+  static metrics_t shells[TOP_MAX_SHELLS];
+  static metrics_t previous_shells[TOP_MAX_SHELLS];
+  size_t previous_count = 0;
+  struct timespec previous_time;
+  clock_gettime( CLOCK_MONOTONIC, &previous_time );
+  bool on_terminal = isatty( STDOUT_FILENO );
+  int iteration;
+  for ( iteration = 0; iterations <= 0 || iteration < iterations; iteration++ )
+  {
+    if ( iteration > 0 )
+    {
+      poll( NULL, 0, interval_ms );
+    }
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    double seconds = (double)( now.tv_sec - previous_time.tv_sec ) +
+                     (double)( now.tv_nsec - previous_time.tv_nsec ) / 1e9;
+    previous_time = now;
+
+    size_t shells_count = read_all_metrics( shells, TOP_MAX_SHELLS );
+    if ( on_terminal )
+    {
+      printf( "\033[H\033[2J" );
+    }
+    printf( "%7s %10s %7s %7s %7s %7s %6s %5s %5s %9s %8s %8s %5s\n",
+            "PID",
+            "UPTIME",
+            "LINES",
+            "LINES/s",
+            "FORKS/s",
+            "EXECS/s",
+            "EFAIL",
+            "JOBS",
+            "SUSP",
+            "SIGCHLD/s",
+            "REAP ms",
+            "MAX ms",
+            "HIST" );
+    size_t ishell;
+    for ( ishell = 0; ishell < shells_count; ishell++ )
+    {
+      // A pid reused by another shell is a new shell.
+      const metrics_t * previous = NULL;
+      size_t iprevious;
+      for ( iprevious = 0; iprevious < previous_count && previous == NULL; iprevious++ )
+      {
+        if ( previous_shells[iprevious].pid == shells[ishell].pid &&
+             previous_shells[iprevious].start_us == shells[ishell].start_us )
+        {
+          previous = &previous_shells[iprevious];
+        }
+      }
+      print_top_line( &shells[ishell], previous, seconds );
+    }
+    fflush( stdout );
+    memcpy( previous_shells, shells, shells_count * sizeof( metrics_t ) );
+    previous_count = shells_count;
+  }
+  return EXIT_SUCCESS;
+}
+
+// Special codes for a worker to exit.
+// It worth noting that when any command from execvp returns with the same code,
+// our worker returns with EXIT_FAILURE (=1),
+// which should not be equal to the special codes below.
+typedef enum worker_exit_code_t
+{
+  MSH_EXIT_ALL = 4,
+  MSH_EXIT_BG = 5,
+  // The command was killed after its deadline, the same status as timeout(1) has.
+  MSH_EXIT_TIMEOUT = 124
+} worker_exit_code_t;
+
+// This flag will be set, if worker's job is finished - so that in the main flow
+// (not signal handling) the liner will now if he still need to pause().
+static bool last_worker_exited = true;
+
+// The same flag for being sure we have to put shell into sleep.
+static bool last_liner_exited = true;
+
+// Some kind of limitation, but no idea how to surpass it in an easy way.
+// In a nutshell, we have to share C-string of the current working directory
+// between different processes of msh. We are doing it through file sharing.
+#define MAX_CWD_SIZE 255
+
+static pid_t msh_pgid = -1;
+
+#define CWD_STORAGE_FILENAME_SIZE 30
+static char cwd_storage_filename[CWD_STORAGE_FILENAME_SIZE] = "/tmp/msh_cwd_";
+
+// Set new current working directory.
+static void set_cwd( char * new_cwd )
+{
+  if ( one_shot_mode )
+  {
+    return;
+  }
+  FILE * f = fopen( cwd_storage_filename, "w" );
+  fprintf( f, "%s", new_cwd );
+  fclose( f );
+}
+
+// Will try to change current working directory to new_dir,
+// returning 0 on success, -1 on failure.
+static int try_change_directory( const char * new_dir )
+{
+  LOG( "Changing directory to %s", new_dir );
+  int exit_code = chdir( new_dir );
+  if ( exit_code != 0 )
+  {
+    ERROR( "cd: Error occured\n" );
+    return -1;
+  }
+
+  char * cwd = get_current_dir_name();
+  set_cwd( cwd );
+  free( cwd );
+  return 0;
+}
+
+// Update this process' current working directory,
+// taken from file cwd_storage_filename.
+static void update_cwd()
+{
+  if ( one_shot_mode )
+  {
+    return;
+  }
+  FILE * f = fopen( cwd_storage_filename, "r" );
+  char * cwd = (char *)malloc( MAX_CWD_SIZE );
+  memset( cwd, 0, MAX_CWD_SIZE );
+  int fscanf_result = fscanf( f, "%s", cwd );
+  if ( fscanf_result <= 0 )
+  {
+    ERROR( "Bad format for current working directory" );
+    if ( my_process_type != PROCESS_TYPE_SHELL )
+    {
+      free_and_exit( EXIT_FAILURE );
+    }
+  }
+  fclose( f );
+
+  int chdir_ret_code = chdir( cwd );
+  if ( chdir_ret_code == -1 )
+  {
+    ERROR( "Error with chdir" );
+    if ( my_process_type != PROCESS_TYPE_SHELL )
+    {
+      free_and_exit( EXIT_FAILURE );
+    }
+  }
+  free( cwd );
+}
+
+// Shell variables are kept in a hash table with chaining.
+// Every exported variable goes into the environment of executed commands.
+#define VARIABLES_TABLE_SIZE 256
+
+typedef struct variable_t
+{
+  // Next variable with the same hash in the bucket.
+  struct variable_t * next_variable;
+  char * name;
+  char * value;
+  bool exported;
+} variable_t;
+
+static variable_t * variables_table[VARIABLES_TABLE_SIZE];
+
+// envp array made of exported variables, passed straight to execve().
+// It is rebuilt only after some variable has changed, otherwise forked
+// processes just share it with the shell (copy-on-write pages).
+static char ** cached_envp = NULL;
+static bool cached_envp_dirty = true;
+
+// FNV-1a hash of the variable name.
+static size_t hash_variable_name( const char * name )
+{
+  size_t hash = 2166136261u;
+  for ( ; *name; name++ )
+  {
+    hash = ( hash ^ (unsigned char)*name ) * 16777619u;
+  }
+  return hash % VARIABLES_TABLE_SIZE;
+}
+
+static variable_t * find_variable( const char * name )
+{
+  variable_t * variable = variables_table[hash_variable_name( name )];
+  while ( variable != NULL && strcmp( variable->name, name ) != 0 )
+  {
+    variable = variable->next_variable;
+  }
+  return variable;
+}
+
+// Returns value of the variable or NULL, if it is not set.
+static const char * get_variable( const char * name )
+{
+  variable_t * variable = find_variable( name );
+  return variable ? variable->value : NULL;
+}
+
+// Creates or overwrites the variable.
+static void set_variable( const char * name, const char * value, bool exported )
+{
+  variable_t * variable = find_variable( name );
+  if ( variable == NULL )
+  {
+    size_t bucket = hash_variable_name( name );
+    variable = (variable_t *)malloc( sizeof( variable_t ) );
+    variable->name = strdup( name );
+    variable->value = NULL;
+    variable->exported = false;
+    variable->next_variable = variables_table[bucket];
+    variables_table[bucket] = variable;
+  }
+  else if ( variable->value != NULL && strcmp( variable->value, value ) == 0 &&
+            variable->exported == exported )
+  {
+    // Nothing changes, so envp can stay as it is.
+    return;
+  }
+
+  free( variable->value );
+  variable->value = strdup( value );
+  // Changes of the variables not in the environment keep envp as it is.
+  if ( exported || variable->exported )
+  {
+    cached_envp_dirty = true;
+  }
+  variable->exported = exported;
+}
+
+static void unset_variable( const char * name )
+{
+  variable_t ** link = &variables_table[hash_variable_name( name )];
+  while ( *link != NULL )
+  {
+    variable_t * variable = *link;
+    if ( strcmp( variable->name, name ) == 0 )
+    {
+      *link = variable->next_variable;
+      free( variable->name );
+      free( variable->value );
+      free( variable );
+      cached_envp_dirty = true;
+      return;
+    }
+    link = &variable->next_variable;
+  }
+}
+
+// Valid names are the same as in POSIX shells: [A-Za-z_][A-Za-z0-9_]*
+static bool is_valid_variable_name( const char * name )
+{
+  if ( !isalpha( *name ) && *name != '_' )
+  {
+    return false;
+  }
+  for ( ; *name; name++ )
+  {
+    if ( !isalnum( *name ) && *name != '_' )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void free_cached_envp()
+{
+  if ( cached_envp == NULL )
+  {
+    return;
+  }
+  char ** entry;
+  for ( entry = cached_envp; *entry; entry++ )
+  {
+    free( *entry );
+  }
+  free( cached_envp );
+  cached_envp = NULL;
+  cached_envp_dirty = true;
+}
+
+// Returns envp for execve(), rebuilding it only if variables have changed.
+static char ** get_envp()
+{
+  if ( !cached_envp_dirty && cached_envp != NULL )
+  {
+    return cached_envp;
+  }
+  free_cached_envp();
+
+  size_t exported_count = 0;
+  size_t bucket;
+  variable_t * variable;
+  for ( bucket = 0; bucket < VARIABLES_TABLE_SIZE; bucket++ )
+  {
+    for ( variable = variables_table[bucket]; variable; variable = variable->next_variable )
+    {
+      exported_count += variable->exported ? 1 : 0;
+    }
+  }
+
+  cached_envp = (char **)malloc( ( exported_count + 1 ) * sizeof( char * ) );
+  size_t ienv = 0;
+  for ( bucket = 0; bucket < VARIABLES_TABLE_SIZE; bucket++ )
+  {
+    for ( variable = variables_table[bucket]; variable; variable = variable->next_variable )
+    {
+      if ( variable->exported )
+      {
+        size_t entry_size = strlen( variable->name ) + strlen( variable->value ) + 2;
+        cached_envp[ienv] = (char *)malloc( entry_size );
+        snprintf( cached_envp[ienv], entry_size, "%s=%s", variable->name, variable->value );
+        ienv++;
+      }
+    }
+  }
+  cached_envp[ienv] = NULL;
+  cached_envp_dirty = false;
+
+  LOG( "Rebuilt envp with %lu variables", exported_count );
+  return cached_envp;
+}
+
+// Fill the variables table from the environment msh was started with.
+static void init_variables()
+{
+  extern char ** environ;
+  char ** entry;
+  for ( entry = environ; *entry; entry++ )
+  {
+    char * separator = strchr( *entry, '=' );
+    if ( separator == NULL )
+    {
+      continue;
+    }
+    char * name = strndup( *entry, ( size_t )( separator - *entry ) );
+    set_variable( name, separator + 1, true );
+    free( name );
+  }
+
+  // The inherited PATH is kept, the assignment's searching order is only the fallback.
+  if ( get_variable( "PATH" ) == NULL )
+  {
+    set_variable( "PATH", DEFAULT_SEARCH_PATH, true );
+  }
+}
+
+static void free_variables()
+{
+  size_t bucket;
+  for ( bucket = 0; bucket < VARIABLES_TABLE_SIZE; bucket++ )
+  {
+    while ( variables_table[bucket] != NULL )
+    {
+      variable_t * variable = variables_table[bucket];
+      variables_table[bucket] = variable->next_variable;
+      free( variable->name );
+      free( variable->value );
+      free( variable );
+    }
+  }
+  free_cached_envp();
+}
+
+// export and unset are run by a worker, so the changes are passed to the liner
+// and the shell the same way as current working directory - through a file.
+// It is a log of records "E NAME=VALUE" and "U NAME", every process replays
+// only the records it has not seen yet.
+#define VARIABLES_LOG_FILENAME_SIZE 30
+static char variables_log_filename[VARIABLES_LOG_FILENAME_SIZE] = "/tmp/msh_env_";
+static off_t variables_log_offset = 0;
+
+static void apply_variables_record( char * record )
+{
+  char * name = record + 2;
+  if ( strncmp( record, "E ", 2 ) == 0 )
+  {
+    char * separator = strchr( name, '=' );
+    if ( separator != NULL )
+    {
+      *separator = '\0';
+      set_variable( name, separator + 1, true );
+    }
+  }
+  else if ( strncmp( record, "U ", 2 ) == 0 )
+  {
+    unset_variable( name );
+  }
+  else
+  {
+    LOG( "Bad variables record: %s", record );
+  }
+}
+
+// Save a record about changed variable, so other msh processes will see it.
+static void log_variables_record( const char * record )
+{
+  if ( one_shot_mode )
+  {
+    // The change is done right in the liner, nobody else to tell about it.
+    char * record_copy = strdup( record );
+    apply_variables_record( record_copy );
+    free( record_copy );
+    return;
+  }
+  FILE * f = fopen( variables_log_filename, "a" );
+  if ( f == NULL )
+  {
+    ERROR( "Failed to save variable" );
+    return;
+  }
+  fprintf( f, "%s\n", record );
+  fclose( f );
+}
+
+// Update this process' variables with the records other processes have saved.
+static void update_variables()
+{
+  struct stat log_stat;
+  if ( one_shot_mode || stat( variables_log_filename, &log_stat ) != 0 ||
+       log_stat.st_size <= variables_log_offset )
+  {
+    return;
+  }
+
+  FILE * f = fopen( variables_log_filename, "r" );
+  if ( f == NULL )
+  {
+    return;
+  }
+  fseek( f, variables_log_offset, SEEK_SET );
+
+  char * record = NULL;
+  size_t record_capacity = 0;
+  ssize_t record_len;
+  while ( ( record_len = getline( &record, &record_capacity, f ) ) > 0 )
+  {
+    if ( record[record_len - 1] == '\n' )
+    {
+      record[record_len - 1] = '\0';
+    }
+    apply_variables_record( record );
+  }
+  variables_log_offset = ftell( f );
+  free( record );
+  fclose( f );
+}
+
+// Another kind of dirty hack decision to use files for sharing info between
+// liner and shell. With sockets the code would become much-much more complicated
+// (and it is over 1k LOC already!)
+#define PID_STORAGE_FILENAME_SIZE 40
+static char pid_storage_suffix[PID_STORAGE_FILENAME_SIZE] = "/tmp/msh_pid_";
+
+// Shared between liner and shell - C-string with command line tokens and semicolons,
 // with a space character as a delimiter.
 static char * cmd_line;
 
-// Maximum number of tokens is MAX_NUM_ARGUMENTS,
-// +1 for a NULL string for passing properly into exec().
+// Maximum number of tokens is MAX_NUM_ARGUMENTS,
+// +1 for a NULL string for passing properly into exec().
+
+// Should initialize by zero as they are in static memory.
+static char * tokens[MAX_NUM_ARGUMENTS + 1];
+
+// Free current set of tokens for current process.
+static void free_tokens()
+{
+  char ** token;
+  for ( token = tokens; *token; token++ )
+  {
+    free( *token );
+    *token = NULL;
+  }
+}
+
+// Free resources used in current command line input iteration.
+// We only need to take of variables created with malloc().
+// Here-documents of the line, defined together with the liner.
+static void free_here_documents();
+
+static void free_current_input_resources()
+{
+  free_tokens();
+  free( cmd_line );
+  cmd_line = NULL;
+  free_here_documents();
+}
+
+// Size of the buffer normalize_command_line() needs for cmd_str_len bytes of input:
+// every symbol can take a space after it (as in "a;a;" -> "a ; a ;"),
+// plus the null-terminating byte.
+#define NORMALIZED_LINE_SIZE( cmd_str_len ) ( 2 * ( cmd_str_len ) + 1 )
+
+// Make a clean command line out of the user's input: tokens and semicolons
+// separated by single spaces, with no spaces at the beginning and at the end.
+// cmd_line should have NORMALIZED_LINE_SIZE( cmd_str_len ) bytes,
+// returns the length of the result.
+// This is the reference version, the vectorized ones below must give the same.
+static size_t normalize_command_line_scalar( const char * cmd_str, size_t cmd_str_len, char * cmd_line )
+{
+  size_t i;
+  size_t cmd_line_len = 0;
+  bool is_first_token = true;
+  for ( i = 0; i < cmd_str_len; i++ )
+  {
+    char c = cmd_str[i];
+
+    if ( isspace( c ) )
+    {
+      continue;
+    }
+
+    if ( is_first_token )
+    {
+      is_first_token = false;
+    }
+    else
+    {
+      cmd_line[cmd_line_len++] = ' ';
+    }
+
+    if ( c == ';' )
+    {
+      cmd_line[cmd_line_len++] = ';';
+    }
+    else
+    {
+      while ( i < cmd_str_len && !isspace( cmd_str[i] ) && cmd_str[i] != ';' )
+      {
+        // put current token fully to cmd_line and wait for the next non-token symbol.
+        cmd_line[cmd_line_len++] = cmd_str[i++];
+      }
+
+      if ( i < cmd_str_len && cmd_str[i] == ';' )
+      {
+        cmd_line[cmd_line_len++] = ' ';
+        cmd_line[cmd_line_len++] = ';';
+      }
+    }
+  }
+  cmd_line[cmd_line_len] = '\0';
+  return cmd_line_len;
+}
+
+// The vectorized versions classify the input 64 bytes at a time into bit masks
+// of whitespace and separators, using SSE2 or AVX2 compares, and copy whole
+// tokens with memcpy(). That pays off on long generated lines.
+// The best version the CPU supports is chosen on the first use, MSH_LEXER=scalar,
+// sse2 or avx2 forces one of them. msh --lex-diff compares them with the scalar one.
+typedef size_t ( *normalizer_t )( const char * cmd_str, size_t cmd_str_len, char * cmd_line );
+
+#define LEXER_BLOCK_SIZE 64
+
+// Sets bit i of the masks, if byte i of the block is whitespace
+// (the same as isspace() in the "C" locale msh runs in) or a separator (whitespace or ';').
+typedef void ( *lexer_classify_t )( const char * block, uint64_t * space_mask, uint64_t * separator_mask );
+
+// The normalization loop shared by the vectorized versions. It is inlined into
+// every one of them, so classify() is inlined and compiled for their instruction set.
+static inline __attribute__( ( always_inline ) ) size_t normalize_with_masks( const char * cmd_str,
+                                                                             size_t cmd_str_len,
+                                                                             char * cmd_line,
+                                                                             lexer_classify_t classify )
+{
+  size_t cmd_line_len = 0;
+  // The last token of the previous block may continue in this one.
+  bool in_token = false;
+  size_t block_start;
+  for ( block_start = 0; block_start < cmd_str_len; block_start += LEXER_BLOCK_SIZE )
+  {
+    const char * block = cmd_str + block_start;
+    uint64_t space_mask;
+    uint64_t separator_mask;
+    if ( cmd_str_len - block_start >= LEXER_BLOCK_SIZE )
+    {
+      classify( block, &space_mask, &separator_mask );
+    }
+    else
+    {
+      // The tail is padded with spaces, so every token ends inside the block.
+      char tail[LEXER_BLOCK_SIZE];
+      memset( tail, ' ', sizeof( tail ) );
+      memcpy( tail, block, cmd_str_len - block_start );
+      classify( tail, &space_mask, &separator_mask );
+    }
+
+    unsigned position = 0;
+    if ( in_token )
+    {
+      if ( separator_mask == 0 )
+      {
+        memcpy( cmd_line + cmd_line_len, block, LEXER_BLOCK_SIZE );
+        cmd_line_len += LEXER_BLOCK_SIZE;
+        continue;
+      }
+      position = (unsigned)__builtin_ctzll( separator_mask );
+      memcpy( cmd_line + cmd_line_len, block, position );
+      cmd_line_len += position;
+      in_token = false;
+    }
+
+    while ( position < LEXER_BLOCK_SIZE )
+    {
+      uint64_t not_space_mask = ~space_mask & ( ~0ULL << position );
+      if ( not_space_mask == 0 )
+      {
+        break;
+      }
+      position = (unsigned)__builtin_ctzll( not_space_mask );
+      if ( cmd_line_len > 0 )
+      {
+        cmd_line[cmd_line_len++] = ' ';
+      }
+      if ( ( separator_mask >> position ) & 1 )
+      {
+        cmd_line[cmd_line_len++] = ';';
+        position++;
+        continue;
+      }
+
+      uint64_t token_end_mask = separator_mask & ( ~0ULL << position );
+      unsigned token_end =
+          token_end_mask != 0 ? (unsigned)__builtin_ctzll( token_end_mask ) : LEXER_BLOCK_SIZE;
+      memcpy( cmd_line + cmd_line_len, block + position, token_end - position );
+      cmd_line_len += token_end - position;
+      in_token = token_end_mask == 0;
+      position = token_end;
+    }
+  }
+  cmd_line[cmd_line_len] = '\0';
+  return cmd_line_len;
+}
+
+#ifdef MSH_X86_LEXERS
+// Bytes from '\t' to '\r' are the ones, which are not above '\r' - '\t' after subtracting '\t'.
+__attribute__( ( target( "sse2" ) ) ) static inline void sse2_classify( const char * block,
+                                                                       uint64_t * space_mask,
+                                                                       uint64_t * separator_mask )
+{
+  *space_mask = 0;
+  *separator_mask = 0;
+  int ichunk;
+  for ( ichunk = 0; ichunk < LEXER_BLOCK_SIZE / 16; ichunk++ )
+  {
+    __m128i bytes = _mm_loadu_si128( (const __m128i *)( block + 16 * ichunk ) );
+    __m128i shifted = _mm_sub_epi8( bytes, _mm_set1_epi8( '\t' ) );
+    __m128i is_control_space =
+        _mm_cmpeq_epi8( _mm_min_epu8( shifted, _mm_set1_epi8( '\r' - '\t' ) ), shifted );
+    __m128i is_space = _mm_or_si128( is_control_space, _mm_cmpeq_epi8( bytes, _mm_set1_epi8( ' ' ) ) );
+    __m128i is_separator = _mm_or_si128( is_space, _mm_cmpeq_epi8( bytes, _mm_set1_epi8( ';' ) ) );
+    *space_mask |= (uint64_t)(unsigned)_mm_movemask_epi8( is_space ) << ( 16 * ichunk );
+    *separator_mask |= (uint64_t)(unsigned)_mm_movemask_epi8( is_separator ) << ( 16 * ichunk );
+  }
+}
+
+__attribute__( ( target( "sse2" ) ) ) static size_t normalize_command_line_sse2( const char * cmd_str,
+                                                                                size_t cmd_str_len,
+                                                                                char * cmd_line )
+{
+  return normalize_with_masks( cmd_str, cmd_str_len, cmd_line, sse2_classify );
+}
+
+// The same as sse2_classify() 32 bytes at a time.
+__attribute__( ( target( "avx2" ) ) ) static inline void avx2_classify( const char * block,
+                                                                       uint64_t * space_mask,
+                                                                       uint64_t * separator_mask )
+{
+  *space_mask = 0;
+  *separator_mask = 0;
+  int ichunk;
+  for ( ichunk = 0; ichunk < LEXER_BLOCK_SIZE / 32; ichunk++ )
+  {
+    __m256i bytes = _mm256_loadu_si256( (const __m256i *)( block + 32 * ichunk ) );
+    __m256i shifted = _mm256_sub_epi8( bytes, _mm256_set1_epi8( '\t' ) );
+    __m256i is_control_space =
+        _mm256_cmpeq_epi8( _mm256_min_epu8( shifted, _mm256_set1_epi8( '\r' - '\t' ) ), shifted );
+    __m256i is_space =
+        _mm256_or_si256( is_control_space, _mm256_cmpeq_epi8( bytes, _mm256_set1_epi8( ' ' ) ) );
+    __m256i is_separator =
+        _mm256_or_si256( is_space, _mm256_cmpeq_epi8( bytes, _mm256_set1_epi8( ';' ) ) );
+    *space_mask |= (uint64_t)(unsigned)_mm256_movemask_epi8( is_space ) << ( 32 * ichunk );
+    *separator_mask |= (uint64_t)(unsigned)_mm256_movemask_epi8( is_separator ) << ( 32 * ichunk );
+  }
+}
+
+__attribute__( ( target( "avx2" ) ) ) static size_t normalize_command_line_avx2( const char * cmd_str,
+                                                                                size_t cmd_str_len,
+                                                                                char * cmd_line )
+{
+  return normalize_with_masks( cmd_str, cmd_str_len, cmd_line, avx2_classify );
+}
+
+static bool is_sse2_supported()
+{
+  return __builtin_cpu_supports( "sse2" );
+}
+
+static bool is_avx2_supported()
+{
+  return __builtin_cpu_supports( "avx2" );
+}
+#endif
+
+static bool is_always_supported()
+{
+  return true;
+}
+
+typedef struct lexer_t
+{
+  const char * name;
+  normalizer_t normalize;
+  bool ( *is_supported )();
+} lexer_t;
+
+// From the slowest to the fastest.
+static const lexer_t lexers[] = {
+  { "scalar", normalize_command_line_scalar, is_always_supported },
+#ifdef MSH_X86_LEXERS
+  { "sse2", normalize_command_line_sse2, is_sse2_supported },
+  { "avx2", normalize_command_line_avx2, is_avx2_supported },
+#endif
+};
+
+#define LEXERS_COUNT ( sizeof( lexers ) / sizeof( lexers[0] ) )
+
+static const lexer_t * selected_lexer = NULL;
+
+static const lexer_t * select_lexer()
+{
+  const lexer_t * best_lexer = &lexers[0];
+  size_t ilexer;
+  for ( ilexer = 0; ilexer < LEXERS_COUNT; ilexer++ )
+  {
+    if ( lexers[ilexer].is_supported() )
+    {
+      best_lexer = &lexers[ilexer];
+    }
+  }
+
+  const char * requested_name = get_variable( "MSH_LEXER" );
+  if ( requested_name == NULL || requested_name[0] == '\0' )
+  {
+    return best_lexer;
+  }
+  for ( ilexer = 0; ilexer < LEXERS_COUNT; ilexer++ )
+  {
+    if ( strcmp( lexers[ilexer].name, requested_name ) == 0 && lexers[ilexer].is_supported() )
+    {
+      return &lexers[ilexer];
+    }
+  }
+  ERROR( "MSH_LEXER: %s is not available, using %s", requested_name, best_lexer->name );
+  return best_lexer;
+}
+
+static size_t normalize_command_line( const char * cmd_str, size_t cmd_str_len, char * cmd_line )
+{
+  if ( selected_lexer == NULL )
+  {
+    selected_lexer = select_lexer();
+    LOG( "Using %s lexer", selected_lexer->name );
+  }
+  return selected_lexer->normalize( cmd_str, cmd_str_len, cmd_line );
+}
+
+// Takes tokens of the next command from normalized cmd_line, starting at *position.
+// *position is moved past the command and its ';'.
+// Tokens are allocated with malloc() and followed by NULL, as exec() wants it.
+// Returns the number of tokens, or -1 if there are more than MAX_NUM_ARGUMENTS of them.
+static int tokenize_next_command( const char * cmd_line,
+                                  size_t cmd_len,
+                                  size_t * position,
+                                  char ** command_tokens )
+{
+  size_t i = *position;
+  int tokens_count = 0;
+  while ( i < cmd_len )
+  {
+    if ( cmd_line[i] == ' ' )
+    {
+      i++;
+      continue;
+    }
+
+    if ( cmd_line[i] == ';' )
+    {
+      // The command currently parsed is finished.
+      i++;
+      break;
+    }
+
+    // The line is normalized, so the token lasts until the next space.
+    size_t token_start = i;
+    const char * token_end = (const char *)memchr( cmd_line + i, ' ', cmd_len - i );
+    i = token_end != NULL ? ( size_t )( token_end - cmd_line ) : cmd_len;
+
+    if ( tokens_count == MAX_NUM_ARGUMENTS )
+    {
+      command_tokens[tokens_count] = NULL;
+      for ( tokens_count--; tokens_count >= 0; tokens_count-- )
+      {
+        free( command_tokens[tokens_count] );
+        command_tokens[tokens_count] = NULL;
+      }
+      *position = cmd_len;
+      return -1;
+    }
+
+    // allocate space for new token, don't forget about null-terminating byte
+    command_tokens[tokens_count++] = strndup( cmd_line + token_start, i - token_start );
+  }
+
+  // That is for the format for passing arguments to exec().
+  command_tokens[tokens_count] = NULL;
+  *position = i;
+  return tokens_count;
+}
+
+// Checking for command !n, where is n is a number from 1 to 99.
+// Returns n, or 0 if cmd_line is something else.
+static size_t parse_history_reference( const char * cmd_line, size_t cmd_line_len )
+{
+  if ( cmd_line_len < 2 || cmd_line_len > 3 || cmd_line[0] != '!' )
+  {
+    return 0;
+  }
+  if ( cmd_line_len == 2 && isdigit( cmd_line[1] ) )
+  {
+    return ( size_t )( cmd_line[1] - '0' );
+  }
+  if ( cmd_line_len == 3 && isdigit( cmd_line[1] ) && isdigit( cmd_line[2] ) )
+  {
+    return ( size_t )( ( cmd_line[1] - '0' ) * 10 + ( cmd_line[2] - '0' ) );
+  }
+  return 0;
+}
+
+// Run lexer stages over stdin, printing every normalized line and its
+// commands' tokens (msh --lex). It gives golden output for lexer changes
+// and a harness for fuzzers feeding stdin.
+static int run_lexer_dump()
+{
+  char * cmd_str = NULL;
+  size_t cmd_str_capacity = 0;
+  ssize_t cmd_str_len;
+  while ( ( cmd_str_len = getline( &cmd_str, &cmd_str_capacity, stdin ) ) != -1 )
+  {
+    char * normalized_line = (char *)malloc( NORMALIZED_LINE_SIZE( ( size_t )cmd_str_len ) );
+    size_t normalized_len = normalize_command_line( cmd_str, ( size_t )cmd_str_len, normalized_line );
+    printf( "> %s\n", normalized_line );
+    size_t history_reference = parse_history_reference( normalized_line, normalized_len );
+    if ( history_reference != 0 )
+    {
+      printf( "!%lu\n", history_reference );
+    }
+
+    char * command_tokens[MAX_NUM_ARGUMENTS + 1];
+    size_t position = 0;
+    while ( position < normalized_len )
+    {
+      int tokens_count =
+          tokenize_next_command( normalized_line, normalized_len, &position, command_tokens );
+      if ( tokens_count == -1 )
+      {
+        printf( "too many tokens\n" );
+        break;
+      }
+      int itoken;
+      for ( itoken = 0; itoken < tokens_count; itoken++ )
+      {
+        printf( itoken ? " [%s]" : "[%s]", command_tokens[itoken] );
+        free( command_tokens[itoken] );
+      }
+      printf( "\n" );
+    }
+    free( normalized_line );
+  }
+  free( cmd_str );
+  return EXIT_SUCCESS;
+}
+
+// Every lexer the CPU supports must give the same as the scalar one
+// (msh --lex-diff). Each line of stdin is checked from each of its first
+// 32 bytes, so the vector loops see it at all the alignments and tails.
+// Prints the lines they differ on, and fails if there are any.
+#define LEXER_DIFF_OFFSETS 32
+
+static int run_lexer_diff()
+{
+  char * cmd_str = NULL;
+  size_t cmd_str_capacity = 0;
+  ssize_t cmd_str_len;
+  size_t lines_count = 0;
+  size_t mismatches_count = 0;
+  while ( ( cmd_str_len = getline( &cmd_str, &cmd_str_capacity, stdin ) ) != -1 )
+  {
+    char * expected_line = (char *)malloc( NORMALIZED_LINE_SIZE( ( size_t )cmd_str_len ) );
+    char * normalized_line = (char *)malloc( NORMALIZED_LINE_SIZE( ( size_t )cmd_str_len ) );
+    size_t offset;
+    for ( offset = 0; offset < LEXER_DIFF_OFFSETS && offset <= ( size_t )cmd_str_len; offset++ )
+    {
+      const char * input = cmd_str + offset;
+      size_t input_len = ( size_t )cmd_str_len - offset;
+      size_t expected_len = normalize_command_line_scalar( input, input_len, expected_line );
+      size_t ilexer;
+      for ( ilexer = 1; ilexer < LEXERS_COUNT; ilexer++ )
+      {
+        if ( !lexers[ilexer].is_supported() )
+        {
+          continue;
+        }
+        size_t normalized_len = lexers[ilexer].normalize( input, input_len, normalized_line );
+        if ( normalized_len != expected_len || memcmp( normalized_line, expected_line, expected_len + 1 ) != 0 )
+        {
+          printf( "%s differs on line %lu from byte %lu:\n> %s\n< %s\n",
+                  lexers[ilexer].name,
+                  lines_count + 1,
+                  offset,
+                  expected_line,
+                  normalized_line );
+          mismatches_count++;
+        }
+      }
+    }
+    free( expected_line );
+    free( normalized_line );
+    lines_count++;
+  }
+  free( cmd_str );
+
+  printf( "lines: %lu, mismatches: %lu, lexers:", lines_count, mismatches_count );
+  size_t ilexer;
+  for ( ilexer = 0; ilexer < LEXERS_COUNT; ilexer++ )
+  {
+    if ( lexers[ilexer].is_supported() )
+    {
+      printf( " %s", lexers[ilexer].name );
+    }
+  }
+  printf( "\n" );
+  return mismatches_count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static double elapsed_seconds( const struct timespec * start, const struct timespec * finish )
+{
+  return (double)( finish->tv_sec - start->tv_sec ) + (double)( finish->tv_nsec - start->tv_nsec ) / 1e9;
+}
+
+// Measure lexer stages over lines of stdin (msh --lex-bench [passes]),
+// reporting time per line and throughput.
+static int run_lexer_bench( int passes )
+{
+  char ** lines = NULL;
+  size_t * lines_len = NULL;
+  size_t lines_count = 0;
+  size_t lines_capacity = 0;
+  size_t total_bytes = 0;
+  size_t max_line_len = 0;
+
+  char * cmd_str = NULL;
+  size_t cmd_str_capacity = 0;
+  ssize_t cmd_str_len;
+  while ( ( cmd_str_len = getline( &cmd_str, &cmd_str_capacity, stdin ) ) != -1 )
+  {
+    if ( lines_count == lines_capacity )
+    {
+      lines_capacity = lines_capacity ? 2 * lines_capacity : 1024;
+      lines = (char **)realloc( lines, lines_capacity * sizeof( char * ) );
+      lines_len = (size_t *)realloc( lines_len, lines_capacity * sizeof( size_t ) );
+    }
+    lines[lines_count] = strndup( cmd_str, ( size_t )cmd_str_len );
+    lines_len[lines_count] = ( size_t )cmd_str_len;
+    total_bytes += ( size_t )cmd_str_len;
+    if ( ( size_t )cmd_str_len > max_line_len )
+    {
+      max_line_len = ( size_t )cmd_str_len;
+    }
+    lines_count++;
+  }
+  free( cmd_str );
+  if ( lines_count == 0 )
+  {
+    ERROR( "--lex-bench: no input lines" );
+    return EXIT_FAILURE;
+  }
+
+  char * normalized_line = (char *)malloc( NORMALIZED_LINE_SIZE( max_line_len ) );
+  char * command_tokens[MAX_NUM_ARGUMENTS + 1];
+  size_t tokens_total = 0;
+
+  struct timespec start_time, finish_time;
+  clock_gettime( CLOCK_MONOTONIC, &start_time );
+  int ipass;
+  for ( ipass = 0; ipass < passes; ipass++ )
+  {
+    size_t iline;
+    for ( iline = 0; iline < lines_count; iline++ )
+    {
+      size_t normalized_len = normalize_command_line( lines[iline], lines_len[iline], normalized_line );
+      size_t position = 0;
+      while ( position < normalized_len )
+      {
+        int tokens_count =
+            tokenize_next_command( normalized_line, normalized_len, &position, command_tokens );
+        int itoken;
+        for ( itoken = 0; itoken < tokens_count; itoken++ )
+        {
+          free( command_tokens[itoken] );
+        }
+        tokens_total += tokens_count > 0 ? ( size_t )tokens_count : 0;
+      }
+    }
+  }
+  clock_gettime( CLOCK_MONOTONIC, &finish_time );
+
+  double seconds = elapsed_seconds( &start_time, &finish_time );
+  double lines_processed = (double)lines_count * passes;
+  printf( "lexer: %s\n", selected_lexer->name );
+  printf( "lines: %lu, bytes: %lu, passes: %d, tokens: %lu\n",
+          lines_count, total_bytes, passes, tokens_total );
+  printf( "%.1f ns/line, %.1f MB/s\n",
+          seconds * 1e9 / lines_processed,
+          (double)total_bytes * passes / seconds / 1e6 );
+
+  size_t iline;
+  for ( iline = 0; iline < lines_count; iline++ )
+  {
+    free( lines[iline] );
+  }
+  free( lines );
+  free( lines_len );
+  free( normalized_line );
+  return EXIT_SUCCESS;
+}
+
+// This enum tells us in which state worker process
+// (the one that runs a single command) is in.
+// There also could be some WORKER_STATE_FINISHED,
+// but we are removing worker info as soon as it finishes,
+// So, WORKER_STATE_FINISHED would not be used anywhere.
+typedef enum worker_state_t
+{
+  WORKER_STATE_ACTIVE,
+  WORKER_STATE_SUSPENDED,
+  WORKER_STATE_BACKGROUND
+} worker_state_t;
+
+// Deadline of a job run with timeout. When it expires, the job's process group
+// gets SIGTERM, and if it is still there kill_after_ms later, SIGKILL.
+typedef enum deadline_stage_t
+{
+  DEADLINE_NONE,
+  DEADLINE_TERM,
+  DEADLINE_KILL
+} deadline_stage_t;
+
+typedef struct job_deadline_t
+{
+  deadline_stage_t stage;
+  // CLOCK_MONOTONIC time of the next signal.
+  struct timespec expires;
+  unsigned long kill_after_ms;
+  pid_t pgid;
+  bool timed_out;
+} job_deadline_t;
+
+// We are saving our current liner child's pid to be able to resume it,
+// when msh user asks for putting this liner's command into the background.
+static pid_t liner_child_pid = -1;
+typedef struct liner_job_t
+{
+  pid_t pid;
+  pid_t pgid;
+  worker_state_t state;
+  job_deadline_t deadline;
+  // Id of the job in the job queue, if it was submitted there, otherwise 0.
+  int queue_id;
+} liner_job_t;
+
+typedef struct liner_list_item_t
+{
+  // next_liner_list_item points at the liner,
+  // which was added before current liner_list.
+  struct liner_list_item_t * next_liner_list_item;
+
+  // Stored liner job's info.
+  liner_job_t * liner_job;
+} liner_list_item_t;
+
+// Pointer to the first liner in the list to be traversed.
+// By design, it is the last liner added.
+static liner_list_item_t * liner;
+
+// Create new liner job and put it into our liners list.
+static liner_job_t * add_liner_list_item( pid_t liner_pid )
+{
+  LOG( "Adding new_liner_list_item, pid %d", liner_pid );
+  assert( my_process_type == PROCESS_TYPE_SHELL );
+
+  liner_job_t * new_liner_job = (liner_job_t *)malloc( sizeof( liner_job_t ) );
+  new_liner_job->pid = liner_pid;
+  // Every liner leads the process group of its job.
+  new_liner_job->pgid = liner_pid;
+  new_liner_job->state = WORKER_STATE_ACTIVE;
+  memset( &new_liner_job->deadline, 0, sizeof( job_deadline_t ) );
+  new_liner_job->queue_id = 0;
+
+  liner_list_item_t * new_liner_list_item =
+      (liner_list_item_t *)malloc( sizeof( liner_list_item_t ) );
+  new_liner_list_item->next_liner_list_item = liner;
+  new_liner_list_item->liner_job = new_liner_job;
+  liner = new_liner_list_item;
+
+  return new_liner_job;
+}
+
+// Remove a liner info from list when its process finished.
+static void remove_liner_list_item( pid_t liner_pid )
+{
+  LOG( "Removing liner with pid %d", liner_pid );
+  liner_list_item_t * current_item = liner;
+
+  // previous_item preserves the liner_list_item which points at our
+  // liner_list_item to be deleted. We have to update next element links,
+  // when removing an item from a list.
+  liner_list_item_t * previous_item = NULL;
+
+  // Traversing the list, trying to find item with liner_job->pid = liner_pid.
+  while ( current_item != NULL )
+  {
+    liner_job_t * liner_job = current_item->liner_job;
+    if ( liner_job->pid == liner_pid )
+    {
+      if ( previous_item != NULL )
+      {
+        previous_item->next_liner_list_item = current_item->next_liner_list_item;
+      }
+      else
+      {
+        assert( current_item == liner );
+        liner = current_item->next_liner_list_item;
+      }
+
+      free( liner_job );
+      free( current_item );
+
+      return;
+    }
+
+    previous_item = current_item;
+    current_item = current_item->next_liner_list_item;
+  }
+
+  ERROR( "Not found liner with pid %d", liner_pid );
+}
+
+// Free the whole list of liners info structures.
+// To be called on msh's exit.
+static char * get_pid_storage_filename( pid_t liner_pid );
+static void save_record_line_with_liner( const char * line );
+
+static void free_liner_list()
+{
+  liner_list_item_t * current_item = liner;
+  // Traversing the list, trying to find item with liner_job->pid = liner_pid.
+  // No need in previous_item here, as we are not modifying the list.
+
+  while ( current_item != NULL )
+  {
+    liner_list_item_t * next_item = current_item->next_liner_list_item;
+    liner_job_t * liner_job = current_item->liner_job;
+
+    // When the item found, send some stopping signal to him
+    // and free resources associated with it.
+    if ( my_process_type == PROCESS_TYPE_SHELL )
+    {
+      // Kill our jobs - suspended and the ones put to the background.
+      kill( -liner_job->pgid, SIGKILL );
+      char * pid_storage_filename = get_pid_storage_filename( liner_job->pid );
+      unlink( pid_storage_filename );
+      free( pid_storage_filename );
+    }
+
+    free( liner_job );
+    free( current_item );
+    current_item = next_item;
+  }
+
+  liner = NULL;
+}
+
+// Find an item in liners list and return the liner job stored inside, or NULL on failure.
+static liner_job_t * get_liner_job_with_pid( pid_t liner_pid )
+{
+  liner_list_item_t * current_item = liner;
+  while ( current_item != NULL )
+  {
+    liner_job_t * liner_job = current_item->liner_job;
+    if ( liner_job->pid == liner_pid )
+    {
+      return liner_job;
+    }
+    current_item = current_item->next_liner_list_item;
+  }
+  LOG( "Not found liner with pid %d", liner_pid );
+  return NULL;
+}
+
+static liner_job_t * get_liner_job_with_state( worker_state_t state )
+{
+  liner_list_item_t * current_item = liner;
+  while ( current_item != NULL )
+  {
+    liner_job_t * liner_job = current_item->liner_job;
+    if ( liner_job->state == state )
+    {
+      return liner_job;
+    }
+    current_item = current_item->next_liner_list_item;
+  }
+  LOG( "Not found liner with state %d", (int)state );
+  return NULL;
+}
+
+// Counts the shell's jobs for the metrics segment.
+static void publish_job_metrics()
+{
+  size_t live_jobs = 0;
+  size_t suspended_jobs = 0;
+  liner_list_item_t * current_item;
+  for ( current_item = liner; current_item != NULL; current_item = current_item->next_liner_list_item )
+  {
+    live_jobs++;
+    if ( current_item->liner_job->state == WORKER_STATE_SUSPENDED )
+    {
+      suspended_jobs++;
+    }
+  }
+  METRICS_SET( live_jobs, live_jobs );
+  METRICS_SET( suspended_jobs, suspended_jobs );
+}
+
+// Caches used by Tab completion, defined together with line reading.
+static void free_completion_caches();
+
+// Descriptors watched by the shell's event loop.
+typedef void ( *fd_event_handler_t )( int fd, uint32_t events, void * data );
+static void watch_fd( int fd, uint32_t events, fd_event_handler_t handler, void * data );
+static void unwatch_fd( int fd );
+static void free_watched_fds();
+static void free_job_queue();
+static void poll_shell_events( int timeout_ms );
+
+// Frees all resources that could be allocated anywhere by malloc and not freed for sure.
+static void free_all_resources()
+{
+  free_liner_list();
+  free_current_input_resources();
+  free_variables();
+  free_completion_caches();
+  free_watched_fds();
+  free_job_queue();
+}
+
+static void free_and_exit( int retcode )
+{
+  LOG( "Exiting with code: %d\n", retcode );
+  trace_flush();
+  dump_log_ring_on_exit( get_variable( "MSH_LOG_FILE" ) );
+  if ( my_process_type == PROCESS_TYPE_SHELL )
+  {
+    unlink( variables_log_filename );
+    unlink( cwd_storage_filename );
+    metrics_remove();
+  }
+  else if ( my_process_type == PROCESS_TYPE_LINER && metrics != NULL )
+  {
+    // The shell measures how long it takes to notice that we are gone.
+    char exit_line[32];
+    snprintf( exit_line, sizeof( exit_line ), "E %lld\n", get_realtime_us() );
+    save_record_line_with_liner( exit_line );
+  }
+  free_all_resources();
+  exit( retcode );
+}
+
+// Returns filename, where the liner with pid=liner_pid saves the list of the pids
+// of the workers spawned with fork().
+// returned string should be freed after usage with free().
+static char * get_pid_storage_filename( pid_t liner_pid )
+{
+  char * pid_storage_filename = (char *)malloc( PID_STORAGE_FILENAME_SIZE );
+  memset( pid_storage_filename, 0, PID_STORAGE_FILENAME_SIZE );
+  snprintf( pid_storage_filename,
+            PID_STORAGE_FILENAME_SIZE,
+            "%s_%d",
+            pid_storage_suffix,
+            liner_pid );
+  return pid_storage_filename;
+}
+
+// Save currently spawned worker's pid.
+static void save_worker_pid_with_liner( pid_t child_pid )
+{
+  assert( my_process_type == PROCESS_TYPE_LINER );
+  if ( one_shot_mode )
+  {
+    return;
+  }
+  char * pid_storage_filename = get_pid_storage_filename( getpid() );
+
+  LOG( "Saving pid of worker: %d to %s", child_pid, pid_storage_filename );
+  FILE * f = fopen( pid_storage_filename, "a" );
+  if ( f == NULL )
+  {
+    LOG( "Failed to open pid_storage_filename \"%s\" for writing", pid_storage_filename )
+  }
+  else
+  {
+    fprintf( f, "%d\n", child_pid );
+    fclose( f );
+  }
+  free( pid_storage_filename );
+}
+
+// Returns true if the liner has replaced itself with its last command,
+// with the command's record started in tail_record.
+static bool save_liner_pids_with_shell( pid_t liner_pid, process_record_t * tail_record )
+{
+  bool tail_executed = false;
+  assert( my_process_type == PROCESS_TYPE_SHELL );
+  char * pid_storage_filename = get_pid_storage_filename( liner_pid );
+
+  LOG( "opening file with pids of liner %d and pid_storage_filename = %s",
+       liner_pid,
+       pid_storage_filename );
+  FILE * f = fopen( pid_storage_filename, "r" );
+  if ( f == NULL )
+  {
+    // Maybe there is no workers spawned.
+    // There are some commands running without a need of workers.
+    LOG( "Failed to open pid_storage_filename \"%s\" for reading", pid_storage_filename )
+  }
+  else
+  {
+    // Lines are pids of the workers as they are spawned,
+    // and their records as they finish.
+    char line[PROCESS_RECORD_LINE_SIZE];
+    while ( fgets( line, sizeof( line ), f ) != NULL )
+    {
+      process_record_t record;
+      if ( line[0] == 'R' )
+      {
+        if ( parse_process_record( line, &record ) )
+        {
+          add_process_record( &record );
+        }
+        continue;
+      }
+      if ( line[0] == 'X' )
+      {
+        tail_executed = parse_process_record( line, tail_record );
+        continue;
+      }
+      if ( line[0] == 'E' )
+      {
+        metrics_add_reap( atoll( line + 2 ) );
+        continue;
+      }
+
+      pid_t worker_pid = atoi( line );
+      LOG( "In the past liner %d spawned a worker with pid %d ", liner_pid, worker_pid );
+      if ( worker_pid != 0 )
+      {
+        add_pid_to_history( worker_pid );
+      }
+    }
+    fclose( f );
+    // The liner is gone, nobody is going to write there anymore.
+    unlink( pid_storage_filename );
+  }
+  free( pid_storage_filename );
+  return tail_executed;
+}
+
+// All the operations we need to do in the shell,
+// when the liner with pid=liner_pid is closing.
+// Returns true if the liner has executed its last command in place,
+// so its status is the command's own one rather than a liner's exit code.
+static bool take_leave_of_liner( pid_t liner_pid, int liner_status, const struct rusage * liner_usage )
+{
+  assert( my_process_type == PROCESS_TYPE_SHELL );
+
+  // Background jobs started by the queue do not end waiting for the foreground one.
+  bool foreground = liner && liner->liner_job->pid == liner_pid && liner->liner_job->queue_id == 0;
+  if ( foreground )
+  {
+    last_liner_exited = true;
+  }
+  // Whatever the job has run, it could have switched the branch.
+  prompt_branch_stale = true;
+  TRACE_ASYNC_END( "job", liner_pid );
+
+  liner_job_t * liner_job = get_liner_job_with_pid( liner_pid );
+  if ( liner_job != NULL && liner_job->deadline.timed_out )
+  {
+    ERROR( "Job %d timed out", liner_pid );
+    // Whatever is left of the job should not outlive its deadline.
+    if ( liner_job->deadline.stage == DEADLINE_KILL )
+    {
+      kill( -liner_job->pgid, SIGKILL );
+    }
+  }
+
+  // Saving workers' pids which were spawned by the liner.
+  process_record_t tail_record;
+  bool tail_executed = save_liner_pids_with_shell( liner_pid, &tail_record );
+  if ( tail_executed )
+  {
+    // The usage includes the commands the liner has run before this one.
+    complete_process_record( &tail_record, liner_status, liner_usage );
+    add_process_record( &tail_record );
+  }
+
+  if ( foreground )
+  {
+    if ( WIFSIGNALED( liner_status ) )
+    {
+      last_line_status = 128 + WTERMSIG( liner_status );
+    }
+    else
+    {
+      // bg reports itself with a special code, and it has succeeded.
+      int exit_code = WEXITSTATUS( liner_status );
+      last_line_status = !tail_executed && exit_code == MSH_EXIT_BG ? EXIT_SUCCESS : exit_code;
+    }
+  }
+
+  // Removing liner from liners list in order to keep memory usage low.
+  remove_liner_list_item( liner_pid );
+  return tail_executed;
+}
+
+typedef void ( *sighandler_t )( int );
+
+// SIGCHLD and SIGUSR1 stay blocked in the shell and in the liner, and are
+// delivered only while they wait in poll_shell_events(). So the handlers never
+// interrupt the main flow in the middle of malloc() or stdio, and a signal
+// coming right after a flag like last_liner_exited was checked still ends the wait.
+static void set_event_signals_blocked( bool blocked )
+{
+  sigset_t event_signals;
+  sigemptyset( &event_signals );
+  sigaddset( &event_signals, SIGCHLD );
+  sigaddset( &event_signals, SIGUSR1 );
+  sigprocmask( blocked ? SIG_BLOCK : SIG_UNBLOCK, &event_signals, NULL );
+}
+
+// Record the child's state change, reported by wait(), into the trace.
+static void trace_child_state_change( pid_t child_pid, int child_status )
+{
+  if ( trace_fd == -1 )
+  {
+    return;
+  }
+  char detail[TRACE_DETAIL_SIZE];
+  if ( WIFEXITED( child_status ) )
+  {
+    snprintf( detail, sizeof( detail ), "%d exited %d", child_pid, WEXITSTATUS( child_status ) );
+  }
+  else if ( WIFSIGNALED( child_status ) )
+  {
+    snprintf( detail, sizeof( detail ), "%d killed %d", child_pid, WTERMSIG( child_status ) );
+  }
+  else if ( WIFSTOPPED( child_status ) )
+  {
+    snprintf( detail, sizeof( detail ), "%d stopped %d", child_pid, WSTOPSIG( child_status ) );
+  }
+  else
+  {
+    snprintf( detail, sizeof( detail ), "%d continued", child_pid );
+  }
+  TRACE_INSTANT( "child state", detail );
+}
+
+// Invariant here: at any moment we can only have one active child.
+static void handle_liner_state_change( pid_t child_pid,
+                                       int child_status,
+                                       const struct rusage * child_usage )
+{
+  LOG( "child_status: %d, child_pid: %d", child_status, child_pid );
+  trace_child_state_change( child_pid, child_status );
+
+  liner_job_t * liner_job = get_liner_job_with_pid( child_pid );
+  if ( liner_job == NULL )
+  {
+    // It can happen if the liner fired a signal or ended
+    // before we added a liner job for it.
+    LOG( "Unstable state: liner with pid %d not found...", child_pid );
+    liner_job = add_liner_list_item( child_pid );
+  }
+
+  if ( WIFCONTINUED( child_status ) )
+  {
+    LOG( "Child %d continued", child_pid );
+    // Someone just continued our child through sending signal manually,
+    // assuming it's us. In the assignment there is not
+    // `put back to the foreground option, so we
+    // should put our child into background right away.
+
+    if ( liner_job->state != WORKER_STATE_SUSPENDED )
+    {
+      LOG( "Bad apriori status (%d) for child %d", (int)liner_job->state, child_pid );
+    }
+    liner_job->state = WORKER_STATE_BACKGROUND;
+  }
+  else if ( WIFEXITED( child_status ) )
+  {
+    // Child exited and we can react on that.
+    int child_exit_code = WEXITSTATUS( child_status );
+    LOG( "Child returned with exit code: %d", child_exit_code );
+
+    if ( take_leave_of_liner( child_pid, child_status, child_usage ) )
+    {
+      // Whatever the command has exited with, it is not a request to msh.
+      LOG( "Liner's last command returned %d", child_exit_code );
+    }
+    else if ( child_exit_code == MSH_EXIT_ALL )
+    {
+      free_and_exit( EXIT_SUCCESS );
+    }
+    else if ( child_exit_code == MSH_EXIT_BG )
+    {
+      // Find first suspended job and put it to the background.
+      liner_job_t * liner_job = get_liner_job_with_state( WORKER_STATE_SUSPENDED );
+      if ( liner_job )
+      {
+        LOG( "Continuing job with pid %d", liner_job->pid );
+        // All of the job, a worker can have its own children, like watch does.
+        kill( -liner_job->pgid, SIGCONT );
+      }
+      else
+      {
+        ERROR( "Did not found any job to continue" );
+      }
+    }
+    else if ( child_exit_code == EXIT_SUCCESS )
+    {
+      LOG( "Doing nothing, returning to the main loop after sleep() call" );
+    }
+    else if ( child_exit_code == MSH_EXIT_TIMEOUT )
+    {
+      LOG( "Liner's command was killed after its deadline" );
+    }
+    else
+    {
+      LOG( "Unexpected exit code from liner: %d", child_exit_code );
+    }
+  }
+  else if ( WIFSIGNALED( child_status ) || WIFSTOPPED( child_status ) )
+  {
+    int child_signal =
+        WIFSIGNALED( child_status ) ? WTERMSIG( child_status ) : WSTOPSIG( child_status );
+    switch ( child_signal )
+    {
+      case SIGCONT:
+        if ( liner_job->state != WORKER_STATE_SUSPENDED )
+        {
+          LOG( "Bad apriori status (%d) for child %d", (int)liner_job->state, child_pid );
+        }
+        liner_job->state = WORKER_STATE_BACKGROUND;
+        break;
+      case SIGTSTP:
+      case SIGSTOP:
+      case SIGTTIN:
+      case SIGTTOU:
+        if ( liner_job->state != WORKER_STATE_ACTIVE )
+        {
+          LOG( "Bad apriori status (%d) for child %d", (int)liner_job->state, child_pid );
+        }
+        else
+        {
+          last_line_status = 128 + child_signal;
+        }
+        liner_job->state = WORKER_STATE_SUSPENDED;
+        break;
+      case SIGKILL:
+      case SIGINT:
+        // Removing the child from our liners list,
+        // as it wont signal us anymore.
+        take_leave_of_liner( child_pid, child_status, child_usage );
+
+        break;
+      default:
+        // We don't know how to react to that signal sent to liner,
+        // let's just kill it.
+        ERROR( "Unexpected signal %d to child, killing it... %d", child_signal, child_pid );
+        kill( child_pid, SIGKILL );
+        take_leave_of_liner( child_pid, child_status, child_usage );
+        break;
+    }
+  }
+  else
+  {
+    LOG( "Unexpected liner's state change, resuming..." );
+  }
+}
+
+// Changes of several children can come with a single SIGCHLD,
+// so all of them are collected at once.
+static void sigchld_handler( int signal_num )
+{
+  LOG( "handling SIGCHLD in Shell" );
+  assert( signal_num == SIGCHLD );
+  assert( my_process_type == PROCESS_TYPE_SHELL );
+
+  METRICS_ADD( sigchlds, 1 );
+  update_cwd();
+  update_variables();
+  int child_status;
+  struct rusage child_usage;
+  pid_t child_pid;
+  while ( ( child_pid = wait4( -1, &child_status, WNOHANG | WUNTRACED | WCONTINUED, &child_usage ) ) >
+          0 )
+  {
+    if ( child_pid == prompt_helper_pid )
+    {
+      // It is not a job, its answer comes through a pipe.
+      prompt_helper_pid = -1;
+      continue;
+    }
+    if ( child_pid == prefetch_helper_pid )
+    {
+      // The same, it sends its counters.
+      prefetch_helper_pid = -1;
+      continue;
+    }
+    handle_liner_state_change( child_pid, child_status, &child_usage );
+  }
+  publish_job_metrics();
+}
+
+// Deadline of the command the liner is running in milliseconds, 0 if it has none.
+static unsigned long command_timeout_ms = 0;
+
+// Record of the running worker, completed when it is reaped.
+static process_record_t worker_record;
+
+// Appends a formatted record to the liner's pid storage file.
+static void save_record_line_with_liner( const char * line )
+{
+  char * pid_storage_filename = get_pid_storage_filename( getpid() );
+  int fd = open( pid_storage_filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600 );
+  if ( fd == -1 || write( fd, line, strlen( line ) ) == -1 )
+  {
+    LOG( "Failed to save the record to %s", pid_storage_filename );
+  }
+  if ( fd != -1 )
+  {
+    close( fd );
+  }
+  free( pid_storage_filename );
+}
+
+// Completes the worker's record and hands it to the shell.
+// Without the shell, the liner keeps it itself.
+static void save_worker_record( int child_status, const struct rusage * child_usage )
+{
+  complete_process_record( &worker_record, child_status, child_usage );
+  if ( one_shot_mode )
+  {
+    add_process_record( &worker_record );
+    return;
+  }
+
+  char line[PROCESS_RECORD_LINE_SIZE];
+  format_process_record( &worker_record, line, sizeof( line ) );
+  save_record_line_with_liner( line );
+}
+
+// Deadlines handling, defined together with the shell's event loop.
+static bool is_command_timed_out();
+static void start_command_deadline( pid_t worker_pid );
+static void cancel_command_deadline();
+
+// Liner should react on signals coming from his worker.
+// Unfortunately, there is a lot of code duplication,
+// but that is for clarity and simplicity.
+static void handle_worker_state_change( pid_t child_pid, int child_status, const struct rusage * child_usage )
+{
+  LOG( "child_status: %d", child_status );
+  trace_child_state_change( child_pid, child_status );
+  TRACE_ASYNC_END( "command", child_pid );
+  // The liner has only one worker at a time.
+  worker_record.pid = child_pid;
+  save_worker_record( child_status, child_usage );
+
+  // Child exited and we can react on that.
+  if ( WIFEXITED( child_status ) )
+  {
+    // Removing liner from liners list in order to keep memory usage low.
+    int child_exit_code = WEXITSTATUS( child_status );
+    LOG( "Child returned with exit code: %d", child_exit_code );
+
+    last_worker_exited = true;
+
+    switch ( child_exit_code )
+    {
+      case MSH_EXIT_BG:
+      case MSH_EXIT_ALL:
+        // Special exit codes should be passed over to the shell.
+        free_and_exit( child_exit_code );
+        break;
+      case EXIT_SUCCESS:
+        // Doing nothing, going to the next child
+        break;
+      default:
+        // Should fail the whole line. Without the shell,
+        // the status of the failed command is the status of msh.
+        free_and_exit( one_shot_mode ? child_exit_code : EXIT_FAILURE );
+        break;
+    }
+  }
+  else if ( WIFSIGNALED( child_status ) || WIFSTOPPED( child_status ) )
+  {
+    int child_signal =
+        WIFSIGNALED( child_status ) ? WTERMSIG( child_status ) :
+                                      WSTOPSIG( child_status );
+    switch ( child_signal )
+    {
+      case SIGCONT:
+        LOG( "Child received SIGCONT" );
+        break;
+      case SIGTSTP:
+        LOG( "Child received SIGTSTP, doing nothing..." );
+        break;
+      case SIGTERM:
+      case SIGKILL:
+        if ( command_timeout_ms != 0 && is_command_timed_out() )
+        {
+          free_and_exit( MSH_EXIT_TIMEOUT );
+        }
+        // fall through
+      default:
+        // We don't know how to react to that signal sent to worker.
+        if ( one_shot_mode )
+        {
+          // Reporting it as other shells do.
+          free_and_exit( 128 + child_signal );
+        }
+        ERROR( "Unexpected signal %d to child, killing it... %d", child_signal, child_pid );
+        kill( child_pid, SIGKILL );
+        free_and_exit( EXIT_FAILURE );
+        break;
+    }
+  }
+  else
+  {
+    LOG( "Unexpected worker's state change, exiting..." );
+    free_and_exit( EXIT_FAILURE );
+  }
+}
+
+// The worker being stopped or continued is not reported here, only its end.
+// SIGCHLD coming after the worker was already collected finds nothing to do.
+static void sigchld_handler_for_liner( int signal_num )
+{
+  LOG( "handling SIGCHLD in Liner" );
+  assert( signal_num == SIGCHLD );
+  assert( my_process_type == PROCESS_TYPE_LINER );
+  METRICS_ADD( sigchlds, 1 );
+
+  update_cwd();
+  update_variables();
+  int child_status;
+  struct rusage child_usage;
+  pid_t child_pid;
+  while ( ( child_pid = wait4( -1, &child_status, WNOHANG, &child_usage ) ) > 0 )
+  {
+    handle_worker_state_change( child_pid, child_status, &child_usage );
+  }
+}
+
+// SIGCONT handler for liner.
+static void sigcont_handler( int signal_num )
+{
+  assert( my_process_type == PROCESS_TYPE_LINER );
+  LOG( "sigcont_handler for liner." );
+
+  // Continue in background, putting ourselves into a separate group.
+  int pgid = getpid();
+  if ( setpgid( pgid, pgid ) == -1 )
+  {
+    ERROR( "Failed to create a separate process group" );
+    free_and_exit( EXIT_FAILURE );
+  }
+  kill( liner_child_pid, SIGCONT );
+}
+
+// Find executable file for command in directories listed in PATH variable.
+// Writes the full path into path_buf and returns 0 on success, -1 on failure.
+static int resolve_command_path( const char * command, char * path_buf, size_t path_buf_size )
+{
+  // Commands with slashes are not searched for, as in other shells.
+  if ( strchr( command, '/' ) != NULL )
+  {
+    snprintf( path_buf, path_buf_size, "%s", command );
+    return 0;
+  }
+
+  const char * search_path = get_variable( "PATH" );
+  if ( search_path == NULL )
+  {
+    search_path = DEFAULT_SEARCH_PATH;
+  }
+
+  const char * dir = search_path;
+  while ( true )
+  {
+    const char * dir_end = strchrnul( dir, ':' );
+    int dir_len = (int)( dir_end - dir );
+
+    // Empty directory in PATH means current working directory, as "." does.
+    if ( dir_len == 0 )
+    {
+      snprintf( path_buf, path_buf_size, "%s", command );
+    }
+    else
+    {
+      snprintf( path_buf, path_buf_size, "%.*s/%s", dir_len, dir, command );
+    }
+
+    struct stat file_stat;
+    if ( stat( path_buf, &file_stat ) == 0 && S_ISREG( file_stat.st_mode ) &&
+         access( path_buf, X_OK ) == 0 )
+    {
+      return 0;
+    }
+
+    if ( *dir_end == '\0' )
+    {
+      break;
+    }
+    dir = dir_end + 1;
+  }
+  return -1;
+}
+
+// Exit codes for commands which could not be executed, the same as in POSIX shells.
+#define EXIT_COMMAND_NOT_FOUND 127
+#define EXIT_COMMAND_NOT_EXECUTABLE 126
+
+// Replace the current process with external command argv[0].
+// Returns only on failure, after reporting it to the user, with the exit code to use.
+static int exec_external_command( char ** argv )
+{
+  char command_path[PATH_MAX];
+  if ( resolve_command_path( argv[0], command_path, sizeof( command_path ) ) == -1 )
+  {
+    METRICS_ADD( exec_failures, 1 );
+    ERROR( "%s: Command not found.", argv[0] );
+    return EXIT_COMMAND_NOT_FOUND;
+  }
+
+  LOG( "Executing %s", command_path );
+  TRACE_INSTANT( "exec", command_path );
+  METRICS_ADD( execs, 1 );
+  // Nothing survives execve(), so the trace and the log have to be saved now.
+  trace_flush();
+  dump_log_ring_on_exit( get_variable( "MSH_LOG_FILE" ) );
+  execve( command_path, argv, get_envp() );
+  if ( errno == ENOEXEC )
+  {
+    // Script without "#!" line, run it with /bin/sh the same way execvp() does.
+    size_t argc;
+    for ( argc = 0; argv[argc]; argc++ )
+      ;
+    char ** sh_argv = (char **)malloc( ( argc + 2 ) * sizeof( char * ) );
+    sh_argv[0] = "sh";
+    sh_argv[1] = command_path;
+    memcpy( sh_argv + 2, argv + 1, argc * sizeof( char * ) );
+    execve( "/bin/sh", sh_argv, get_envp() );
+    free( sh_argv );
+  }
+  METRICS_ADD( exec_failures, 1 );
+  switch ( errno )
+  {
+    case ENOENT:
+      ERROR( "%s: Command not found.", argv[0] );
+      return EXIT_COMMAND_NOT_FOUND;
+    default:
+      ERROR( "Error (%d) while trying to execute command: %s\n", errno, argv[0] );
+      return EXIT_COMMAND_NOT_EXECUTABLE;
+  }
+}
+
+// Formats an exit status as "exit N" or "signal N".
+static void format_wait_status( int status, char * buf, size_t buf_size )
+{
+  if ( WIFSIGNALED( status ) )
+  {
+    snprintf( buf, buf_size, "signal %d", WTERMSIG( status ) );
+  }
+  else
+  {
+    snprintf( buf, buf_size, "exit %d", WEXITSTATUS( status ) );
+  }
+}
+
+static void print_process_record_header()
+{
+  printf( "%3s %7s %-10s %8s %9s %9s %9s %9s %7s  %s\n",
+          "#",
+          "PID",
+          "STATUS",
+          "START",
+          "ELAPSED",
+          "USER",
+          "SYS",
+          "MAXRSS",
+          "MAJFLT",
+          "COMMAND" );
+}
+
+// listpids -l line: the pid and whatever was recorded about it.
+// Liners have no records, they just run the recorded commands.
+static void print_process_record( size_t index, pid_t pid )
+{
+  const process_record_t * record = find_process_record( pid );
+  if ( record == NULL )
+  {
+    printf( "%3lu %7d %s\n", index, pid, "-" );
+    return;
+  }
+
+  char status[16];
+  format_wait_status( record->status, status, sizeof( status ) );
+  char start[16];
+  time_t start_seconds = (time_t)( record->start_us / 1000000 );
+  struct tm start_tm;
+  localtime_r( &start_seconds, &start_tm );
+  strftime( start, sizeof( start ), "%H:%M:%S", &start_tm );
+  printf( "%3lu %7d %-10s %8s %8.3fs %8.3fs %8.3fs %8ldK %7ld  %s\n",
+          index,
+          pid,
+          status,
+          start,
+          ( record->end_us - record->start_us ) / 1e6,
+          record->user_us / 1e6,
+          record->system_us / 1e6,
+          record->max_rss_kb,
+          record->major_faults,
+          record->command );
+}
+
+#define DEFAULT_STATS_TOP_COUNT 5
+
+static int compare_records_by_cpu( const void * left, const void * right )
+{
+  const process_record_t * left_record = (const process_record_t *)left;
+  const process_record_t * right_record = (const process_record_t *)right;
+  long long left_cpu = left_record->user_us + left_record->system_us;
+  long long right_cpu = right_record->user_us + right_record->system_us;
+  return ( left_cpu < right_cpu ) - ( left_cpu > right_cpu );
+}
+
+static int compare_records_by_memory( const void * left, const void * right )
+{
+  const process_record_t * left_record = (const process_record_t *)left;
+  const process_record_t * right_record = (const process_record_t *)right;
+  return ( left_record->max_rss_kb < right_record->max_rss_kb ) -
+         ( left_record->max_rss_kb > right_record->max_rss_kb );
+}
+
+static void print_top_records( const char * title,
+                               process_record_t * records,
+                               size_t records_count,
+                               size_t top_count,
+                               int ( *compare )( const void *, const void * ) )
+{
+  qsort( records, records_count, sizeof( process_record_t ), compare );
+  printf( "Top %lu by %s:\n", top_count < records_count ? top_count : records_count, title );
+  printf( "%7s %9s %9s %-10s  %s\n", "PID", "CPU", "MAXRSS", "STATUS", "COMMAND" );
+  size_t irecord;
+  for ( irecord = 0; irecord < records_count && irecord < top_count; irecord++ )
+  {
+    char status[16];
+    format_wait_status( records[irecord].status, status, sizeof( status ) );
+    printf( "%7d %8.3fs %8ldK %-10s  %s\n",
+            records[irecord].pid,
+            ( records[irecord].user_us + records[irecord].system_us ) / 1e6,
+            records[irecord].max_rss_kb,
+            status,
+            records[irecord].command );
+  }
+}
+
+// stats [N]: totals of the recorded commands and top N of them by CPU and by memory.
+static void print_process_stats( size_t top_count )
+{
+  size_t records_count =
+      process_records_count < MAX_PROCESS_RECORDS ? process_records_count : MAX_PROCESS_RECORDS;
+  process_record_t records[MAX_PROCESS_RECORDS];
+  memcpy( records, process_records, records_count * sizeof( process_record_t ) );
+
+  long long user_us = 0;
+  long long system_us = 0;
+  size_t failed_count = 0;
+  size_t irecord;
+  for ( irecord = 0; irecord < records_count; irecord++ )
+  {
+    user_us += records[irecord].user_us;
+    system_us += records[irecord].system_us;
+    if ( records[irecord].status != 0 )
+    {
+      failed_count++;
+    }
+  }
+  printf( "Commands: %lu finished (%lu recorded), %lu failed, CPU %.3fs user %.3fs sys\n",
+          process_records_count,
+          records_count,
+          failed_count,
+          user_us / 1e6,
+          system_us / 1e6 );
+  if ( records_count == 0 )
+  {
+    return;
+  }
+  print_top_records( "CPU", records, records_count, top_count, compare_records_by_cpu );
+  print_top_records( "memory", records, records_count, top_count, compare_records_by_memory );
+}
+
+// Builtins, which change the state of msh itself, rather than print something.
+static bool is_state_builtin( const char * command )
+{
+  return strcmp( command, "cd" ) == 0 || strcmp( command, "exit" ) == 0 ||
+         strcmp( command, "quit" ) == 0 || strcmp( command, "bg" ) == 0 ||
+         strcmp( command, "export" ) == 0 || strcmp( command, "unset" ) == 0;
+}
+
+// Builtins run by run_builtin(), in a worker or in place of one.
+static bool is_builtin( const char * command )
+{
+  return is_state_builtin( command ) || strcmp( command, "history" ) == 0 ||
+         strcmp( command, "listpids" ) == 0 || strcmp( command, "showpids" ) == 0 ||
+         strcmp( command, "bench" ) == 0 || strcmp( command, "watch" ) == 0 ||
+         strcmp( command, "submit" ) == 0 || strcmp( command, "queue" ) == 0 ||
+         strcmp( command, "prefetch" ) == 0 || strcmp( command, "stats" ) == 0 ||
+         strcmp( command, "logdump" ) == 0 || strcmp( command, "xargs" ) == 0;
+}
+
+// Trivial utilities msh runs in-process, without fork() and exec():
+// echo, true, false, pwd, printf, test and [. They write to buffered stdout,
+// which is flushed before the next fork() and on exit. MSH_FORCE_EXTERNAL=1
+// makes msh run the binaries from PATH instead, when their exact behavior is needed.
+static bool is_fast_builtin( const char * command )
+{
+  const char * force_external = get_variable( "MSH_FORCE_EXTERNAL" );
+  if ( force_external != NULL && strcmp( force_external, "1" ) == 0 )
+  {
+    return false;
+  }
+  return strcmp( command, "echo" ) == 0 || strcmp( command, "true" ) == 0 ||
+         strcmp( command, "false" ) == 0 || strcmp( command, "pwd" ) == 0 ||
+         strcmp( command, "printf" ) == 0 || strcmp( command, "test" ) == 0 ||
+         strcmp( command, "[" ) == 0;
+}
+
+// Writes one backslash escape, escape points right after the backslash.
+// Octal escapes are \0nnn for echo and %b, and \nnn in printf's format.
+// Returns the count of characters consumed; stop is set by \c, which ends all the output.
+static size_t print_escape( const char * escape, bool octal_after_zero, bool * stop )
+{
+  static const char simple_escapes[] = "\\\\a\ab\be\033f\fn\nr\rt\tv\v";
+  size_t iescape;
+  for ( iescape = 0; simple_escapes[iescape] != '\0'; iescape += 2 )
+  {
+    if ( simple_escapes[iescape] == *escape )
+    {
+      putchar( simple_escapes[iescape + 1] );
+      return 1;
+    }
+  }
+
+  size_t consumed = 0;
+  int value = 0;
+  if ( *escape == 'c' )
+  {
+    *stop = true;
+    return 1;
+  }
+  else if ( *escape == 'x' && isxdigit( (unsigned char)escape[1] ) )
+  {
+    for ( consumed = 1; consumed < 3 && isxdigit( (unsigned char)escape[consumed] ); consumed++ )
+    {
+      int digit = tolower( (unsigned char)escape[consumed] );
+      value = value * 16 + ( isdigit( digit ) ? digit - '0' : digit - 'a' + 10 );
+    }
+  }
+  else if ( *escape >= '0' && *escape <= '7' )
+  {
+    size_t first_digit = octal_after_zero && *escape == '0' ? 1 : 0;
+    for ( consumed = first_digit;
+          consumed < first_digit + 3 && escape[consumed] >= '0' && escape[consumed] <= '7';
+          consumed++ )
+    {
+      value = value * 8 + escape[consumed] - '0';
+    }
+  }
+  else
+  {
+    // Not an escape after all, written as is.
+    putchar( '\\' );
+    if ( *escape == '\0' )
+    {
+      return 0;
+    }
+    putchar( *escape );
+    return 1;
+  }
+  putchar( value );
+  return consumed;
+}
+
+// Writes text interpreting backslash escapes, as echo -e and printf's %b do.
+// Returns false after \c.
+static bool print_escaped( const char * text )
+{
+  bool stop = false;
+  while ( *text != '\0' && !stop )
+  {
+    if ( *text == '\\' )
+    {
+      text++;
+      text += print_escape( text, true, &stop );
+    }
+    else
+    {
+      putchar( *text++ );
+    }
+  }
+  return !stop;
+}
+
+// echo [-neE] [string ...]
+// Options are recognized the way GNU echo does: only the leading words made of n, e and E.
+static int run_echo( char ** argv )
+{
+  bool newline = true;
+  bool escapes = false;
+  char ** arg = argv + 1;
+  for ( ; *arg && ( *arg )[0] == '-' && ( *arg )[1] != '\0' &&
+          strspn( *arg + 1, "neE" ) == strlen( *arg + 1 );
+        arg++ )
+  {
+    const char * option;
+    for ( option = *arg + 1; *option; option++ )
+    {
+      newline = newline && *option != 'n';
+      escapes = *option == 'e' || ( escapes && *option != 'E' );
+    }
+  }
+
+  char ** first_arg = arg;
+  for ( ; *arg; arg++ )
+  {
+    if ( arg != first_arg )
+    {
+      putchar( ' ' );
+    }
+    if ( !escapes )
+    {
+      fputs( *arg, stdout );
+    }
+    else if ( !print_escaped( *arg ) )
+    {
+      return EXIT_SUCCESS;
+    }
+  }
+  if ( newline )
+  {
+    putchar( '\n' );
+  }
+  return EXIT_SUCCESS;
+}
+
+static int run_pwd()
+{
+  char * cwd = get_current_dir_name();
+  if ( cwd == NULL )
+  {
+    ERROR( "pwd: %s", strerror( errno ) );
+    return EXIT_FAILURE;
+  }
+  puts( cwd );
+  free( cwd );
+  return EXIT_SUCCESS;
+}
+
+// Numeric argument of printf: a number in C notation, or 'c for the code of c.
+// Missing one is 0. Sets failed if the argument is not a valid number.
+static long long parse_printf_number( const char * arg, bool * failed )
+{
+  if ( arg == NULL )
+  {
+    return 0;
+  }
+  if ( arg[0] == '\'' || arg[0] == '"' )
+  {
+    return (unsigned char)arg[1];
+  }
+  char * end;
+  errno = 0;
+  long long value = strtoll( arg, &end, 0 );
+  if ( end == arg || *end != '\0' || errno != 0 )
+  {
+    ERROR( "printf: %s: invalid number", arg );
+    *failed = true;
+  }
+  return value;
+}
+
+// Appends a width or precision of printf's conversion to spec, taken from
+// the format or, for '*', from the next argument.
+static void take_printf_field_size( const char ** position,
+                                    char *** arg,
+                                    char * spec,
+                                    size_t * spec_len,
+                                    bool * failed )
+{
+  if ( **position == '*' )
+  {
+    ( *position )++;
+    int size = (int)parse_printf_number( **arg, failed );
+    *arg += **arg != NULL;
+    *spec_len += snprintf( spec + *spec_len, 12, "%d", size );
+    return;
+  }
+  while ( isdigit( (unsigned char)**position ) && *spec_len < 20 )
+  {
+    spec[( *spec_len )++] = *( *position )++;
+  }
+  while ( isdigit( (unsigned char)**position ) )
+  {
+    ( *position )++;
+  }
+}
+
+// printf format [arguments]
+// The format is reused while there are arguments left, as POSIX requires.
+static int run_printf( char ** argv )
+{
+  if ( argv[1] == NULL )
+  {
+    ERROR( "printf: usage: printf format [arguments]" );
+    return 2;
+  }
+
+  const char * format = argv[1];
+  char ** arg = argv + 2;
+  bool failed = false;
+  bool stop = false;
+  do
+  {
+    char ** pass_first_arg = arg;
+    const char * position = format;
+    while ( *position != '\0' && !stop )
+    {
+      if ( *position == '\\' )
+      {
+        position++;
+        position += print_escape( position, false, &stop );
+        continue;
+      }
+      if ( *position != '%' )
+      {
+        putchar( *position++ );
+        continue;
+      }
+      if ( position[1] == '%' )
+      {
+        putchar( '%' );
+        position += 2;
+        continue;
+      }
+
+      // The conversion is passed to printf() with its argument converted to a C type.
+      char spec[64];
+      size_t spec_len = 0;
+      spec[spec_len++] = *position++;
+      while ( *position != '\0' && strchr( "-+ #0", *position ) != NULL && spec_len < 8 )
+      {
+        spec[spec_len++] = *position++;
+      }
+      take_printf_field_size( &position, &arg, spec, &spec_len, &failed );
+      if ( *position == '.' )
+      {
+        spec[spec_len++] = *position++;
+        take_printf_field_size( &position, &arg, spec, &spec_len, &failed );
+      }
+
+      char conversion = *position;
+      if ( conversion == '\0' || strchr( "diouxXcsbfFeEgGaA", conversion ) == NULL )
+      {
+        ERROR( "printf: %%%c: invalid conversion", conversion );
+        return EXIT_FAILURE;
+      }
+      position++;
+      const char * value = *arg;
+      arg += *arg != NULL;
+
+      if ( conversion == 'd' || conversion == 'i' )
+      {
+        strcpy( spec + spec_len, "lld" );
+        printf( spec, parse_printf_number( value, &failed ) );
+      }
+      else if ( strchr( "ouxX", conversion ) != NULL )
+      {
+        sprintf( spec + spec_len, "ll%c", conversion );
+        printf( spec, (unsigned long long)parse_printf_number( value, &failed ) );
+      }
+      else if ( strchr( "fFeEgGaA", conversion ) != NULL )
+      {
+        sprintf( spec + spec_len, "%c", conversion );
+        char * end = NULL;
+        double number = value != NULL ? strtod( value, &end ) : 0;
+        if ( value != NULL && ( end == value || *end != '\0' ) )
+        {
+          ERROR( "printf: %s: invalid number", value );
+          failed = true;
+        }
+        printf( spec, number );
+      }
+      else if ( conversion == 'c' )
+      {
+        char character[2] = { value != NULL ? value[0] : '\0', '\0' };
+        strcpy( spec + spec_len, "s" );
+        printf( spec, character );
+      }
+      else if ( conversion == 's' )
+      {
+        strcpy( spec + spec_len, "s" );
+        printf( spec, value != NULL ? value : "" );
+      }
+      else
+      {
+        // %b: the argument's escapes are interpreted, width is not supported.
+        stop = value != NULL && !print_escaped( value );
+      }
+    }
+    // Without conversions taking arguments, the format is not reused.
+    if ( arg == pass_first_arg )
+    {
+      break;
+    }
+  } while ( *arg != NULL && !stop );
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// test expression, [ expression ]
+// Expressions of POSIX test, combined with !, -a, -o and parentheses.
+// The result is 0 for true, 1 for false and 2 for an error.
+typedef struct test_parser_t
+{
+  char ** args;
+  int args_count;
+  int position;
+  bool failed;
+} test_parser_t;
+
+static bool is_test_binary_operator( const char * arg )
+{
+  static const char * operators[] = { "=", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL };
+  const char ** test_operator;
+  for ( test_operator = operators; *test_operator; test_operator++ )
+  {
+    if ( strcmp( arg, *test_operator ) == 0 )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool is_test_unary_operator( const char * arg )
+{
+  return arg[0] == '-' && arg[1] != '\0' && arg[2] == '\0' &&
+         strchr( "bcdefghLnprsStuwxz", arg[1] ) != NULL;
+}
+
+static long long parse_test_integer( test_parser_t * parser, const char * arg )
+{
+  char * end;
+  errno = 0;
+  long long value = strtoll( arg, &end, 10 );
+  if ( end == arg || *end != '\0' || errno != 0 )
+  {
+    ERROR( "test: %s: integer expression expected", arg );
+    parser->failed = true;
+  }
+  return value;
+}
+
+static bool test_binary( test_parser_t * parser,
+                         const char * left,
+                         const char * test_operator,
+                         const char * right )
+{
+  if ( strcmp( test_operator, "=" ) == 0 )
+  {
+    return strcmp( left, right ) == 0;
+  }
+  if ( strcmp( test_operator, "!=" ) == 0 )
+  {
+    return strcmp( left, right ) != 0;
+  }
+
+  long long left_value = parse_test_integer( parser, left );
+  long long right_value = parse_test_integer( parser, right );
+  if ( strcmp( test_operator, "-eq" ) == 0 )
+  {
+    return left_value == right_value;
+  }
+  if ( strcmp( test_operator, "-ne" ) == 0 )
+  {
+    return left_value != right_value;
+  }
+  if ( strcmp( test_operator, "-lt" ) == 0 )
+  {
+    return left_value < right_value;
+  }
+  if ( strcmp( test_operator, "-le" ) == 0 )
+  {
+    return left_value <= right_value;
+  }
+  if ( strcmp( test_operator, "-gt" ) == 0 )
+  {
+    return left_value > right_value;
+  }
+  return left_value >= right_value;
+}
+
+static bool test_unary( char test_operator, const char * arg )
+{
+  if ( test_operator == 'n' )
+  {
+    return arg[0] != '\0';
+  }
+  if ( test_operator == 'z' )
+  {
+    return arg[0] == '\0';
+  }
+  if ( test_operator == 't' )
+  {
+    return isatty( atoi( arg ) );
+  }
+  if ( test_operator == 'r' || test_operator == 'w' || test_operator == 'x' )
+  {
+    return access( arg, test_operator == 'r' ? R_OK : test_operator == 'w' ? W_OK : X_OK ) == 0;
+  }
+
+  struct stat file_stat;
+  if ( ( test_operator == 'h' || test_operator == 'L' ? lstat( arg, &file_stat ) :
+                                                        stat( arg, &file_stat ) ) == -1 )
+  {
+    return false;
+  }
+  switch ( test_operator )
+  {
+    case 'b':
+      return S_ISBLK( file_stat.st_mode );
+    case 'c':
+      return S_ISCHR( file_stat.st_mode );
+    case 'd':
+      return S_ISDIR( file_stat.st_mode );
+    case 'f':
+      return S_ISREG( file_stat.st_mode );
+    case 'g':
+      return ( file_stat.st_mode & S_ISGID ) != 0;
+    case 'h':
+    case 'L':
+      return S_ISLNK( file_stat.st_mode );
+    case 'p':
+      return S_ISFIFO( file_stat.st_mode );
+    case 's':
+      return file_stat.st_size > 0;
+    case 'S':
+      return S_ISSOCK( file_stat.st_mode );
+    case 'u':
+      return ( file_stat.st_mode & S_ISUID ) != 0;
+    default:
+      // -e
+      return true;
+  }
+}
+
+static bool test_or_expression( test_parser_t * parser );
+
+static const char * current_test_arg( test_parser_t * parser, int offset )
+{
+  int position = parser->position + offset;
+  return position < parser->args_count ? parser->args[position] : NULL;
+}
+
+static bool test_primary( test_parser_t * parser )
+{
+  const char * arg = current_test_arg( parser, 0 );
+  if ( arg == NULL )
+  {
+    ERROR( "test: argument expected" );
+    parser->failed = true;
+    return false;
+  }
+
+  // Binary expressions win over ( and unary operators, as in "test ( = (".
+  if ( current_test_arg( parser, 2 ) != NULL &&
+       is_test_binary_operator( current_test_arg( parser, 1 ) ) )
+  {
+    parser->position += 3;
+    return test_binary( parser, arg, current_test_arg( parser, -2 ), current_test_arg( parser, -1 ) );
+  }
+  if ( strcmp( arg, "(" ) == 0 && current_test_arg( parser, 1 ) != NULL )
+  {
+    parser->position++;
+    bool value = test_or_expression( parser );
+    arg = current_test_arg( parser, 0 );
+    if ( arg == NULL || strcmp( arg, ")" ) != 0 )
+    {
+      ERROR( "test: ')' expected" );
+      parser->failed = true;
+    }
+    parser->position++;
+    return value;
+  }
+  if ( is_test_unary_operator( arg ) && current_test_arg( parser, 1 ) != NULL )
+  {
+    parser->position += 2;
+    return test_unary( arg[1], current_test_arg( parser, -1 ) );
+  }
+
+  // A single string is true if not empty.
+  parser->position++;
+  return arg[0] != '\0';
+}
+
+static bool test_not_expression( test_parser_t * parser )
+{
+  const char * arg = current_test_arg( parser, 0 );
+  if ( arg != NULL && strcmp( arg, "!" ) == 0 && current_test_arg( parser, 1 ) != NULL &&
+       !( current_test_arg( parser, 2 ) != NULL &&
+          is_test_binary_operator( current_test_arg( parser, 1 ) ) ) )
+  {
+    parser->position++;
+    return !test_not_expression( parser );
+  }
+  return test_primary( parser );
+}
+
+static bool test_and_expression( test_parser_t * parser )
+{
+  bool value = test_not_expression( parser );
+  while ( current_test_arg( parser, 0 ) != NULL &&
+          strcmp( current_test_arg( parser, 0 ), "-a" ) == 0 )
+  {
+    parser->position++;
+    // Both sides are parsed, whatever the left one is.
+    bool right_value = test_not_expression( parser );
+    value = value && right_value;
+  }
+  return value;
+}
+
+static bool test_or_expression( test_parser_t * parser )
+{
+  bool value = test_and_expression( parser );
+  while ( current_test_arg( parser, 0 ) != NULL &&
+          strcmp( current_test_arg( parser, 0 ), "-o" ) == 0 )
+  {
+    parser->position++;
+    bool right_value = test_and_expression( parser );
+    value = value || right_value;
+  }
+  return value;
+}
+
+static int run_test( char ** argv )
+{
+  test_parser_t parser;
+  memset( &parser, 0, sizeof( parser ) );
+  parser.args = argv + 1;
+  while ( parser.args[parser.args_count] != NULL )
+  {
+    parser.args_count++;
+  }
+
+  if ( strcmp( argv[0], "[" ) == 0 )
+  {
+    if ( parser.args_count == 0 || strcmp( parser.args[parser.args_count - 1], "]" ) != 0 )
+    {
+      ERROR( "[: missing ]" );
+      return 2;
+    }
+    parser.args_count--;
+  }
+  if ( parser.args_count == 0 )
+  {
+    return EXIT_FAILURE;
+  }
+
+  bool value = test_or_expression( &parser );
+  if ( !parser.failed && parser.position < parser.args_count )
+  {
+    ERROR( "test: %s: unexpected argument", parser.args[parser.position] );
+    parser.failed = true;
+  }
+  return parser.failed ? 2 : value ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Runs one of the utilities above and returns its exit status.
+static int run_fast_builtin( char ** argv )
+{
+  const char * command = argv[0];
+  if ( strcmp( command, "echo" ) == 0 )
+  {
+    return run_echo( argv );
+  }
+  if ( strcmp( command, "printf" ) == 0 )
+  {
+    return run_printf( argv );
+  }
+  if ( strcmp( command, "pwd" ) == 0 )
+  {
+    return run_pwd();
+  }
+  if ( strcmp( command, "test" ) == 0 || strcmp( command, "[" ) == 0 )
+  {
+    return run_test( argv );
+  }
+  return strcmp( command, "true" ) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Predictive prefetch. The shell learns which command tends to follow which,
+// and when a line is started, it reads ahead the executable predicted to come
+// after the line's last command, together with the shared libraries it needs,
+// so their pages are in the page cache by the time the user runs it.
+// The reading is done by a helper process, never delaying the prompt.
+// MSH_PREFETCH=0 turns it off; the prefetch builtin shows how well it does.
+#define PREFETCH_MODEL_SIZE 128
+#define PREFETCH_NAME_SIZE 32
+#define PREFETCH_MAX_FILES 32
+
+typedef struct successor_t
+{
+  char command[PREFETCH_NAME_SIZE];
+  char next_command[PREFETCH_NAME_SIZE];
+  unsigned long count;
+} successor_t;
+
+static successor_t successors[PREFETCH_MODEL_SIZE];
+static size_t successors_count = 0;
+
+typedef struct prefetch_counters_t
+{
+  unsigned long predictions;
+  unsigned long hits;
+  unsigned long files;
+  unsigned long long cold_bytes;
+  // Time spent reading ahead, and the part of it spent for the predictions that came true.
+  // It is what the prefetch has cost, not what it has saved: the commands' own start-up
+  // time is not measured.
+  double seconds;
+  double hit_seconds;
+} prefetch_counters_t;
+
+static prefetch_counters_t prefetch_counters;
+
+// The last command run, and what is expected to be run next.
+static char last_command[PREFETCH_NAME_SIZE];
+static char predicted_command[PREFETCH_NAME_SIZE];
+static double predicted_command_seconds = 0;
+
+static void add_successor( const char * command, const char * next_command )
+{
+  size_t isuccessor;
+  size_t rarest = 0;
+  for ( isuccessor = 0; isuccessor < successors_count; isuccessor++ )
+  {
+    successor_t * successor = &successors[isuccessor];
+    if ( strcmp( successor->command, command ) == 0 &&
+         strcmp( successor->next_command, next_command ) == 0 )
+    {
+      successor->count++;
+      return;
+    }
+    if ( successor->count < successors[rarest].count )
+    {
+      rarest = isuccessor;
+    }
+  }
+
+  // The rarest pair gives its place to the new one, when the model is full.
+  successor_t * successor =
+      successors_count < PREFETCH_MODEL_SIZE ? &successors[successors_count++] : &successors[rarest];
+  snprintf( successor->command, PREFETCH_NAME_SIZE, "%s", command );
+  snprintf( successor->next_command, PREFETCH_NAME_SIZE, "%s", next_command );
+  successor->count = 1;
+}
+
+static const char * predict_successor( const char * command )
+{
+  const successor_t * best = NULL;
+  size_t isuccessor;
+  for ( isuccessor = 0; isuccessor < successors_count; isuccessor++ )
+  {
+    const successor_t * successor = &successors[isuccessor];
+    if ( strcmp( successor->command, command ) == 0 && ( best == NULL || successor->count > best->count ) )
+    {
+      best = successor;
+    }
+  }
+  return best != NULL ? best->next_command : NULL;
+}
+
+static bool is_prefetch_enabled()
+{
+  const char * prefetch = get_variable( "MSH_PREFETCH" );
+  return prefetch == NULL || strcmp( prefetch, "0" ) != 0;
+}
+
+// Counts the checked prediction and learns the commands of the line.
+static void learn_command_line( const char * line, size_t line_len )
+{
+  size_t position = 0;
+  while ( position < line_len )
+  {
+    int tokens_count = tokenize_next_command( line, line_len, &position, tokens );
+    // The command run with timeout is the one to learn.
+    int icommand = tokens_count > 2 && strcmp( tokens[0], "timeout" ) == 0 ? 2 : 0;
+    if ( tokens_count > icommand )
+    {
+      const char * command = tokens[icommand];
+      if ( predicted_command[0] != '\0' )
+      {
+        prefetch_counters.predictions++;
+        if ( strncmp( predicted_command, command, PREFETCH_NAME_SIZE - 1 ) == 0 )
+        {
+          prefetch_counters.hits++;
+          prefetch_counters.hit_seconds += predicted_command_seconds;
+        }
+        predicted_command[0] = '\0';
+      }
+      if ( last_command[0] != '\0' )
+      {
+        add_successor( last_command, command );
+      }
+      snprintf( last_command, PREFETCH_NAME_SIZE, "%s", command );
+    }
+    free_tokens();
+  }
+}
+
+// Reads an ELF file's interpreter and DT_NEEDED libraries into names,
+// as a sequence of zero-terminated strings. Returns the names' count.
+static size_t read_elf_dependencies( int fd, char * names, size_t names_size )
+{
+  Elf64_Ehdr header;
+  if ( pread( fd, &header, sizeof( header ), 0 ) != sizeof( header ) ||
+       memcmp( header.e_ident, ELFMAG, SELFMAG ) != 0 || header.e_ident[EI_CLASS] != ELFCLASS64 ||
+       header.e_phentsize != sizeof( Elf64_Phdr ) || header.e_phnum == 0 || header.e_phnum > 64 )
+  {
+    return 0;
+  }
+  Elf64_Phdr program_headers[64];
+  size_t program_headers_size = header.e_phnum * sizeof( Elf64_Phdr );
+  if ( pread( fd, program_headers, program_headers_size, (off_t)header.e_phoff ) !=
+       (ssize_t)program_headers_size )
+  {
+    return 0;
+  }
+
+  size_t names_count = 0;
+  size_t names_len = 0;
+  const Elf64_Phdr * dynamic = NULL;
+  int iheader;
+  for ( iheader = 0; iheader < header.e_phnum; iheader++ )
+  {
+    const Elf64_Phdr * program_header = &program_headers[iheader];
+    if ( program_header->p_type == PT_DYNAMIC )
+    {
+      dynamic = program_header;
+    }
+    else if ( program_header->p_type == PT_INTERP && program_header->p_filesz < PATH_MAX &&
+              names_len + program_header->p_filesz + 1 < names_size )
+    {
+      if ( pread( fd, names + names_len, program_header->p_filesz, (off_t)program_header->p_offset ) ==
+           (ssize_t)program_header->p_filesz )
+      {
+        names[names_len + program_header->p_filesz] = '\0';
+        names_len += strlen( names + names_len ) + 1;
+        names_count++;
+      }
+    }
+  }
+  if ( dynamic == NULL || dynamic->p_filesz > 64 * 1024 )
+  {
+    return names_count;
+  }
+
+  Elf64_Dyn * entries = (Elf64_Dyn *)malloc( dynamic->p_filesz );
+  size_t entries_count = dynamic->p_filesz / sizeof( Elf64_Dyn );
+  if ( pread( fd, entries, dynamic->p_filesz, (off_t)dynamic->p_offset ) != (ssize_t)dynamic->p_filesz )
+  {
+    entries_count = 0;
+  }
+
+  // The string table is given by its address, found in the file through the segments.
+  Elf64_Addr strtab_address = 0;
+  size_t ientry;
+  for ( ientry = 0; ientry < entries_count && entries[ientry].d_tag != DT_NULL; ientry++ )
+  {
+    if ( entries[ientry].d_tag == DT_STRTAB )
+    {
+      strtab_address = entries[ientry].d_un.d_ptr;
+    }
+  }
+  off_t strtab_offset = -1;
+  for ( iheader = 0; iheader < header.e_phnum; iheader++ )
+  {
+    const Elf64_Phdr * program_header = &program_headers[iheader];
+    if ( program_header->p_type == PT_LOAD && strtab_address >= program_header->p_vaddr &&
+         strtab_address < program_header->p_vaddr + program_header->p_filesz )
+    {
+      strtab_offset = (off_t)( program_header->p_offset + strtab_address - program_header->p_vaddr );
+    }
+  }
+
+  for ( ientry = 0; strtab_offset != -1 && ientry < entries_count && entries[ientry].d_tag != DT_NULL;
+        ientry++ )
+  {
+    if ( entries[ientry].d_tag != DT_NEEDED || names_len + NAME_MAX + 1 >= names_size )
+    {
+      continue;
+    }
+    ssize_t name_len =
+        pread( fd, names + names_len, NAME_MAX, strtab_offset + (off_t)entries[ientry].d_un.d_val );
+    if ( name_len > 0 )
+    {
+      names[names_len + (size_t)name_len] = '\0';
+      names_len += strlen( names + names_len ) + 1;
+      names_count++;
+    }
+  }
+  free( entries );
+  return names_count;
+}
+
+// Finds a shared library by its DT_NEEDED name the way the dynamic loader would
+// in the usual cases: LD_LIBRARY_PATH, then the system directories.
+static bool resolve_library_path( const char * name, char * path_buf, size_t path_buf_size )
+{
+  if ( strchr( name, '/' ) != NULL )
+  {
+    snprintf( path_buf, path_buf_size, "%s", name );
+    return access( path_buf, R_OK ) == 0;
+  }
+
+  const char * library_path = get_variable( "LD_LIBRARY_PATH" );
+  char search_path[PATH_MAX];
+  snprintf( search_path,
+            sizeof( search_path ),
+            "%s%s/lib/x86_64-linux-gnu:/usr/lib/x86_64-linux-gnu:/lib64:/usr/lib64:/lib:/usr/lib",
+            library_path != NULL ? library_path : "",
+            library_path != NULL ? ":" : "" );
+  char * saveptr;
+  char * dir;
+  for ( dir = strtok_r( search_path, ":", &saveptr ); dir; dir = strtok_r( NULL, ":", &saveptr ) )
+  {
+    snprintf( path_buf, path_buf_size, "%s/%s", dir, name );
+    if ( access( path_buf, R_OK ) == 0 )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reads the file ahead, if some of its pages are not in the page cache,
+// and returns the size of those pages.
+static size_t prefetch_file( int fd )
+{
+  struct stat file_stat;
+  if ( fstat( fd, &file_stat ) == -1 || file_stat.st_size == 0 )
+  {
+    return 0;
+  }
+
+  size_t page_size = (size_t)sysconf( _SC_PAGESIZE );
+  size_t pages_count = ( (size_t)file_stat.st_size + page_size - 1 ) / page_size;
+  size_t cold_pages = pages_count;
+  void * file_map = mmap( NULL, (size_t)file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  if ( file_map != MAP_FAILED )
+  {
+    unsigned char * residency = (unsigned char *)malloc( pages_count );
+    if ( mincore( file_map, (size_t)file_stat.st_size, residency ) == 0 )
+    {
+      size_t ipage;
+      for ( ipage = 0, cold_pages = 0; ipage < pages_count; ipage++ )
+      {
+        cold_pages += !( residency[ipage] & 1 );
+      }
+    }
+    free( residency );
+    munmap( file_map, (size_t)file_stat.st_size );
+  }
+
+  if ( cold_pages > 0 )
+  {
+    readahead( fd, 0, (size_t)file_stat.st_size );
+    posix_fadvise( fd, 0, 0, POSIX_FADV_WILLNEED );
+  }
+  return cold_pages * page_size;
+}
+
+// Reads ahead the executable at path with its libraries, path is reused for them.
+static void prefetch_executable( char * path, size_t path_size, prefetch_counters_t * counters )
+{
+  // Libraries' names are collected breadth first, while there is room for them.
+  char names[PREFETCH_MAX_FILES * 64];
+  size_t names_len = 0;
+  size_t names_count = 0;
+  const char * name = NULL;
+  size_t ifile;
+  for ( ifile = 0; ifile <= names_count && ifile < PREFETCH_MAX_FILES; ifile++ )
+  {
+    if ( ifile > 0 )
+    {
+      name = name == NULL ? names : name + strlen( name ) + 1;
+      if ( !resolve_library_path( name, path, path_size ) )
+      {
+        continue;
+      }
+    }
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd == -1 )
+    {
+      continue;
+    }
+    counters->cold_bytes += prefetch_file( fd );
+    counters->files++;
+
+    // Only the libraries not collected yet are added.
+    char dependencies[PREFETCH_MAX_FILES * 64];
+    size_t dependencies_count = read_elf_dependencies( fd, dependencies, sizeof( dependencies ) );
+    close( fd );
+    const char * dependency = dependencies;
+    size_t idependency;
+    for ( idependency = 0; idependency < dependencies_count; idependency++ )
+    {
+      size_t dependency_len = strlen( dependency );
+      bool known = false;
+      const char * known_name = names;
+      size_t iname;
+      for ( iname = 0; iname < names_count && !known; iname++ )
+      {
+        known = strcmp( known_name, dependency ) == 0;
+        known_name += strlen( known_name ) + 1;
+      }
+      if ( !known && names_len + dependency_len + 1 <= sizeof( names ) )
+      {
+        memcpy( names + names_len, dependency, dependency_len + 1 );
+        names_len += dependency_len + 1;
+        names_count++;
+      }
+      dependency += dependency_len + 1;
+    }
+  }
+}
+
+static int prefetch_helper_fd = -1;
+
+static void handle_prefetch_helper_answer( int fd, uint32_t events, void * data )
+{
+  (void)events;
+  (void)data;
+  prefetch_counters_t counters;
+  ssize_t read_result = read( fd, &counters, sizeof( counters ) );
+  if ( read_result == -1 && errno == EINTR )
+  {
+    return;
+  }
+  unwatch_fd( fd );
+  close( fd );
+  prefetch_helper_fd = -1;
+  if ( read_result == sizeof( counters ) )
+  {
+    prefetch_counters.files += counters.files;
+    prefetch_counters.cold_bytes += counters.cold_bytes;
+    prefetch_counters.seconds += counters.seconds;
+    predicted_command_seconds = counters.seconds;
+  }
+}
+
+// Prefetches the command predicted to follow the last one, with its libraries.
+// Reading them can block on a slow disk, so a helper process does it, and
+// the shell goes on to the prompt. The helper sends its counters through a pipe.
+static void prefetch_next_command()
+{
+  const char * next_command = last_command[0] != '\0' ? predict_successor( last_command ) : NULL;
+  if ( next_command == NULL || !is_prefetch_enabled() )
+  {
+    return;
+  }
+  snprintf( predicted_command, PREFETCH_NAME_SIZE, "%s", next_command );
+  predicted_command_seconds = 0;
+  if ( is_fast_builtin( next_command ) || prefetch_helper_fd != -1 || prefetch_helper_pid != -1 )
+  {
+    // Nothing to read, or the previous helper is still reading.
+    return;
+  }
+
+  int helper_pipe[2];
+  if ( pipe2( helper_pipe, O_CLOEXEC ) == -1 )
+  {
+    LOG( "Failed to create a pipe for the prefetch helper: %s", strerror( errno ) );
+    return;
+  }
+  TRACE_INSTANT( "prefetch", next_command );
+  METRICS_ADD( forks, 1 );
+  pid_t helper_pid = fork();
+  if ( helper_pid == 0 )
+  {
+    // The helper has nothing to free or to save, it only answers.
+    close( helper_pipe[0] );
+    prefetch_counters_t counters;
+    memset( &counters, 0, sizeof( counters ) );
+    struct timespec start_time;
+    clock_gettime( CLOCK_MONOTONIC, &start_time );
+    char path[PATH_MAX];
+    if ( resolve_command_path( predicted_command, path, sizeof( path ) ) != -1 )
+    {
+      prefetch_executable( path, sizeof( path ), &counters );
+    }
+    struct timespec finish_time;
+    clock_gettime( CLOCK_MONOTONIC, &finish_time );
+    counters.seconds = elapsed_seconds( &start_time, &finish_time );
+    ssize_t written = write( helper_pipe[1], &counters, sizeof( counters ) );
+    _exit( written == -1 ? EXIT_FAILURE : EXIT_SUCCESS );
+  }
+  close( helper_pipe[1] );
+  if ( helper_pid == -1 )
+  {
+    LOG( "Failed to start the prefetch helper: %s", strerror( errno ) );
+    close( helper_pipe[0] );
+    return;
+  }
+
+  prefetch_helper_pid = helper_pid;
+  prefetch_helper_fd = helper_pipe[0];
+  watch_fd( prefetch_helper_fd, EPOLLIN, handle_prefetch_helper_answer, NULL );
+}
+
+static void print_prefetch_counters()
+{
+  printf( "predictions %lu, hits %lu (%.1f%%)\n",
+          prefetch_counters.predictions,
+          prefetch_counters.hits,
+          prefetch_counters.predictions ? 100.0 * prefetch_counters.hits / prefetch_counters.predictions :
+                                          0.0 );
+  printf( "prefetched %lu files, %llu KiB not cached before\n",
+          prefetch_counters.files,
+          prefetch_counters.cold_bytes / 1024 );
+  printf( "prefetch time %.3f ms, of it for hits %.3f ms\n",
+          prefetch_counters.seconds * 1e3,
+          prefetch_counters.hit_seconds * 1e3 );
+  if ( last_command[0] != '\0' )
+  {
+    const char * next_command = predict_successor( last_command );
+    printf( "after %s: %s\n", last_command, next_command != NULL ? next_command : "no prediction" );
+  }
+}
+
+void run_worker();
+
+// bench [-n N] [-w warmup] [-o file.csv] command [arguments]
+// Runs the command warmup + N times the same way a worker runs it, one run
+// at a time, and prints statistics of the measured runs. The stdout of the runs
+// is discarded. With -o, every measured run is written to a CSV file as well.
+#define DEFAULT_BENCH_RUNS 10
+#define DEFAULT_BENCH_WARMUP_RUNS 1
+#define BENCH_HISTOGRAM_BUCKETS 10
+#define BENCH_HISTOGRAM_WIDTH 40
+
+// Runs the command given to a builtin like bench from tokens[command_index]
+// once, the same way a worker runs it, and returns its wait status.
+static int run_nested_command( size_t command_index, bool discard_output )
+{
+  METRICS_ADD( forks, 1 );
+  pid_t nested_child_pid = fork();
+  if ( nested_child_pid == -1 )
+  {
+    ERROR( "%s: fork failed: %s", tokens[0], strerror( errno ) );
+    free_and_exit( EXIT_FAILURE );
+  }
+  if ( nested_child_pid == 0 )
+  {
+    if ( discard_output )
+    {
+      int null_fd = open( "/dev/null", O_WRONLY );
+      if ( null_fd != -1 )
+      {
+        dup2( null_fd, STDOUT_FILENO );
+        close( null_fd );
+      }
+    }
+
+    // The command's tokens take the place of the builtin's ones.
+    size_t itoken;
+    for ( itoken = 0; itoken < command_index; itoken++ )
+    {
+      free( tokens[itoken] );
+    }
+    memmove( tokens,
+             tokens + command_index,
+             ( MAX_NUM_ARGUMENTS + 1 - command_index ) * sizeof( char * ) );
+    for ( itoken = MAX_NUM_ARGUMENTS + 1 - command_index; itoken <= MAX_NUM_ARGUMENTS; itoken++ )
+    {
+      tokens[itoken] = NULL;
+    }
+    run_worker();
+  }
+
+  int status = 0;
+  while ( waitpid( nested_child_pid, &status, 0 ) == -1 && errno == EINTR )
+    ;
+  return status;
+}
+
+static int compare_doubles( const void * left, const void * right )
+{
+  double left_value = *(const double *)left;
+  double right_value = *(const double *)right;
+  return ( left_value > right_value ) - ( left_value < right_value );
+}
+
+static int compare_strings( const void * a, const void * b )
+{
+  return strcmp( *(const char * const *)a, *(const char * const *)b );
+}
+
+// Nearest-rank percentile of the sorted values.
+static double get_percentile( const double * sorted_values, size_t values_count, double percent )
+{
+  size_t rank = (size_t)( percent / 100.0 * values_count + 0.999999 );
+  if ( rank == 0 )
+  {
+    rank = 1;
+  }
+  return sorted_values[( rank > values_count ? values_count : rank ) - 1];
+}
+
+static void print_bench_histogram( const double * sorted_values, size_t values_count )
+{
+  size_t buckets[BENCH_HISTOGRAM_BUCKETS];
+  memset( buckets, 0, sizeof( buckets ) );
+  double low = sorted_values[0];
+  double bucket_width = ( sorted_values[values_count - 1] - low ) / BENCH_HISTOGRAM_BUCKETS;
+  size_t ivalue;
+  for ( ivalue = 0; ivalue < values_count; ivalue++ )
+  {
+    size_t ibucket =
+        bucket_width > 0 ? (size_t)( ( sorted_values[ivalue] - low ) / bucket_width ) : 0;
+    buckets[ibucket < BENCH_HISTOGRAM_BUCKETS ? ibucket : BENCH_HISTOGRAM_BUCKETS - 1]++;
+  }
+
+  size_t max_bucket = 0;
+  size_t ibucket;
+  for ( ibucket = 0; ibucket < BENCH_HISTOGRAM_BUCKETS; ibucket++ )
+  {
+    max_bucket = buckets[ibucket] > max_bucket ? buckets[ibucket] : max_bucket;
+  }
+  for ( ibucket = 0; ibucket < BENCH_HISTOGRAM_BUCKETS; ibucket++ )
+  {
+    char bar[BENCH_HISTOGRAM_WIDTH + 1];
+    size_t bar_len = ( buckets[ibucket] * BENCH_HISTOGRAM_WIDTH + max_bucket - 1 ) / max_bucket;
+    memset( bar, '#', bar_len );
+    bar[bar_len] = '\0';
+    printf( "  %10.3f ms | %-*s %lu\n",
+            ( low + bucket_width * ibucket ) * 1e3,
+            BENCH_HISTOGRAM_WIDTH,
+            bar,
+            buckets[ibucket] );
+    if ( bucket_width == 0 )
+    {
+      break;
+    }
+  }
+}
+
+static void run_bench( size_t tokens_count )
+{
+  int runs = DEFAULT_BENCH_RUNS;
+  int warmup_runs = DEFAULT_BENCH_WARMUP_RUNS;
+  const char * csv_filename = NULL;
+  size_t command_index = 1;
+  while ( command_index + 1 < tokens_count && tokens[command_index][0] == '-' )
+  {
+    const char * option = tokens[command_index];
+    const char * value = tokens[command_index + 1];
+    if ( strcmp( option, "-n" ) == 0 )
+    {
+      runs = atoi( value );
+    }
+    else if ( strcmp( option, "-w" ) == 0 )
+    {
+      warmup_runs = atoi( value );
+    }
+    else if ( strcmp( option, "-o" ) == 0 )
+    {
+      csv_filename = value;
+    }
+    else
+    {
+      break;
+    }
+    command_index += 2;
+  }
+  if ( command_index >= tokens_count || runs <= 0 || warmup_runs < 0 ||
+       tokens[command_index][0] == '-' )
+  {
+    ERROR( "bench: usage: bench [-n N] [-w warmup] [-o file.csv] command [arguments]" );
+    free_and_exit( EXIT_FAILURE );
+  }
+
+  FILE * csv = NULL;
+  if ( csv_filename != NULL )
+  {
+    csv = fopen( csv_filename, "w" );
+    if ( csv == NULL )
+    {
+      ERROR( "bench: %s: %s", csv_filename, strerror( errno ) );
+      free_and_exit( EXIT_FAILURE );
+    }
+    fprintf( csv, "run,seconds,status\n" );
+  }
+
+  // Nothing buffered should be written by every run again.
+  fflush( stdout );
+  double * seconds = (double *)malloc( (size_t)runs * sizeof( double ) );
+  size_t failed_runs = 0;
+  int irun;
+  for ( irun = -warmup_runs; irun < runs; irun++ )
+  {
+    struct timespec start_time;
+    struct timespec finish_time;
+    clock_gettime( CLOCK_MONOTONIC, &start_time );
+    int status = run_nested_command( command_index, true );
+    clock_gettime( CLOCK_MONOTONIC, &finish_time );
+    if ( irun < 0 )
+    {
+      continue;
+    }
+
+    seconds[irun] = elapsed_seconds( &start_time, &finish_time );
+    if ( status != 0 )
+    {
+      failed_runs++;
+    }
+    if ( csv != NULL )
+    {
+      char status_text[16];
+      format_wait_status( status, status_text, sizeof( status_text ) );
+      fprintf( csv, "%d,%.9f,%s\n", irun + 1, seconds[irun], status_text );
+    }
+  }
+  if ( csv != NULL )
+  {
+    fclose( csv );
+  }
+
+  double total_seconds = 0;
+  for ( irun = 0; irun < runs; irun++ )
+  {
+    total_seconds += seconds[irun];
+  }
+  qsort( seconds, (size_t)runs, sizeof( double ), compare_doubles );
+  printf( "%d runs (%d warmup), %lu failed\n", runs, warmup_runs, failed_runs );
+  printf( "min %.3f ms, mean %.3f ms, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+          seconds[0] * 1e3,
+          total_seconds / runs * 1e3,
+          get_percentile( seconds, (size_t)runs, 50 ) * 1e3,
+          get_percentile( seconds, (size_t)runs, 90 ) * 1e3,
+          get_percentile( seconds, (size_t)runs, 99 ) * 1e3,
+          seconds[runs - 1] * 1e3 );
+  print_bench_histogram( seconds, (size_t)runs );
+  free( seconds );
+
+  if ( failed_runs > 0 )
+  {
+    free_and_exit( EXIT_FAILURE );
+  }
+}
+
+// watch [-p path]... [-d milliseconds] [--] command [arguments]
+// Runs the command, then runs it again every time something changes in the
+// paths (the current directory by default), until watch is killed. Changes are
+// waited for with inotify rather than by polling, and a burst of them (like
+// an editor saving a file) makes a single run: the command waits until nothing
+// has changed for the debounce time. Being a worker, watch is a usual job,
+// which can be suspended, put into the background or interrupted.
+#define DEFAULT_WATCH_DEBOUNCE_MS 100
+#define WATCH_EVENTS                                                                                  \
+  ( IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |    \
+    IN_DELETE_SELF | IN_MOVE_SELF )
+
+// Watches all the paths, returns the number of the ones watched.
+// wds gets the watch descriptor of every path, -1 for the ones not watched.
+static size_t add_watches( int inotify_fd, char ** paths, int * wds, size_t paths_count, bool report_errors )
+{
+  size_t watched_count = 0;
+  size_t ipath;
+  for ( ipath = 0; ipath < paths_count; ipath++ )
+  {
+    wds[ipath] = inotify_add_watch( inotify_fd, paths[ipath], WATCH_EVENTS );
+    if ( wds[ipath] != -1 )
+    {
+      watched_count++;
+    }
+    else if ( report_errors )
+    {
+      ERROR( "watch: %s: %s", paths[ipath], strerror( errno ) );
+    }
+  }
+  return watched_count;
+}
+
+// Files changed while the command was running, as "<watched path>/<name>".
+// They are named by the watched paths rather than by watch descriptors,
+// as the descriptors change when a path is watched anew.
+typedef struct watch_changes_t
+{
+  char ** paths;
+  size_t count;
+  size_t capacity;
+} watch_changes_t;
+
+static void add_watch_change( watch_changes_t * changes, const char * path, const char * name )
+{
+  if ( changes->count == changes->capacity )
+  {
+    changes->capacity = changes->capacity ? 2 * changes->capacity : 16;
+    changes->paths = (char **)realloc( changes->paths, changes->capacity * sizeof( char * ) );
+  }
+  size_t change_size = strlen( path ) + strlen( name ) + 2;
+  changes->paths[changes->count] = (char *)malloc( change_size );
+  snprintf( changes->paths[changes->count], change_size, "%s/%s", path, name );
+  changes->count++;
+}
+
+static void free_watch_changes( watch_changes_t * changes )
+{
+  size_t ichange;
+  for ( ichange = 0; ichange < changes->count; ichange++ )
+  {
+    free( changes->paths[ichange] );
+  }
+  free( changes->paths );
+  memset( changes, 0, sizeof( watch_changes_t ) );
+}
+
+// True if any of the changes is not among the known ones, which should be sorted.
+static bool has_unknown_watch_changes( const watch_changes_t * changes, const watch_changes_t * known_changes )
+{
+  size_t ichange;
+  for ( ichange = 0; ichange < changes->count; ichange++ )
+  {
+    if ( known_changes->count == 0 ||
+         bsearch( &changes->paths[ichange],
+                  known_changes->paths,
+                  known_changes->count,
+                  sizeof( char * ),
+                  compare_strings ) == NULL )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reads the pending events, waiting for them up to timeout_ms (-1 is forever).
+// Returns false if there were none. *rewatch is set if a watched path
+// has been removed or replaced (as editors save files), so it has to be watched again.
+// If changes is not NULL, the files changed are added to it.
+static bool read_watch_events( int inotify_fd,
+                               int timeout_ms,
+                               bool * rewatch,
+                               char ** paths,
+                               const int * wds,
+                               size_t paths_count,
+                               watch_changes_t * changes )
+{
+  struct pollfd inotify_pollfd = { inotify_fd, POLLIN, 0 };
+  int poll_result;
+  while ( ( poll_result = poll( &inotify_pollfd, 1, timeout_ms ) ) == -1 && errno == EINTR )
+    ;
+  if ( poll_result <= 0 )
+  {
+    return false;
+  }
+
+  char events[4096] __attribute__( ( aligned( __alignof__( struct inotify_event ) ) ) );
+  ssize_t events_len = read( inotify_fd, events, sizeof( events ) );
+  ssize_t offset = 0;
+  while ( offset < events_len )
+  {
+    const struct inotify_event * event = (const struct inotify_event *)( events + offset );
+    if ( event->mask & ( IN_IGNORED | IN_Q_OVERFLOW ) )
+    {
+      *rewatch = true;
+    }
+    else if ( changes != NULL )
+    {
+      size_t ipath;
+      for ( ipath = 0; ipath < paths_count; ipath++ )
+      {
+        if ( wds[ipath] == event->wd )
+        {
+          add_watch_change( changes, paths[ipath], event->len > 0 ? event->name : "" );
+          break;
+        }
+      }
+    }
+    offset += (ssize_t)sizeof( struct inotify_event ) + event->len;
+  }
+  return true;
+}
+
+static void run_watch( size_t tokens_count )
+{
+  char * paths[MAX_NUM_ARGUMENTS];
+  int wds[MAX_NUM_ARGUMENTS];
+  size_t paths_count = 0;
+  int debounce_ms = DEFAULT_WATCH_DEBOUNCE_MS;
+  size_t command_index = 1;
+  while ( command_index + 1 < tokens_count && tokens[command_index][0] == '-' )
+  {
+    const char * option = tokens[command_index];
+    if ( strcmp( option, "--" ) == 0 )
+    {
+      command_index++;
+      break;
+    }
+    if ( strcmp( option, "-p" ) == 0 )
+    {
+      paths[paths_count++] = tokens[command_index + 1];
+    }
+    else if ( strcmp( option, "-d" ) == 0 )
+    {
+      debounce_ms = atoi( tokens[command_index + 1] );
+    }
+    else
+    {
+      break;
+    }
+    command_index += 2;
+  }
+  if ( command_index >= tokens_count || debounce_ms < 0 || tokens[command_index][0] == '-' )
+  {
+    ERROR( "watch: usage: watch [-p path]... [-d milliseconds] [--] command [arguments]" );
+    free_and_exit( EXIT_FAILURE );
+  }
+  if ( paths_count == 0 )
+  {
+    paths[paths_count++] = ".";
+  }
+
+  int inotify_fd = inotify_init1( IN_CLOEXEC );
+  if ( inotify_fd == -1 )
+  {
+    ERROR( "watch: inotify: %s", strerror( errno ) );
+    free_and_exit( EXIT_FAILURE );
+  }
+  if ( add_watches( inotify_fd, paths, wds, paths_count, true ) == 0 )
+  {
+    close( inotify_fd );
+    free_and_exit( EXIT_FAILURE );
+  }
+
+  // Files the command has changed in its previous run.
+  watch_changes_t own_changes;
+  memset( &own_changes, 0, sizeof( own_changes ) );
+  while ( true )
+  {
+    run_nested_command( command_index, false );
+
+    // The changes made while the command was running are queued by now. The files
+    // it has changed in its previous run as well are taken for its own output,
+    // not a change to run it again for. A change to any other file (the user saving
+    // one meanwhile) runs it again, as does anything the first run changes:
+    // the second one learns its output then. Files replaced are watched anew.
+    bool rewatch = false;
+    watch_changes_t run_changes;
+    memset( &run_changes, 0, sizeof( run_changes ) );
+    while ( read_watch_events( inotify_fd, 0, &rewatch, paths, wds, paths_count, &run_changes ) )
+      ;
+    bool changed_meanwhile = has_unknown_watch_changes( &run_changes, &own_changes );
+    free_watch_changes( &own_changes );
+    own_changes = run_changes;
+    if ( own_changes.count > 0 )
+    {
+      qsort( own_changes.paths, own_changes.count, sizeof( char * ), compare_strings );
+    }
+    if ( rewatch )
+    {
+      add_watches( inotify_fd, paths, wds, paths_count, false );
+      rewatch = false;
+    }
+
+    if ( !changed_meanwhile )
+    {
+      read_watch_events( inotify_fd, -1, &rewatch, paths, wds, paths_count, NULL );
+    }
+    while ( read_watch_events( inotify_fd, debounce_ms, &rewatch, paths, wds, paths_count, NULL ) )
+      ;
+    if ( rewatch )
+    {
+      // A new file under the same path, or the one being saved, can appear a bit later.
+      add_watches( inotify_fd, paths, wds, paths_count, false );
+    }
+  }
+}
+
+// xargs [-P jobs] [-n count] [-g pattern]... [--] command [arguments]
+// Runs the command with items appended to its arguments: the words read from
+// stdin, or the paths matching the glob patterns. The items are packed into
+// as few runs as ARG_MAX allows with the current environment (or count items
+// per run with -n), so thousands of files take a handful of exec() calls
+// instead of one each. Up to jobs runs go in parallel, one by default, and
+// nothing is run without items. Exit codes are the ones of GNU xargs:
+// 123 if any run has failed, 126 or 127 if the command could not be run at all.
+#define XARGS_EXIT_FAILED 123
+// Left for the environment the command itself may add, as POSIX xargs leaves it.
+#define XARGS_ARG_HEADROOM 2048
+
+// The space an argument takes from ARG_MAX: the string and its pointer.
+static size_t get_exec_argument_size( const char * argument )
+{
+  return strlen( argument ) + 1 + sizeof( char * );
+}
+
+// Words of stdin, allocated with malloc().
+static char ** read_xargs_items( size_t * items_count )
+{
+  char ** items = NULL;
+  size_t items_capacity = 0;
+  *items_count = 0;
+  char * line = NULL;
+  size_t line_capacity = 0;
+  while ( getline( &line, &line_capacity, stdin ) != -1 )
+  {
+    char * saveptr = NULL;
+    char * word;
+    for ( word = strtok_r( line, " \t\n", &saveptr ); word != NULL;
+          word = strtok_r( NULL, " \t\n", &saveptr ) )
+    {
+      if ( *items_count == items_capacity )
+      {
+        items_capacity = items_capacity ? items_capacity * 2 : 64;
+        items = (char **)realloc( items, items_capacity * sizeof( char * ) );
+      }
+      items[( *items_count )++] = strdup( word );
+    }
+  }
+  free( line );
+  return items;
+}
+
+// Waits for one of the runs, returns false if the rest should not be started.
+static bool wait_xargs_run( int * exit_code )
+{
+  int status;
+  while ( waitpid( -1, &status, 0 ) == -1 )
+  {
+    if ( errno != EINTR )
+    {
+      return true;
+    }
+  }
+  if ( WIFEXITED( status ) && WEXITSTATUS( status ) == EXIT_SUCCESS )
+  {
+    return true;
+  }
+  if ( WIFEXITED( status ) && ( WEXITSTATUS( status ) == EXIT_COMMAND_NOT_FOUND ||
+                                WEXITSTATUS( status ) == EXIT_COMMAND_NOT_EXECUTABLE ) )
+  {
+    *exit_code = WEXITSTATUS( status );
+    return false;
+  }
+  if ( *exit_code == EXIT_SUCCESS )
+  {
+    *exit_code = XARGS_EXIT_FAILED;
+  }
+  return true;
+}
+
+static pid_t start_xargs_run( char ** argv, bool items_from_stdin )
+{
+  // Otherwise the child would write out what is buffered once more.
+  fflush( stdout );
+  METRICS_ADD( forks, 1 );
+  pid_t child_pid = fork();
+  if ( child_pid == -1 )
+  {
+    ERROR( "xargs: fork failed: %s", strerror( errno ) );
+    return -1;
+  }
+  if ( child_pid == 0 )
+  {
+    if ( items_from_stdin )
+    {
+      // The items are taken already, and the command should not wait for more input.
+      int null_fd = open( "/dev/null", O_RDONLY );
+      if ( null_fd != -1 )
+      {
+        dup2( null_fd, STDIN_FILENO );
+        close( null_fd );
+      }
+    }
+    if ( is_fast_builtin( argv[0] ) )
+    {
+      free_and_exit( run_fast_builtin( argv ) );
+    }
+    free_and_exit( exec_external_command( argv ) );
+  }
+  return child_pid;
+}
+
+static void run_xargs( size_t tokens_count )
+{
+  int jobs = 1;
+  int max_batch_count = 0;
+  glob_t glob_items;
+  memset( &glob_items, 0, sizeof( glob_items ) );
+  bool items_from_stdin = true;
+  size_t command_index = 1;
+  while ( command_index + 1 < tokens_count && tokens[command_index][0] == '-' )
+  {
+    const char * option = tokens[command_index];
+    if ( strcmp( option, "--" ) == 0 )
+    {
+      command_index++;
+      break;
+    }
+    if ( strcmp( option, "-P" ) == 0 )
+    {
+      jobs = atoi( tokens[command_index + 1] );
+    }
+    else if ( strcmp( option, "-n" ) == 0 )
+    {
+      max_batch_count = atoi( tokens[command_index + 1] );
+    }
+    else if ( strcmp( option, "-g" ) == 0 )
+    {
+      int glob_result =
+          glob( tokens[command_index + 1], items_from_stdin ? 0 : GLOB_APPEND, NULL, &glob_items );
+      if ( glob_result != 0 && glob_result != GLOB_NOMATCH )
+      {
+        ERROR( "xargs: %s: failed to expand", tokens[command_index + 1] );
+        globfree( &glob_items );
+        free_and_exit( EXIT_FAILURE );
+      }
+      items_from_stdin = false;
+    }
+    else
+    {
+      break;
+    }
+    command_index += 2;
+  }
+  if ( command_index >= tokens_count || jobs <= 0 || max_batch_count < 0 || tokens[command_index][0] == '-' )
+  {
+    ERROR( "xargs: usage: xargs [-P jobs] [-n count] [-g pattern]... [--] command [arguments]" );
+    globfree( &glob_items );
+    free_and_exit( EXIT_FAILURE );
+  }
+
+  size_t items_count = glob_items.gl_pathc;
+  char ** items = items_from_stdin ? read_xargs_items( &items_count ) : glob_items.gl_pathv;
+
+  // The command and its own arguments go into every run.
+  size_t base_count = tokens_count - command_index;
+  long arg_max = sysconf( _SC_ARG_MAX );
+  size_t args_space = arg_max > 0 ? (size_t)arg_max : _POSIX_ARG_MAX;
+  size_t used_space = XARGS_ARG_HEADROOM + sizeof( char * );
+  char ** env;
+  for ( env = get_envp(); *env; env++ )
+  {
+    used_space += get_exec_argument_size( *env );
+  }
+  size_t itoken;
+  for ( itoken = command_index; itoken < tokens_count; itoken++ )
+  {
+    used_space += get_exec_argument_size( tokens[itoken] );
+  }
+  size_t batch_space = args_space > used_space ? args_space - used_space : 0;
+
+  char ** argv = (char **)malloc( ( base_count + items_count + 1 ) * sizeof( char * ) );
+  memcpy( argv, tokens + command_index, base_count * sizeof( char * ) );
+  int exit_code = EXIT_SUCCESS;
+  int running_count = 0;
+  bool keep_going = true;
+  size_t iitem = 0;
+  while ( keep_going && iitem < items_count )
+  {
+    // At least one item goes into a run, whatever its size is.
+    size_t batch_count = 0;
+    size_t batch_size = 0;
+    while ( iitem + batch_count < items_count &&
+            ( max_batch_count == 0 || batch_count < (size_t)max_batch_count ) )
+    {
+      size_t item_size = get_exec_argument_size( items[iitem + batch_count] );
+      if ( batch_count > 0 && batch_size + item_size > batch_space )
+      {
+        break;
+      }
+      argv[base_count + batch_count] = items[iitem + batch_count];
+      batch_size += item_size;
+      batch_count++;
+    }
+    argv[base_count + batch_count] = NULL;
+    iitem += batch_count;
+    LOG( "xargs: running %s with %lu items", argv[0], batch_count );
+
+    if ( running_count == jobs )
+    {
+      keep_going = wait_xargs_run( &exit_code );
+      running_count--;
+    }
+    if ( keep_going && start_xargs_run( argv, items_from_stdin ) != -1 )
+    {
+      running_count++;
+    }
+    else if ( keep_going )
+    {
+      exit_code = XARGS_EXIT_FAILED;
+      keep_going = false;
+    }
+  }
+  for ( ; running_count > 0; running_count-- )
+  {
+    wait_xargs_run( &exit_code );
+  }
+
+  free( argv );
+  if ( items_from_stdin )
+  {
+    for ( iitem = 0; iitem < items_count; iitem++ )
+    {
+      free( items[iitem] );
+    }
+    free( items );
+  }
+  globfree( &glob_items );
+  free_and_exit( exit_code );
+}
+
+// Run the current tokens as msh builtin command.
+// Returns false if it is not a builtin. Failures end the process with free_and_exit().
+static bool run_builtin( size_t tokens_count )
+{
+  char * command = tokens[0];
+  if ( strcmp( command, "cd" ) == 0 )
+  {
+    bool cd_succeded = true;
+    if ( tokens_count == 1 )
+    {
+      const char * home_value = get_variable( "HOME" );
+      if ( home_value == NULL )
+      {
+        ERROR( "cd: HOME variable not set\n" );
+        cd_succeded = false;
+      }
+      else
+      {
+        cd_succeded = try_change_directory( home_value ) == 0;
+      }
+    }
+    else if ( tokens_count > 2 )
+    {
+      ERROR( "cd: Too many arguments, must be one\n" );
+      cd_succeded = false;
+    }
+    else
+    {
+      char * dest = tokens[1];
+      cd_succeded = try_change_directory( dest ) == 0;
+    }
+    if ( !cd_succeded )
+    {
+      LOG( "cd failed!" );
+      free_and_exit( EXIT_FAILURE );
+    }
+  }
+  else if ( strcmp( command, "exit" ) == 0 || strcmp( command, "quit" ) == 0 )
+  {
+    // Without the shell, all the previous commands have succeeded if we are here.
+    free_and_exit( one_shot_mode ? EXIT_SUCCESS : MSH_EXIT_ALL );
+  }
+  else if ( strcmp( command, "bg" ) == 0 )
+  {
+    if ( one_shot_mode )
+    {
+      ERROR( "bg: no job control" );
+      free_and_exit( EXIT_FAILURE );
+    }
+    free_and_exit( MSH_EXIT_BG );
+  }
+  else if ( strcmp( command, "history" ) == 0 )
+  {
+    // Traversing command history starting from the oldest element.
+    // As we stated earlier, command_history_finish index is for the earliest element.
+    // Then the first non-zero element found in the circular buffer will be indexed
+    // "0: " in output for user.
+    size_t icmd = command_history_finish;
+
+    // Numbered index for current command output
+    // is icmd_printed, icmd is index for command_history.
+    size_t icmd_printed = MAX_COMMANDS_HISTORY_SIZE;
+
+    do
+    {
+      if ( strlen( command_history[icmd] ) > 0 )
+      {
+        if ( icmd_printed == MAX_COMMANDS_HISTORY_SIZE )
+        {
+          icmd_printed = 0;
+        }
+        printf( "%lu: %s\n", icmd_printed + 1, command_history[icmd] );
+        icmd_printed++;
+      }
+      icmd = ( icmd + 1 ) % MAX_COMMANDS_HISTORY_SIZE;
+    } while ( icmd != command_history_finish );
+  }
+  else if ( strcmp( command, "listpids" ) == 0 || strcmp( command, "showpids" ) == 0 )
+  {
+    bool long_format = tokens_count > 1 && strcmp( tokens[1], "-l" ) == 0;
+    if ( long_format )
+    {
+      print_process_record_header();
+    }
+    size_t ipid = pids_history_finish;
+    // ipid_printed will set to the first valid pid.
+    // So, currently it is set to invalid value, that it can never take,
+    // while being needed to print.
+    size_t ipid_printed = MAX_PIDS_HISTORY_SIZE;
+    do
+    {
+      if ( pids_history[ipid] != 0 )
+      {
+        if ( ipid_printed == MAX_PIDS_HISTORY_SIZE )
+        {
+          ipid_printed = 0;
+        }
+        if ( long_format )
+        {
+          print_process_record( ipid_printed, pids_history[ipid] );
+        }
+        else
+        {
+          printf( "%lu: %d\n", ipid_printed, pids_history[ipid] );
+        }
+        ipid_printed++;
+      }
+      LOG( "ipid %lu, ipid_printed %lu, pid %d", ipid, ipid_printed, pids_history[ipid] );
+      ipid = ( ipid + 1 ) % MAX_PIDS_HISTORY_SIZE;
+    } while ( ipid != pids_history_finish );
+  }
+  else if ( strcmp( command, "bench" ) == 0 )
+  {
+    run_bench( tokens_count );
+  }
+  else if ( strcmp( command, "watch" ) == 0 )
+  {
+    run_watch( tokens_count );
+  }
+  else if ( strcmp( command, "xargs" ) == 0 )
+  {
+    run_xargs( tokens_count );
+  }
+  else if ( strcmp( command, "submit" ) == 0 || strcmp( command, "queue" ) == 0 )
+  {
+    ERROR( one_shot_mode ? "%s: no job queue" :
+                           "%s: can not be mixed with other commands in a line",
+           command );
+    free_and_exit( EXIT_FAILURE );
+  }
+  else if ( strcmp( command, "prefetch" ) == 0 )
+  {
+    print_prefetch_counters();
+  }
+  else if ( strcmp( command, "stats" ) == 0 )
+  {
+    int top_count = tokens_count > 1 ? atoi( tokens[1] ) : DEFAULT_STATS_TOP_COUNT;
+    print_process_stats( top_count > 0 ? (size_t)top_count : DEFAULT_STATS_TOP_COUNT );
+  }
+  else if ( strcmp( command, "logdump" ) == 0 )
+  {
+    // The ring is inherited from the shell and the liner, so it shows their events too.
+    fflush( stdout );
+    dump_log_ring( STDOUT_FILENO, 0 );
+  }
+  else if ( strcmp( command, "export" ) == 0 )
+  {
+    if ( tokens_count == 1 )
+    {
+      char ** entry;
+      for ( entry = get_envp(); *entry; entry++ )
+      {
+        printf( "export %s\n", *entry );
+      }
+    }
+
+    size_t itoken;
+    for ( itoken = 1; itoken < tokens_count; itoken++ )
+    {
+      char * assignment = tokens[itoken];
+      char * separator = strchr( assignment, '=' );
+      char * name = separator ? strndup( assignment, ( size_t )( separator - assignment ) ) :
+                                strdup( assignment );
+      const char * value = separator ? separator + 1 : get_variable( name );
+      if ( !is_valid_variable_name( name ) )
+      {
+        ERROR( "export: %s: not a valid identifier", assignment );
+        free( name );
+        free_and_exit( EXIT_FAILURE );
+      }
+      if ( value != NULL )
+      {
+        char * record = (char *)malloc( strlen( name ) + strlen( value ) + 4 );
+        sprintf( record, "E %s=%s", name, value );
+        log_variables_record( record );
+        free( record );
+      }
+      free( name );
+    }
+  }
+  else if ( strcmp( command, "unset" ) == 0 )
+  {
+    size_t itoken;
+    for ( itoken = 1; itoken < tokens_count; itoken++ )
+    {
+      char * record = (char *)malloc( strlen( tokens[itoken] ) + 3 );
+      sprintf( record, "U %s", tokens[itoken] );
+      log_variables_record( record );
+      free( record );
+    }
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Fan-out, `producer |> (consumer, consumer, ...)`.
+ *
+ * The worker starts the producer and the consumers as its own children,
+ * so they are all in the job's process group. The producer writes into
+ * a pipe the worker duplicates into a pipe of every consumer with tee(),
+ * and the last consumer takes the data out of it with splice(). The data
+ * never goes through the worker's memory, and as the pipes are blocking,
+ * the producer never gets ahead of the slowest consumer by more than a pipe.
+ * Every one of the commands can have up to MAX_NUM_ARGUMENTS words.
+ */
+
+#define FAN_OUT_OPERATOR "|>"
+#define MAX_FAN_OUT_CONSUMERS 8
+#define FAN_OUT_CHUNK_SIZE ( 64 * 1024 )
+
+// The lexer does not split "|>(" into tokens, so the operator is looked for inside them.
+static bool is_fan_out( char ** command_tokens )
+{
+  char ** token;
+  for ( token = command_tokens; *token; token++ )
+  {
+    if ( strstr( *token, FAN_OUT_OPERATOR ) != NULL )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// A fan-out goes to the worker as a single token, so the limit of arguments applies
+// to each of its commands, when parse_fan_out() splits them, rather than to the whole
+// of it. Takes the next command of the normalized cmd_line into command_tokens this way,
+// if it is a fan-out, and moves *position past it. Returns false for other commands.
+static bool take_fan_out_command( const char * cmd_line,
+                                  size_t cmd_len,
+                                  size_t * position,
+                                  char ** command_tokens )
+{
+  const char * command = cmd_line + *position;
+  const char * command_end = (const char *)memchr( command, ';', cmd_len - *position );
+  size_t command_len = command_end != NULL ? ( size_t )( command_end - command ) : cmd_len - *position;
+  if ( memmem( command, command_len, FAN_OUT_OPERATOR, strlen( FAN_OUT_OPERATOR ) ) == NULL )
+  {
+    return false;
+  }
+  while ( command_len > 0 && command[0] == ' ' )
+  {
+    command++;
+    command_len--;
+  }
+  while ( command_len > 0 && command[command_len - 1] == ' ' )
+  {
+    command_len--;
+  }
+  command_tokens[0] = strndup( command, command_len );
+  command_tokens[1] = NULL;
+  *position = command_end != NULL ? ( size_t )( command_end - cmd_line ) + 1 : cmd_len;
+  return true;
+}
+
+// The same for the words of a script's command.
+static char * join_fan_out_words( char * const * words, size_t words_count )
+{
+  size_t command_size = 1;
+  size_t iword;
+  for ( iword = 0; iword < words_count; iword++ )
+  {
+    command_size += strlen( words[iword] ) + 1;
+  }
+  char * command = (char *)malloc( command_size );
+  size_t command_len = 0;
+  for ( iword = 0; iword < words_count; iword++ )
+  {
+    command_len += (size_t)snprintf(
+        command + command_len, command_size - command_len, iword == 0 ? "%s" : " %s", words[iword] );
+  }
+  return command;
+}
+
+// Splits text by spaces into argv allocated with malloc(), argv is always
+// followed by NULL. Returns the number of arguments, or -1 if there are too many of them.
+static int split_fan_out_command( char * text, char ** argv )
+{
+  int argc = 0;
+  argv[0] = NULL;
+  char * saveptr = NULL;
+  char * word;
+  for ( word = strtok_r( text, " ", &saveptr ); word != NULL; word = strtok_r( NULL, " ", &saveptr ) )
+  {
+    if ( argc == MAX_NUM_ARGUMENTS )
+    {
+      return -1;
+    }
+    argv[argc++] = strdup( word );
+    argv[argc] = NULL;
+  }
+  return argc;
+}
+
+static void free_fan_out_commands( char * commands[][MAX_NUM_ARGUMENTS + 1], size_t commands_count )
+{
+  size_t icommand;
+  for ( icommand = 0; icommand < commands_count; icommand++ )
+  {
+    char ** argument;
+    for ( argument = commands[icommand]; *argument; argument++ )
+    {
+      free( *argument );
+    }
+  }
+}
+
+// Parses the current tokens into commands, the producer goes first.
+// The commands are to be freed even if it fails, after reporting the error.
+static bool parse_fan_out( char * commands[][MAX_NUM_ARGUMENTS + 1], size_t * commands_count )
+{
+  *commands_count = 0;
+  char line[MAX_COMMAND_SIZE];
+  size_t line_len = 0;
+  char ** token;
+  for ( token = tokens; *token && line_len < sizeof( line ); token++ )
+  {
+    line_len += snprintf( line + line_len,
+                          sizeof( line ) - line_len,
+                          token == tokens ? "%s" : " %s",
+                          *token );
+  }
+
+  char * operator_start = strstr( line, FAN_OUT_OPERATOR );
+  *operator_start = '\0';
+  char * consumers = operator_start + strlen( FAN_OUT_OPERATOR );
+  consumers += strspn( consumers, " " );
+  char * consumers_end = strrchr( consumers, ')' );
+  if ( consumers[0] != '(' || consumers_end == NULL ||
+       consumers_end[1 + strspn( consumers_end + 1, " " )] != '\0' )
+  {
+    ERROR( "%s: usage: producer %s (consumer, consumer, ...)", FAN_OUT_OPERATOR, FAN_OUT_OPERATOR );
+    return false;
+  }
+  *consumers_end = '\0';
+
+  ( *commands_count )++;
+  if ( split_fan_out_command( line, commands[0] ) <= 0 )
+  {
+    ERROR( "%s: bad producer", FAN_OUT_OPERATOR );
+    return false;
+  }
+  char * consumers_rest = consumers + 1;
+  char * consumer;
+  while ( ( consumer = strsep( &consumers_rest, "," ) ) != NULL )
+  {
+    if ( *commands_count == MAX_FAN_OUT_CONSUMERS + 1 )
+    {
+      ERROR( "%s: more than %d consumers", FAN_OUT_OPERATOR, MAX_FAN_OUT_CONSUMERS );
+      return false;
+    }
+    ( *commands_count )++;
+    if ( split_fan_out_command( consumer, commands[*commands_count - 1] ) <= 0 )
+    {
+      ERROR( "%s: bad consumer \"%s\"", FAN_OUT_OPERATOR, consumer );
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs argv in a child with the given ends of the pipes, -1 leaves the worker's one.
+// All the pipes' descriptors are closed in the child, otherwise a builtin could
+// keep a consumer's pipe open until it exits.
+static pid_t start_fan_out_command(
+    char ** argv, int stdin_fd, int stdout_fd, const int * pipe_fds, size_t pipe_fds_count )
+{
+  METRICS_ADD( forks, 1 );
+  pid_t child_pid = fork();
+  if ( child_pid == -1 )
+  {
+    ERROR( "%s: fork failed: %s", argv[0], strerror( errno ) );
+    return -1;
+  }
+  if ( child_pid == 0 )
+  {
+    if ( stdin_fd != -1 )
+    {
+      dup2( stdin_fd, STDIN_FILENO );
+    }
+    if ( stdout_fd != -1 )
+    {
+      dup2( stdout_fd, STDOUT_FILENO );
+    }
+    size_t ifd;
+    for ( ifd = 0; ifd < pipe_fds_count; ifd++ )
+    {
+      close( pipe_fds[ifd] );
+    }
+    // The command's tokens take the place of the fan-out's ones.
+    free_tokens();
+    memcpy( tokens, argv, ( MAX_NUM_ARGUMENTS + 1 ) * sizeof( char * ) );
+    run_worker();
+  }
+  return child_pid;
+}
+
+// Moves up to size bytes with splice(), returns how many of them were moved.
+static size_t splice_all( int input_fd, int output_fd, size_t size )
+{
+  size_t moved = 0;
+  while ( moved < size )
+  {
+    ssize_t chunk = splice( input_fd, NULL, output_fd, NULL, size - moved, SPLICE_F_MOVE );
+    if ( chunk == -1 && errno == EINTR )
+    {
+      continue;
+    }
+    if ( chunk <= 0 )
+    {
+      break;
+    }
+    moved += (size_t)chunk;
+  }
+  return moved;
+}
+
+// Copies exactly size bytes from the head of input_fd into output_fd, leaving them in input_fd.
+// Returns false if the consumer is gone.
+static bool tee_all( int input_fd, int output_fd, size_t size, int * scratch_fds, int null_fd )
+{
+  ssize_t copied;
+  while ( ( copied = tee( input_fd, output_fd, size, 0 ) ) == -1 && errno == EINTR )
+    ;
+  if ( copied == -1 )
+  {
+    return false;
+  }
+  if ( (size_t)copied == size )
+  {
+    return true;
+  }
+
+  // A full consumer's pipe takes only a part, and tee() always starts from the head
+  // of the input. So the chunk is duplicated into an empty pipe of the same size,
+  // the part the consumer already has is dropped there, and the rest is moved on.
+  if ( scratch_fds[0] == -1 )
+  {
+    if ( pipe2( scratch_fds, O_CLOEXEC ) == -1 )
+    {
+      return false;
+    }
+    fcntl( scratch_fds[1], F_SETPIPE_SZ, fcntl( input_fd, F_GETPIPE_SZ ) );
+  }
+  ssize_t duplicated;
+  while ( ( duplicated = tee( input_fd, scratch_fds[1], size, 0 ) ) == -1 && errno == EINTR )
+    ;
+  bool delivered = duplicated == (ssize_t)size &&
+                   splice_all( scratch_fds[0], null_fd, (size_t)copied ) == (size_t)copied &&
+                   splice_all( scratch_fds[0], output_fd, size - (size_t)copied ) == size - (size_t)copied;
+  if ( !delivered )
+  {
+    // Whatever is left would go to the next consumer.
+    int left_size = 0;
+    ioctl( scratch_fds[0], FIONREAD, &left_size );
+    splice_all( scratch_fds[0], null_fd, (size_t)left_size );
+  }
+  return delivered;
+}
+
+static int write_fully( int fd, const char * buf, size_t len );
+
+// Without tee() and splice() for these descriptors, the data goes through a buffer.
+static void fan_out_through_buffer( int input_fd, int * output_fds, size_t outputs_count )
+{
+  static char buffer[FAN_OUT_CHUNK_SIZE];
+  size_t live_outputs_count = outputs_count;
+  ssize_t buffer_len;
+  while ( live_outputs_count > 0 && ( buffer_len = read( input_fd, buffer, sizeof( buffer ) ) ) != 0 )
+  {
+    if ( buffer_len == -1 )
+    {
+      if ( errno == EINTR )
+      {
+        continue;
+      }
+      break;
+    }
+    size_t ioutput;
+    for ( ioutput = 0; ioutput < outputs_count; ioutput++ )
+    {
+      if ( output_fds[ioutput] != -1 && write_fully( output_fds[ioutput], buffer, (size_t)buffer_len ) == -1 )
+      {
+        close( output_fds[ioutput] );
+        output_fds[ioutput] = -1;
+        live_outputs_count--;
+      }
+    }
+  }
+}
+
+// Duplicates input_fd into all the outputs until the producer is done or all the consumers are gone.
+// Consumers which are gone get -1 in output_fds.
+static void fan_out( int input_fd, int * output_fds, size_t outputs_count )
+{
+  int null_fd = open( "/dev/null", O_WRONLY | O_CLOEXEC );
+  int scratch_fds[2] = { -1, -1 };
+  bool moved_any = false;
+  bool finished = false;
+  while ( !finished )
+  {
+    size_t live_outputs[MAX_FAN_OUT_CONSUMERS];
+    size_t live_outputs_count = 0;
+    size_t ioutput;
+    for ( ioutput = 0; ioutput < outputs_count; ioutput++ )
+    {
+      if ( output_fds[ioutput] != -1 )
+      {
+        live_outputs[live_outputs_count++] = ioutput;
+      }
+    }
+    if ( live_outputs_count == 0 )
+    {
+      break;
+    }
+
+    // The first copy sets the size of the chunk, it can't be cut short.
+    ssize_t chunk_size = -1;
+    size_t ilive;
+    for ( ilive = 0; ilive + 1 < live_outputs_count; ilive++ )
+    {
+      int * output_fd = &output_fds[live_outputs[ilive]];
+      bool delivered;
+      if ( chunk_size == -1 )
+      {
+        while ( ( chunk_size = tee( input_fd, *output_fd, FAN_OUT_CHUNK_SIZE, 0 ) ) == -1 &&
+                errno == EINTR )
+          ;
+        if ( chunk_size == -1 && !moved_any && ( errno == EINVAL || errno == ENOSYS ) )
+        {
+          fan_out_through_buffer( input_fd, output_fds, outputs_count );
+          finished = true;
+          break;
+        }
+        finished = chunk_size == 0;
+        if ( chunk_size <= 0 )
+        {
+          if ( chunk_size == -1 )
+          {
+            close( *output_fd );
+            *output_fd = -1;
+          }
+          break;
+        }
+        delivered = true;
+      }
+      else
+      {
+        delivered = tee_all( input_fd, *output_fd, (size_t)chunk_size, scratch_fds, null_fd );
+      }
+      if ( !delivered )
+      {
+        close( *output_fd );
+        *output_fd = -1;
+      }
+      moved_any = true;
+    }
+    if ( finished || ( ilive + 1 < live_outputs_count ) )
+    {
+      // Either the producer is done, or the consumer setting the chunk is gone.
+      continue;
+    }
+
+    // The last consumer takes the chunk out of the input.
+    int * output_fd = &output_fds[live_outputs[live_outputs_count - 1]];
+    if ( chunk_size == -1 )
+    {
+      ssize_t moved;
+      while ( ( moved = splice( input_fd, NULL, *output_fd, NULL, FAN_OUT_CHUNK_SIZE, SPLICE_F_MOVE ) ) ==
+                  -1 &&
+              errno == EINTR )
+        ;
+      if ( moved == -1 && !moved_any && ( errno == EINVAL || errno == ENOSYS ) )
+      {
+        fan_out_through_buffer( input_fd, output_fds, outputs_count );
+        break;
+      }
+      finished = moved == 0;
+      if ( moved == -1 )
+      {
+        close( *output_fd );
+        *output_fd = -1;
+      }
+    }
+    else
+    {
+      size_t moved = splice_all( input_fd, *output_fd, (size_t)chunk_size );
+      if ( moved < (size_t)chunk_size )
+      {
+        close( *output_fd );
+        *output_fd = -1;
+        // The others have the chunk already.
+        splice_all( input_fd, null_fd, (size_t)chunk_size - moved );
+      }
+    }
+    moved_any = true;
+  }
+
+  if ( scratch_fds[0] != -1 )
+  {
+    close( scratch_fds[0] );
+    close( scratch_fds[1] );
+  }
+  if ( null_fd != -1 )
+  {
+    close( null_fd );
+  }
+}
+
+// Exit code of the worker for a child's status, its special codes are not for the liner.
+static int get_fan_out_exit_code( int status )
+{
+  if ( WIFSIGNALED( status ) )
+  {
+    return 128 + WTERMSIG( status );
+  }
+  int exit_code = WEXITSTATUS( status );
+  return exit_code == MSH_EXIT_ALL || exit_code == MSH_EXIT_BG ? EXIT_FAILURE : exit_code;
+}
+
+// Runs the current tokens as a fan-out, the exit code is the first failure
+// of the producer and then of the consumers in their order.
+static int run_fan_out()
+{
+  char * commands[MAX_FAN_OUT_CONSUMERS + 1][MAX_NUM_ARGUMENTS + 1];
+  size_t commands_count;
+  if ( !parse_fan_out( commands, &commands_count ) )
+  {
+    free_fan_out_commands( commands, commands_count );
+    return EXIT_FAILURE;
+  }
+  size_t consumers_count = commands_count - 1;
+
+  // All the pipes are there before the first fork(), so every child can close the others' ones.
+  int pipe_fds[2 * ( MAX_FAN_OUT_CONSUMERS + 1 )];
+  size_t pipe_fds_count = 0;
+  size_t icommand;
+  for ( icommand = 0; icommand < commands_count; icommand++ )
+  {
+    if ( pipe2( pipe_fds + pipe_fds_count, O_CLOEXEC ) == -1 )
+    {
+      ERROR( "%s: failed to create a pipe: %s", FAN_OUT_OPERATOR, strerror( errno ) );
+      for ( ; pipe_fds_count > 0; pipe_fds_count-- )
+      {
+        close( pipe_fds[pipe_fds_count - 1] );
+      }
+      free_fan_out_commands( commands, commands_count );
+      return EXIT_FAILURE;
+    }
+    pipe_fds_count += 2;
+  }
+  // The producer's pipe goes first, then a pipe for every consumer.
+  int input_fd = pipe_fds[0];
+  int output_fds[MAX_FAN_OUT_CONSUMERS];
+  pid_t child_pids[MAX_FAN_OUT_CONSUMERS + 1];
+
+  // Consumers go first, so they are ready when the producer starts writing.
+  size_t iconsumer;
+  for ( iconsumer = 0; iconsumer < consumers_count; iconsumer++ )
+  {
+    int * consumer_pipe_fds = pipe_fds + 2 * ( iconsumer + 1 );
+    child_pids[iconsumer + 1] =
+        start_fan_out_command( commands[iconsumer + 1], consumer_pipe_fds[0], -1, pipe_fds, pipe_fds_count );
+    close( consumer_pipe_fds[0] );
+    output_fds[iconsumer] = consumer_pipe_fds[1];
+    if ( child_pids[iconsumer + 1] == -1 )
+    {
+      close( output_fds[iconsumer] );
+      output_fds[iconsumer] = -1;
+    }
+  }
+  child_pids[0] = start_fan_out_command( commands[0], -1, pipe_fds[1], pipe_fds, pipe_fds_count );
+  close( pipe_fds[1] );
+  free_fan_out_commands( commands, commands_count );
+
+  // Consumers which are gone are noticed by EPIPE.
+  signal( SIGPIPE, SIG_IGN );
+  if ( child_pids[0] != -1 )
+  {
+    fan_out( input_fd, output_fds, consumers_count );
+  }
+  close( input_fd );
+  for ( iconsumer = 0; iconsumer < consumers_count; iconsumer++ )
+  {
+    if ( output_fds[iconsumer] != -1 )
+    {
+      close( output_fds[iconsumer] );
+    }
+  }
+
+  int exit_code = child_pids[0] == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+  for ( icommand = 0; icommand < commands_count; icommand++ )
+  {
+    int status = 0;
+    if ( child_pids[icommand] == -1 )
+    {
+      continue;
+    }
+    while ( waitpid( child_pids[icommand], &status, 0 ) == -1 && errno == EINTR )
+      ;
+    if ( exit_code == EXIT_SUCCESS )
+    {
+      exit_code = get_fan_out_exit_code( status );
+    }
+  }
+  return exit_code;
+}
+
+// Run a single command from semicolon-delimited line.
+void run_worker()
+{
+  assert( my_process_type == PROCESS_TYPE_WORKER );
+  LOG( "Entering worker" );
+  size_t tokens_count;
+  for ( tokens_count = 0; tokens[tokens_count]; tokens_count++ )
+    ;
+
+  if ( tokens_count == 0 )
+  {
+    LOG( "Liner: command is empty, skipping..." );
+    free_and_exit( EXIT_SUCCESS );
+  }
+
+  char * command = tokens[0];
+  if ( command == NULL )
+  {
+    ERROR( "Something bad happened while tokens processing" );
+    free_and_exit( EXIT_FAILURE );
+  }
+
+  LOG( "Running worker, command %s", command );
+
+  if ( is_fan_out( tokens ) )
+  {
+    free_and_exit( run_fan_out() );
+  }
+  if ( is_fast_builtin( command ) )
+  {
+    free_and_exit( run_fast_builtin( tokens ) );
+  }
+  if ( !run_builtin( tokens_count ) )
+  {
+    free_and_exit( exec_external_command( tokens ) );
+  }
+
+  free_and_exit( EXIT_SUCCESS );
+}
+
+// Parses a duration like "10", "1.5s", "250ms", "2m" or "1h" (seconds if no suffix).
+static bool parse_duration_ms( const char * text, unsigned long * duration_ms )
+{
+  char * suffix;
+  errno = 0;
+  double duration = strtod( text, &suffix );
+  if ( suffix == text || errno != 0 || !( duration >= 0 ) )
+  {
+    return false;
+  }
+
+  if ( strcmp( suffix, "ms" ) == 0 )
+  {
+  }
+  else if ( strcmp( suffix, "" ) == 0 || strcmp( suffix, "s" ) == 0 )
+  {
+    duration *= 1000;
+  }
+  else if ( strcmp( suffix, "m" ) == 0 )
+  {
+    duration *= 60 * 1000;
+  }
+  else if ( strcmp( suffix, "h" ) == 0 )
+  {
+    duration *= 60 * 60 * 1000;
+  }
+  else
+  {
+    return false;
+  }
+
+  // Deadlines are passed to the shell as int, and nobody waits for 24 days anyway.
+  if ( duration > INT_MAX )
+  {
+    duration = INT_MAX;
+  }
+  *duration_ms = (unsigned long)duration;
+  if ( *duration_ms == 0 && duration > 0 )
+  {
+    *duration_ms = 1;
+  }
+  return true;
+}
+
+// Strips "timeout DURATION" from the current tokens and returns the deadline
+// of the command in milliseconds. Without it, MSH_TIMEOUT is used as the default
+// for every command. 0 means no deadline.
+static unsigned long take_command_timeout()
+{
+  unsigned long timeout_ms = 0;
+  if ( strcmp( tokens[0], "timeout" ) == 0 )
+  {
+    if ( tokens[1] == NULL || tokens[2] == NULL )
+    {
+      ERROR( "timeout: usage: timeout DURATION command [arguments]" );
+      free_and_exit( EXIT_FAILURE );
+    }
+    if ( !parse_duration_ms( tokens[1], &timeout_ms ) )
+    {
+      ERROR( "timeout: invalid duration: %s", tokens[1] );
+      free_and_exit( EXIT_FAILURE );
+    }
+
+    free( tokens[0] );
+    free( tokens[1] );
+    memmove( tokens, tokens + 2, ( MAX_NUM_ARGUMENTS - 1 ) * sizeof( char * ) );
+    tokens[MAX_NUM_ARGUMENTS - 1] = NULL;
+    tokens[MAX_NUM_ARGUMENTS] = NULL;
+    return timeout_ms;
+  }
+
+  const char * default_timeout = get_variable( "MSH_TIMEOUT" );
+  if ( default_timeout != NULL && !parse_duration_ms( default_timeout, &timeout_ms ) )
+  {
+    LOG( "Ignoring invalid MSH_TIMEOUT: %s", default_timeout );
+    timeout_ms = 0;
+  }
+  return timeout_ms;
+}
+
+// Writes the started record of the command the liner is about to become,
+// so the shell reads the liner's status as the command's one.
+static void save_tail_exec_record()
+{
+  if ( one_shot_mode )
+  {
+    return;
+  }
+  worker_record.pid = getpid();
+  char line[PROCESS_RECORD_LINE_SIZE];
+  format_process_record( &worker_record, line, sizeof( line ) );
+  line[0] = 'X';
+  save_record_line_with_liner( line );
+}
+
+/*
+ * Here-documents and here-strings give a command its input right on its line:
+ *
+ *   cat <<EOF (or << EOF)   the lines after the command line, up to EOF
+ *   cat <<< words           the rest of the command's words and a newline
+ *
+ * The content goes to a sealed memfd, which the command gets as its stdin:
+ * nothing is written to disk or left to clean up, and the command sees a
+ * regular file it can seek and map. A command can have one of them.
+ */
+#define HERE_DOCUMENT_NAME "msh-input"
+
+typedef enum input_redirection_t
+{
+  INPUT_REDIRECTION_NONE = 0,
+  INPUT_REDIRECTION_HERE_DOCUMENT,
+  INPUT_REDIRECTION_HERE_STRING,
+  // A second one, or a here-document without a delimiter.
+  INPUT_REDIRECTION_INVALID
+} input_redirection_t;
+
+// Bodies of the here-documents of the current line, in the order of their commands.
+// The shell reads them together with the line, the liner takes them one by one.
+static char ** here_documents = NULL;
+static size_t here_documents_count = 0;
+static size_t next_here_document = 0;
+
+// Input of the command the liner is starting, NULL if it has none.
+static char * input_document = NULL;
+static size_t input_document_len = 0;
+
+static bool has_input_redirection( char * const * command_tokens )
+{
+  for ( ; *command_tokens != NULL; command_tokens++ )
+  {
+    if ( strncmp( *command_tokens, "<<", 2 ) == 0 )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Finds the here-document or the here-string in words, taking the words from *start to *end.
+// *delimiter is set to the delimiter of a here-document.
+static input_redirection_t find_input_redirection(
+    char * const * words, size_t words_count, size_t * start, size_t * end, const char ** delimiter )
+{
+  size_t iword;
+  for ( iword = 0; iword < words_count && strncmp( words[iword], "<<", 2 ) != 0; iword++ )
+    ;
+  if ( iword == words_count )
+  {
+    return INPUT_REDIRECTION_NONE;
+  }
+
+  *start = iword;
+  if ( strcmp( words[iword], "<<<" ) == 0 )
+  {
+    // The here-string takes all the words after it.
+    *end = words_count;
+    return INPUT_REDIRECTION_HERE_STRING;
+  }
+
+  *delimiter = words[iword] + 2;
+  *end = iword + 1;
+  if ( **delimiter == '\0' )
+  {
+    if ( *end == words_count )
+    {
+      return INPUT_REDIRECTION_INVALID;
+    }
+    *delimiter = words[( *end )++];
+  }
+  size_t iextra;
+  for ( iextra = *end; iextra < words_count; iextra++ )
+  {
+    if ( strncmp( words[iextra], "<<", 2 ) == 0 )
+    {
+      return INPUT_REDIRECTION_INVALID;
+    }
+  }
+  return INPUT_REDIRECTION_HERE_DOCUMENT;
+}
+
+// Content of a here-string: its words separated by spaces, and a newline.
+static char * join_here_string( char * const * words, size_t words_count, size_t * len )
+{
+  size_t content_size = 2;
+  size_t iword;
+  for ( iword = 0; iword < words_count; iword++ )
+  {
+    content_size += strlen( words[iword] ) + 1;
+  }
+  char * content = (char *)malloc( content_size );
+  *len = 0;
+  for ( iword = 0; iword < words_count; iword++ )
+  {
+    *len += (size_t)sprintf( content + *len, iword ? " %s" : "%s", words[iword] );
+  }
+  content[( *len )++] = '\n';
+  content[*len] = '\0';
+  return content;
+}
+
+// Adds a line of input to the body of a here-document, unless it is the delimiter.
+// Returns false on the delimiter, which ends the body.
+static bool add_here_document_line( char ** body,
+                                    size_t * body_len,
+                                    const char * line,
+                                    const char * delimiter )
+{
+  size_t line_len = strlen( line );
+  size_t text_len = strcspn( line, "\r\n" );
+  if ( text_len == strlen( delimiter ) && strncmp( line, delimiter, text_len ) == 0 )
+  {
+    return false;
+  }
+  *body = (char *)realloc( *body, *body_len + line_len + 1 );
+  memcpy( *body + *body_len, line, line_len + 1 );
+  *body_len += line_len;
+  return true;
+}
+
+// Makes content the stdin of the process. Without memfd_create() (kernels before 3.17)
+// the content goes through a pipe, with a writer process only if it is more than
+// the pipe can hold.
+static bool redirect_input_document( const char * content, size_t len )
+{
+  int fd = memfd_create( HERE_DOCUMENT_NAME, MFD_CLOEXEC | MFD_ALLOW_SEALING );
+  if ( fd != -1 )
+  {
+    // Sealed, the content stays the same for everyone sharing the descriptor.
+    if ( write_fully( fd, content, len ) == -1 ||
+         fcntl( fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL ) == -1 ||
+         lseek( fd, 0, SEEK_SET ) == -1 || dup2( fd, STDIN_FILENO ) == -1 )
+    {
+      ERROR( "msh: failed to prepare the input: %s", strerror( errno ) );
+      close( fd );
+      return false;
+    }
+    close( fd );
+    return true;
+  }
+
+  int pipe_fds[2];
+  if ( pipe2( pipe_fds, O_CLOEXEC ) == -1 )
+  {
+    ERROR( "msh: failed to prepare the input: %s", strerror( errno ) );
+    return false;
+  }
+  int pipe_size = fcntl( pipe_fds[1], F_GETPIPE_SZ );
+  if ( pipe_size != -1 && len <= (size_t)pipe_size )
+  {
+    write_fully( pipe_fds[1], content, len );
+  }
+  else
+  {
+    // The writer streams the content while the command reads it. It is forked
+    // through an intermediate process, which exits at once: the command is exec()'ed
+    // in this one and would never reap the writer, leaving it a zombie.
+    METRICS_ADD( forks, 2 );
+    pid_t intermediate_pid = fork();
+    if ( intermediate_pid == 0 )
+    {
+      pid_t writer_pid = fork();
+      if ( writer_pid == 0 )
+      {
+        close( pipe_fds[0] );
+        _exit( write_fully( pipe_fds[1], content, len ) == -1 ? EXIT_FAILURE : EXIT_SUCCESS );
+      }
+      _exit( writer_pid == -1 ? EXIT_FAILURE : EXIT_SUCCESS );
+    }
+    int intermediate_status = 0;
+    while ( intermediate_pid != -1 && waitpid( intermediate_pid, &intermediate_status, 0 ) == -1 &&
+            errno == EINTR )
+      ;
+    if ( intermediate_pid == -1 || !WIFEXITED( intermediate_status ) ||
+         WEXITSTATUS( intermediate_status ) != EXIT_SUCCESS )
+    {
+      ERROR( "msh: failed to start the input writer" );
+      close( pipe_fds[0] );
+      close( pipe_fds[1] );
+      return false;
+    }
+  }
+  close( pipe_fds[1] );
+  bool redirected = dup2( pipe_fds[0], STDIN_FILENO ) != -1;
+  close( pipe_fds[0] );
+  return redirected;
+}
+
+// Takes the here-document or here-string out of tokens, keeping its content for start_worker().
+// Returns the count of tokens left, or -1 if it is wrong.
+static int take_input_document( size_t tokens_count )
+{
+  size_t start = 0;
+  size_t end = 0;
+  const char * delimiter = NULL;
+  switch ( find_input_redirection( tokens, tokens_count, &start, &end, &delimiter ) )
+  {
+    case INPUT_REDIRECTION_NONE:
+      return (int)tokens_count;
+    case INPUT_REDIRECTION_HERE_STRING:
+      input_document = join_here_string( tokens + start + 1, end - start - 1, &input_document_len );
+      break;
+    case INPUT_REDIRECTION_HERE_DOCUMENT:
+      if ( next_here_document == here_documents_count )
+      {
+        // Like in msh -c, which has no lines after the command line.
+        ERROR( "%s: the here-document has no lines", tokens[0] );
+        return -1;
+      }
+      input_document = strdup( here_documents[next_here_document++] );
+      input_document_len = strlen( input_document );
+      break;
+    case INPUT_REDIRECTION_INVALID:
+      ERROR( "%s: wrong input, a here-document needs a delimiter and only one is allowed", tokens[0] );
+      return -1;
+  }
+
+  // Words after a here-document are still the command's arguments.
+  size_t itoken;
+  for ( itoken = start; itoken < end; itoken++ )
+  {
+    free( tokens[itoken] );
+  }
+  memmove( tokens + start, tokens + end, ( tokens_count - end + 1 ) * sizeof( char * ) );
+  return (int)( tokens_count - ( end - start ) );
+}
+
+static void free_here_documents()
+{
+  size_t idocument;
+  for ( idocument = 0; idocument < here_documents_count; idocument++ )
+  {
+    free( here_documents[idocument] );
+  }
+  free( here_documents );
+  here_documents = NULL;
+  here_documents_count = 0;
+  next_here_document = 0;
+  free( input_document );
+  input_document = NULL;
+  input_document_len = 0;
+}
+
+// Starts worker with current set of tokens.
+// The last command of the line is executed in place of the liner instead,
+// as nothing is left for the liner to do after it: that saves a fork() and a wait.
+// Commands with a deadline still need the liner to watch them.
+void start_worker( bool last_command )
+{
+  assert( my_process_type == PROCESS_TYPE_LINER );
+
+  command_timeout_ms = take_command_timeout();
+
+  // In one-shot mode the state of msh is the liner's state,
+  // so builtins changing it are run right here instead of a worker.
+  if ( one_shot_mode && is_state_builtin( tokens[0] ) )
+  {
+    size_t tokens_count;
+    for ( tokens_count = 0; tokens[tokens_count]; tokens_count++ )
+      ;
+    run_builtin( tokens_count );
+    return;
+  }
+
+  // Trivial utilities do not need a worker at all, unless they feed a fan-out.
+  if ( is_fast_builtin( tokens[0] ) && !is_fan_out( tokens ) )
+  {
+    TRACE_BEGIN( "builtin", tokens[0] );
+    int status = run_fast_builtin( tokens );
+    TRACE_END( "builtin" );
+    if ( status != EXIT_SUCCESS )
+    {
+      // The same as for a failed worker.
+      free_and_exit( one_shot_mode ? status : EXIT_FAILURE );
+    }
+    return;
+  }
+
+  // Whatever the liner has written goes before the worker's output,
+  // and should not be inherited by the worker to be written twice.
+  fflush( stdout );
+
+  // The record is ready before the fork, as the worker can finish before fork() returns.
+  memset( &worker_record, 0, sizeof( worker_record ) );
+  worker_record.start_us = get_realtime_us();
+  size_t command_len = 0;
+  char ** token;
+  for ( token = tokens; *token && command_len + 1 < PROCESS_RECORD_COMMAND_SIZE; token++ )
+  {
+    command_len += snprintf( worker_record.command + command_len,
+                             PROCESS_RECORD_COMMAND_SIZE - command_len,
+                             token == tokens ? "%s" : " %s",
+                             *token );
+  }
+
+  if ( last_command && command_timeout_ms == 0 && !is_builtin( tokens[0] ) && !is_fan_out( tokens ) )
+  {
+    TRACE_INSTANT( "tail exec", tokens[0] );
+    save_tail_exec_record();
+    // The command gets the signal handling a worker would have.
+    signal( SIGCONT, SIG_DFL );
+    signal( SIGCHLD, SIG_DFL );
+    signal( SIGTERM, SIG_DFL );
+    set_event_signals_blocked( false );
+    if ( input_document != NULL && !redirect_input_document( input_document, input_document_len ) )
+    {
+      free_and_exit( EXIT_FAILURE );
+    }
+    int exit_code = exec_external_command( tokens );
+    // The shell takes the status as is, no special codes are possible.
+    free_and_exit( exit_code );
+  }
+
+  last_worker_exited = false;
+  TRACE_BEGIN( "fork", "worker" );
+  METRICS_ADD( forks, 1 );
+  liner_child_pid = fork();
+  if ( liner_child_pid == 0 )
+  {
+    trace_process_started( "worker" );
+    log_process_started();
+    // Initializing worker.
+    // Setting SIGCONT and SIGCHLD signals to default handlers,
+    // as we are not going to follow the worker's children,
+    // and default SIGCONT is fine with us.
+    signal( SIGCONT, SIG_DFL );
+    signal( SIGCHLD, SIG_DFL );
+    signal( SIGTERM, SIG_DFL );
+    set_event_signals_blocked( false );
+    if ( one_shot_mode && command_timeout_ms != 0 )
+    {
+      // Without the shell the worker leads the process group to be signalled
+      // on its deadline, the same way timeout(1) runs commands.
+      setpgid( 0, 0 );
+    }
+    my_process_type = PROCESS_TYPE_WORKER;
+    if ( input_document != NULL && !redirect_input_document( input_document, input_document_len ) )
+    {
+      free_and_exit( EXIT_FAILURE );
+    }
+    run_worker();
+  }
+  else
+  {
+    TRACE_END( "fork" );
+    TRACE_ASYNC_BEGIN( "command", liner_child_pid, tokens[0] );
+    LOG( "Forked a new child worker with pid %d", liner_child_pid );
+
+    // Store pid, so the shell process will be able to read it afterwards.
+    save_worker_pid_with_liner( liner_child_pid );
+
+    if ( command_timeout_ms != 0 )
+    {
+      start_command_deadline( liner_child_pid );
+    }
+
+    // Wait for any change in the currently forked worker's state.
+    // Flag last_worker_exited tells us if it is still alive.
+    while ( !last_worker_exited )
+    {
+      poll_shell_events( -1 );
+    }
+
+    if ( command_timeout_ms != 0 )
+    {
+      cancel_command_deadline();
+    }
+    trace_flush();
+  }
+}
+
+/*
+ * run_liner takes null-terminated cmd_line,
+ * with only spaces and semicolons allowed between tokens
+ * Tries to extract tokens sequences consisting one command to run.
+ * All commands in the input sequence cmd_line are separated by ' ; '.
+ */
+void run_liner()
+{
+  assert( my_process_type == PROCESS_TYPE_LINER );
+  size_t cmd_len = strlen( cmd_line );
+  LOG( "Entering liner, cmd_line = \"%s\", cmd_len = %lu", cmd_line, cmd_len );
+
+  size_t position = 0;
+  while ( position < cmd_len )
+  {
+    int tokens_count = take_fan_out_command( cmd_line, cmd_len, &position, tokens ) ?
+                           1 :
+                           tokenize_next_command( cmd_line, cmd_len, &position, tokens );
+    if ( tokens_count == -1 )
+    {
+      ERROR( "liner: Too much tokens already" );
+      free_and_exit( EXIT_FAILURE );
+    }
+    if ( tokens_count > 0 )
+    {
+      tokens_count = take_input_document( (size_t)tokens_count );
+      if ( tokens_count == -1 )
+      {
+        free_and_exit( EXIT_FAILURE );
+      }
+    }
+
+    // Empty commands (like in "ls ; ; ls") are skipped.
+    if ( tokens_count > 0 )
+    {
+      // It's time to send current tokens sequence to execution.
+      // Only empty commands may follow the last one.
+      bool last_command = strspn( cmd_line + position, " ;" ) == cmd_len - position;
+      start_worker( last_command );
+    }
+
+    // Free tokens expecting the other command coming after ';'
+    free_tokens();
+    free( input_document );
+    input_document = NULL;
+  }
+
+  free_and_exit( EXIT_SUCCESS );
+}
+
+// Command names for Tab completion are stored in a prefix tree.
+// Nodes live in one growing array and refer to each other by index,
+// so rebuilding the tree is just resetting the array.
+typedef struct completion_node_t
+{
+  char c;
+  // The path from the root to this node spells a full command name.
+  bool terminal;
+  // Indices of the first child and the next sibling, 0 means none
+  // (the root is node 0, so it can not be anyone's child).
+  size_t child;
+  size_t sibling;
+} completion_node_t;
+
+static completion_node_t * completion_nodes = NULL;
+static size_t completion_nodes_count = 0;
+static size_t completion_nodes_capacity = 0;
+
+// The tree is built from the directories of PATH, and it stays valid
+// until PATH value or modification time of some directory changes.
+#define MAX_COMPLETION_DIRS 32
+typedef struct completion_dir_t
+{
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+} completion_dir_t;
+
+static char * completion_search_path = NULL;
+static completion_dir_t completion_dirs[MAX_COMPLETION_DIRS];
+static size_t completion_dirs_count = 0;
+
+// Commands run by msh itself, they are completed as well.
+static const char * builtin_command_names[] = {
+    "bench", "bg", "cd", "echo", "exit", "export", "false", "history", "listpids", "logdump",
+    "prefetch", "printf", "pwd", "queue", "quit", "showpids", "stats", "submit", "test", "true",
+    "unset", "watch", "xargs", NULL };
+
+static size_t new_completion_node( char c )
+{
+  if ( completion_nodes_count == completion_nodes_capacity )
+  {
+    completion_nodes_capacity = completion_nodes_capacity ? 2 * completion_nodes_capacity : 1024;
+    completion_nodes = (completion_node_t *)realloc(
+        completion_nodes, completion_nodes_capacity * sizeof( completion_node_t ) );
+  }
+  completion_node_t * node = &completion_nodes[completion_nodes_count];
+  node->c = c;
+  node->terminal = false;
+  node->child = 0;
+  node->sibling = 0;
+  return completion_nodes_count++;
+}
+
+// Returns child of the node with character c, or 0 if there is no such child.
+static size_t find_completion_child( size_t node, char c )
+{
+  size_t child = completion_nodes[node].child;
+  while ( child != 0 && completion_nodes[child].c != c )
+  {
+    child = completion_nodes[child].sibling;
+  }
+  return child;
+}
+
+static void add_completion_word( const char * word )
+{
+  size_t node = 0;
+  for ( ; *word; word++ )
+  {
+    size_t child = find_completion_child( node, *word );
+    if ( child == 0 )
+    {
+      child = new_completion_node( *word );
+      completion_nodes[child].sibling = completion_nodes[node].child;
+      completion_nodes[node].child = child;
+    }
+    node = child;
+  }
+  completion_nodes[node].terminal = true;
+}
+
+// Checks if the tree has been built for the current PATH and directories content.
+static bool is_completion_tree_valid( const char * search_path )
+{
+  if ( completion_nodes_count == 0 || completion_search_path == NULL ||
+       strcmp( completion_search_path, search_path ) != 0 )
+  {
+    return false;
+  }
+
+  size_t idir = 0;
+  const char * dir = search_path;
+  while ( idir < completion_dirs_count )
+  {
+    const char * dir_end = strchrnul( dir, ':' );
+    char * dir_name = dir_end == dir ? strdup( "." ) : strndup( dir, ( size_t )( dir_end - dir ) );
+    struct stat dir_stat;
+    bool same = stat( dir_name, &dir_stat ) == 0 && dir_stat.st_dev == completion_dirs[idir].dev &&
+                dir_stat.st_ino == completion_dirs[idir].ino &&
+                dir_stat.st_mtim.tv_sec == completion_dirs[idir].mtime.tv_sec &&
+                dir_stat.st_mtim.tv_nsec == completion_dirs[idir].mtime.tv_nsec;
+    free( dir_name );
+    if ( !same )
+    {
+      return false;
+    }
+    idir++;
+    dir = *dir_end ? dir_end + 1 : dir_end;
+  }
+  return true;
+}
+
+// Build the tree of commands lazily, with the same directories order run_worker() uses.
+static void update_completion_tree()
+{
+  const char * search_path = get_variable( "PATH" );
+  if ( search_path == NULL )
+  {
+    search_path = DEFAULT_SEARCH_PATH;
+  }
+  if ( is_completion_tree_valid( search_path ) )
+  {
+    return;
+  }
+
+  LOG( "Rebuilding completion tree for PATH %s", search_path );
+  completion_nodes_count = 0;
+  new_completion_node( '\0' );
+  free( completion_search_path );
+  completion_search_path = strdup( search_path );
+  completion_dirs_count = 0;
+
+  const char ** builtin_name;
+  for ( builtin_name = builtin_command_names; *builtin_name; builtin_name++ )
+  {
+    add_completion_word( *builtin_name );
+  }
+
+  const char * dir = search_path;
+  while ( completion_dirs_count < MAX_COMPLETION_DIRS )
+  {
+    const char * dir_end = strchrnul( dir, ':' );
+    char * dir_name = dir_end == dir ? strdup( "." ) : strndup( dir, ( size_t )( dir_end - dir ) );
+    completion_dir_t * completion_dir = &completion_dirs[completion_dirs_count++];
+    memset( completion_dir, 0, sizeof( completion_dir_t ) );
+
+    DIR * dir_stream = opendir( dir_name );
+    struct stat dir_stat;
+    if ( dir_stream != NULL && fstat( dirfd( dir_stream ), &dir_stat ) == 0 )
+    {
+      completion_dir->dev = dir_stat.st_dev;
+      completion_dir->ino = dir_stat.st_ino;
+      completion_dir->mtime = dir_stat.st_mtim;
+
+      struct dirent * entry;
+      while ( ( entry = readdir( dir_stream ) ) != NULL )
+      {
+        if ( entry->d_name[0] != '.' && entry->d_type != DT_DIR &&
+             faccessat( dirfd( dir_stream ), entry->d_name, X_OK, 0 ) == 0 )
+        {
+          add_completion_word( entry->d_name );
+        }
+      }
+    }
+    if ( dir_stream != NULL )
+    {
+      closedir( dir_stream );
+    }
+    free( dir_name );
+
+    if ( *dir_end == '\0' )
+    {
+      break;
+    }
+    dir = dir_end + 1;
+  }
+}
+
+// Candidates for completion of the word under cursor.
+#define MAX_COMPLETION_CANDIDATES 256
+typedef struct completion_candidates_t
+{
+  char * names[MAX_COMPLETION_CANDIDATES];
+  size_t count;
+  // Total number of matches, there could be more than we keep.
+  size_t total_count;
+  // Length of the prefix common to all the matches, the ones not kept as well.
+  size_t common_len;
+} completion_candidates_t;
+
+static void add_completion_candidate( completion_candidates_t * candidates, const char * name )
+{
+  if ( candidates->total_count == 0 )
+  {
+    candidates->common_len = strlen( name );
+  }
+  else
+  {
+    size_t ichar = 0;
+    while ( ichar < candidates->common_len && name[ichar] == candidates->names[0][ichar] )
+    {
+      ichar++;
+    }
+    candidates->common_len = ichar;
+  }
+  if ( candidates->count < MAX_COMPLETION_CANDIDATES )
+  {
+    candidates->names[candidates->count++] = strdup( name );
+  }
+  candidates->total_count++;
+}
+
+static void free_completion_candidates( completion_candidates_t * candidates )
+{
+  size_t icandidate;
+  for ( icandidate = 0; icandidate < candidates->count; icandidate++ )
+  {
+    free( candidates->names[icandidate] );
+  }
+  candidates->count = 0;
+  candidates->total_count = 0;
+}
+
+// Depth-first traversal collecting all the words below node,
+// word_buf already contains the path to the node of word_len length.
+static void collect_completion_words( size_t node,
+                                      char * word_buf,
+                                      size_t word_len,
+                                      completion_candidates_t * candidates )
+{
+  if ( completion_nodes[node].terminal )
+  {
+    word_buf[word_len] = '\0';
+    add_completion_candidate( candidates, word_buf );
+  }
+  if ( word_len + 1 >= MAX_COMMAND_SIZE )
+  {
+    return;
+  }
+  size_t child;
+  for ( child = completion_nodes[node].child; child != 0; child = completion_nodes[child].sibling )
+  {
+    word_buf[word_len] = completion_nodes[child].c;
+    collect_completion_words( child, word_buf, word_len + 1, candidates );
+  }
+}
+
+static void complete_command_name( const char * prefix, completion_candidates_t * candidates )
+{
+  update_completion_tree();
+
+  size_t node = 0;
+  const char * c;
+  for ( c = prefix; *c; c++ )
+  {
+    node = find_completion_child( node, *c );
+    if ( node == 0 )
+    {
+      return;
+    }
+  }
+
+  char word_buf[MAX_COMMAND_SIZE];
+  size_t prefix_len = strlen( prefix );
+  memcpy( word_buf, prefix, prefix_len );
+  collect_completion_words( node, word_buf, prefix_len, candidates );
+}
+
+// Directory listings are cached for path completion,
+// so pressing Tab again and again does not rescan the directory.
+#define COMPLETION_DIR_CACHE_SIZE 8
+typedef struct cached_dir_listing_t
+{
+  char * path;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  // Entries names, directories have '/' appended.
+  char ** names;
+  size_t names_count;
+  // Time of the last use for evicting the least recently used listing.
+  unsigned long last_used;
+} cached_dir_listing_t;
+
+static cached_dir_listing_t dir_listings_cache[COMPLETION_DIR_CACHE_SIZE];
+static unsigned long dir_listings_clock = 0;
+
+static void free_dir_listing( cached_dir_listing_t * listing )
+{
+  size_t iname;
+  for ( iname = 0; iname < listing->names_count; iname++ )
+  {
+    free( listing->names[iname] );
+  }
+  free( listing->names );
+  free( listing->path );
+  memset( listing, 0, sizeof( cached_dir_listing_t ) );
+}
+
+// Returns up to date listing of the directory or NULL, if it can't be read.
+static cached_dir_listing_t * get_dir_listing( const char * path )
+{
+  struct stat dir_stat;
+  if ( stat( path, &dir_stat ) != 0 || !S_ISDIR( dir_stat.st_mode ) )
+  {
+    return NULL;
+  }
+
+  cached_dir_listing_t * listing = NULL;
+  size_t ilisting;
+  for ( ilisting = 0; ilisting < COMPLETION_DIR_CACHE_SIZE; ilisting++ )
+  {
+    cached_dir_listing_t * candidate = &dir_listings_cache[ilisting];
+    if ( candidate->path != NULL && strcmp( candidate->path, path ) == 0 )
+    {
+      listing = candidate;
+      break;
+    }
+    if ( listing == NULL || candidate->last_used < listing->last_used )
+    {
+      listing = candidate;
+    }
+  }
+
+  listing->last_used = ++dir_listings_clock;
+  if ( listing->path != NULL && strcmp( listing->path, path ) == 0 &&
+       listing->dev == dir_stat.st_dev && listing->ino == dir_stat.st_ino &&
+       listing->mtime.tv_sec == dir_stat.st_mtim.tv_sec &&
+       listing->mtime.tv_nsec == dir_stat.st_mtim.tv_nsec )
+  {
+    return listing;
+  }
+
+  LOG( "Reading directory %s for completion", path );
+  free_dir_listing( listing );
+  listing->path = strdup( path );
+  listing->dev = dir_stat.st_dev;
+  listing->ino = dir_stat.st_ino;
+  listing->mtime = dir_stat.st_mtim;
+  listing->last_used = dir_listings_clock;
+
+  DIR * dir_stream = opendir( path );
+  if ( dir_stream == NULL )
+  {
+    return listing;
+  }
+  size_t names_capacity = 0;
+  struct dirent * entry;
+  while ( ( entry = readdir( dir_stream ) ) != NULL )
+  {
+    if ( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 )
+    {
+      continue;
+    }
+
+    bool is_dir = entry->d_type == DT_DIR;
+    if ( entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK )
+    {
+      struct stat entry_stat;
+      is_dir = fstatat( dirfd( dir_stream ), entry->d_name, &entry_stat, 0 ) == 0 &&
+               S_ISDIR( entry_stat.st_mode );
+    }
+
+    if ( listing->names_count == names_capacity )
+    {
+      names_capacity = names_capacity ? 2 * names_capacity : 64;
+      listing->names = (char **)realloc( listing->names, names_capacity * sizeof( char * ) );
+    }
+    size_t name_len = strlen( entry->d_name );
+    char * name = (char *)malloc( name_len + 2 );
+    memcpy( name, entry->d_name, name_len );
+    name[name_len] = is_dir ? '/' : '\0';
+    name[name_len + 1] = '\0';
+    listing->names[listing->names_count++] = name;
+  }
+  closedir( dir_stream );
+  return listing;
+}
+
+static void free_completion_caches()
+{
+  size_t ilisting;
+  for ( ilisting = 0; ilisting < COMPLETION_DIR_CACHE_SIZE; ilisting++ )
+  {
+    free_dir_listing( &dir_listings_cache[ilisting] );
+  }
+  free( completion_nodes );
+  completion_nodes = NULL;
+  completion_nodes_count = completion_nodes_capacity = 0;
+  free( completion_search_path );
+  completion_search_path = NULL;
+}
+
+// Candidates are full words: the directory part of word followed by entry name.
+static void complete_path( const char * word, completion_candidates_t * candidates )
+{
+  const char * last_slash = strrchr( word, '/' );
+  char * dir_path;
+  const char * name_prefix;
+  if ( last_slash == NULL )
+  {
+    dir_path = strdup( "." );
+    name_prefix = word;
+  }
+  else
+  {
+    dir_path = last_slash == word ? strdup( "/" ) : strndup( word, ( size_t )( last_slash - word ) );
+    name_prefix = last_slash + 1;
+  }
+  size_t dir_part_len = last_slash ? ( size_t )( last_slash - word ) + 1 : 0;
+  size_t name_prefix_len = strlen( name_prefix );
+
+  cached_dir_listing_t * listing = get_dir_listing( dir_path );
+  free( dir_path );
+  if ( listing == NULL )
+  {
+    return;
+  }
+
+  size_t iname;
+  for ( iname = 0; iname < listing->names_count; iname++ )
+  {
+    const char * name = listing->names[iname];
+    // Hidden files are only completed if user asks for them explicitly.
+    if ( strncmp( name, name_prefix, name_prefix_len ) != 0 ||
+         ( name[0] == '.' && name_prefix[0] != '.' ) )
+    {
+      continue;
+    }
+    char candidate[MAX_COMMAND_SIZE];
+    snprintf( candidate, sizeof( candidate ), "%.*s%s", (int)dir_part_len, word, name );
+    add_completion_candidate( candidates, candidate );
+  }
+}
+
+// Terminal settings we have to restore after reading a line in raw mode.
+static struct termios saved_termios;
+
+static void write_string( const char * str )
+{
+  size_t len = strlen( str );
+  while ( len > 0 )
+  {
+    ssize_t written = write( STDOUT_FILENO, str, len );
+    if ( written <= 0 )
+    {
+      if ( written == -1 && errno == EINTR )
+      {
+        continue;
+      }
+      return;
+    }
+    str += written;
+    len -= ( size_t )written;
+  }
+}
+
+// Complete the last word of line, line_len is updated accordingly.
+// If listing_allowed is true and nothing could be added, all candidates are printed.
+// Returns true if the line has changed.
+static bool complete_line( char * line, size_t * line_len, size_t line_size, bool listing_allowed )
+{
+  line[*line_len] = '\0';
+
+  // Word under cursor starts after the last space or semicolon.
+  size_t word_start = *line_len;
+  while ( word_start > 0 && !isspace( line[word_start - 1] ) && line[word_start - 1] != ';' )
+  {
+    word_start--;
+  }
+  // It is a command name, if there is nothing before it except spaces after ';'.
+  size_t before_word = word_start;
+  while ( before_word > 0 && isspace( line[before_word - 1] ) )
+  {
+    before_word--;
+  }
+  bool is_command = before_word == 0 || line[before_word - 1] == ';';
+  char * word = line + word_start;
+
+  completion_candidates_t candidates;
+  candidates.count = candidates.total_count = candidates.common_len = 0;
+  if ( is_command && strchr( word, '/' ) == NULL )
+  {
+    complete_command_name( word, &candidates );
+  }
+  else
+  {
+    complete_path( word, &candidates );
+  }
+
+  if ( candidates.count == 0 )
+  {
+    return false;
+  }
+
+  // Longest common prefix of all the candidates.
+  size_t common_len = candidates.common_len;
+  size_t icandidate;
+  size_t word_len = *line_len - word_start;
+  bool changed = false;
+  if ( common_len > word_len || candidates.total_count == 1 )
+  {
+    size_t new_line_len = word_start + common_len;
+    // Put a space after the only candidate, unless it is a directory.
+    bool add_space = candidates.total_count == 1 && candidates.names[0][common_len - 1] != '/';
+    if ( new_line_len + ( add_space ? 1 : 0 ) < line_size )
+    {
+      memcpy( word, candidates.names[0], common_len );
+      if ( add_space )
+      {
+        line[new_line_len++] = ' ';
+      }
+      line[new_line_len] = '\0';
+      write_string( line + *line_len );
+      *line_len = new_line_len;
+      changed = true;
+    }
+  }
+  else if ( listing_allowed )
+  {
+    qsort( candidates.names, candidates.count, sizeof( char * ), compare_strings );
+    write_string( "\n" );
+    for ( icandidate = 0; icandidate < candidates.count; icandidate++ )
+    {
+      // For paths, show only names without directory part.
+      const char * name = candidates.names[icandidate];
+      const char * shown_name = name + ( strrchr( word, '/' ) ? strrchr( word, '/' ) - word + 1 : 0 );
+      write_string( shown_name );
+      write_string( icandidate + 1 < candidates.count ? "  " : "\n" );
+    }
+    if ( candidates.total_count > candidates.count )
+    {
+      char more_buf[64];
+      snprintf( more_buf, sizeof( more_buf ), "... and %lu more\n",
+                candidates.total_count - candidates.count );
+      write_string( more_buf );
+    }
+    write_string( prompt );
+    write_string( line );
+  }
+
+  free_completion_candidates( &candidates );
+  return changed;
+}
+
+// The line being edited, so it can be redrawn after something else
+// has been written to the terminal in the middle of editing.
+static char * edited_line = NULL;
+
+static void clear_edited_line()
+{
+  if ( edited_line != NULL )
+  {
+    write_string( "\r\033[K" );
+  }
+}
+
+static void redraw_edited_line()
+{
+  if ( edited_line != NULL )
+  {
+    write_string( prompt );
+    write_string( edited_line );
+  }
+}
+
+// Waits until the user types something, handling shell's events meanwhile.
+static void handle_terminal_input( int fd, uint32_t events, void * data );
+static void wait_for_terminal_input();
+
+// Read a line from the terminal with simple line editing and Tab completion.
+// Returns false if input is over.
+static bool read_line_from_terminal( char * line, size_t line_size )
+{
+  struct termios raw_termios = saved_termios;
+  raw_termios.c_lflag &= ~( tcflag_t )( ICANON | ECHO );
+  raw_termios.c_cc[VMIN] = 1;
+  raw_termios.c_cc[VTIME] = 0;
+  tcsetattr( STDIN_FILENO, TCSADRAIN, &raw_termios );
+
+  size_t line_len = 0;
+  bool last_key_was_tab = false;
+  bool line_read = false;
+  line[0] = '\0';
+  edited_line = line;
+  // Only while the line is read: a job takes the terminal after that,
+  // and the typeahead would keep the descriptor ready for the whole job.
+  watch_fd( STDIN_FILENO, EPOLLIN, handle_terminal_input, NULL );
+  while ( !line_read )
+  {
+    wait_for_terminal_input();
+    unsigned char c;
+    ssize_t read_result = read( STDIN_FILENO, &c, 1 );
+    if ( read_result == -1 && errno == EINTR )
+    {
+      continue;
+    }
+    if ( read_result <= 0 )
+    {
+      break;
+    }
+
+    bool is_tab = false;
+    switch ( c )
+    {
+      case '\r':
+      case '\n':
+        write_string( "\n" );
+        line[line_len++] = '\n';
+        line_read = true;
+        break;
+      case '\t':
+        is_tab = true;
+        complete_line( line, &line_len, line_size - 1, last_key_was_tab );
+        break;
+      case 0x7f:
+      case '\b':
+        if ( line_len > 0 )
+        {
+          line_len--;
+          write_string( "\b \b" );
+        }
+        break;
+      case 0x15:
+        // Ctrl-U erases the whole line.
+        while ( line_len > 0 )
+        {
+          line_len--;
+          write_string( "\b \b" );
+        }
+        break;
+      case 0x04:
+        // Ctrl-D on an empty line means the end of input.
+        if ( line_len == 0 )
+        {
+          write_string( "\n" );
+          edited_line = NULL;
+          unwatch_fd( STDIN_FILENO );
+          tcsetattr( STDIN_FILENO, TCSADRAIN, &saved_termios );
+          return false;
+        }
+        break;
+      case 0x1b:
+      {
+        // Escape sequences (arrows and so on) are not supported, skipping them.
+        unsigned char seq[2];
+        if ( read( STDIN_FILENO, seq, 2 ) == 2 && seq[0] == '[' && !isalpha( seq[1] ) &&
+             seq[1] != '~' )
+        {
+          while ( read( STDIN_FILENO, seq, 1 ) == 1 && !isalpha( seq[0] ) && seq[0] != '~' )
+            ;
+        }
+        break;
+      }
+      default:
+        if ( isprint( c ) && line_len + 2 < line_size )
+        {
+          line[line_len++] = (char)c;
+          line[line_len] = '\0';
+          write_string( line + line_len - 1 );
+        }
+        break;
+    }
+    last_key_was_tab = is_tab;
+    line[line_len] = '\0';
+  }
+
+  edited_line = NULL;
+  unwatch_fd( STDIN_FILENO );
+  tcsetattr( STDIN_FILENO, TCSADRAIN, &saved_termios );
+  line[line_len] = '\0';
+  return line_read;
+}
+
+// Read the next line of input into line, returns false if input is over.
+static bool read_command_line( char * line, size_t line_size )
+{
+  if ( isatty( STDIN_FILENO ) )
+  {
+    return read_line_from_terminal( line, line_size );
+  }
+
+  while ( !fgets( line, (int)line_size, stdin ) )
+  {
+    if ( feof( stdin ) )
+    {
+      return false;
+    }
+    clearerr( stdin );
+  }
+  return true;
+}
+
+// Reads the bodies of the here-documents of the line, they come in the lines after it.
+// The input ending before a delimiter ends the body as well.
+static void read_here_documents( const char * line, size_t line_len )
+{
+  char * command_tokens[MAX_NUM_ARGUMENTS + 1];
+  size_t position = 0;
+  while ( position < line_len )
+  {
+    int tokens_count = tokenize_next_command( line, line_len, &position, command_tokens );
+    if ( tokens_count == -1 )
+    {
+      // The liner does not run such a line.
+      break;
+    }
+
+    size_t start = 0;
+    size_t end = 0;
+    const char * delimiter = NULL;
+    if ( find_input_redirection( command_tokens, (size_t)tokens_count, &start, &end, &delimiter ) ==
+         INPUT_REDIRECTION_HERE_DOCUMENT )
+    {
+      char * body = strdup( "" );
+      size_t body_len = 0;
+      char body_line[MAX_COMMAND_SIZE];
+      bool body_read = false;
+      while ( !body_read )
+      {
+        if ( isatty( STDIN_FILENO ) )
+        {
+          write_string( "> " );
+        }
+        if ( !read_command_line( body_line, sizeof( body_line ) ) )
+        {
+          ERROR( "msh: the input is over, but the here-document waits for %s", delimiter );
+          break;
+        }
+        body_read = !add_here_document_line( &body, &body_len, body_line, delimiter );
+      }
+      here_documents =
+          (char **)realloc( here_documents, ( here_documents_count + 1 ) * sizeof( char * ) );
+      here_documents[here_documents_count++] = body;
+    }
+
+    int itoken;
+    for ( itoken = 0; itoken < tokens_count; itoken++ )
+    {
+      free( command_tokens[itoken] );
+    }
+  }
+}
+
+// msh -c: run command_string the same way the liner runs a line, skipping everything
+// the interactive shell needs - terminal, job control, history and temporary files.
+// Exits with the status of the last command run.
+static void run_one_shot( const char * command_string )
+{
+  my_process_type = PROCESS_TYPE_LINER;
+  one_shot_mode = true;
+
+  size_t command_string_len = strlen( command_string );
+  cmd_line = (char *)malloc( NORMALIZED_LINE_SIZE( command_string_len ) );
+  normalize_command_line( command_string, command_string_len, cmd_line );
+
+  signal( SIGCHLD, sigchld_handler_for_liner );
+  set_event_signals_blocked( true );
+  run_liner();
+  // Should exit from inside run_liner.
+  assert( false );
+}
+
+/*
+ * Scripts, msh FILE [arguments].
+ *
+ * A script is compiled once into bytecode for a small VM running right in
+ * msh's process: loops and conditions are jumps, the in-process utilities
+ * and the state builtins are called in place, and only the other commands
+ * cost a fork(). The language is msh's command line with a few shell
+ * keywords on top:
+ *
+ *   NAME=value
+ *   if command; then ...; elif command; then ...; else ...; fi
+ *   while command; do ...; done        (and until)
+ *   for NAME in words; do ...; done    (the words are split and globbed)
+ *   function NAME { ...; }             (or NAME() { ...; })
+ *   break, continue, return [n], exit [n], ! command
+ *
+ * $NAME, ${NAME}, $?, $#, $@, $$ and $0 to $9 are expanded in the words,
+ * and in the bodies of here-documents, which functions can take as well.
+ * Outside of for lists a word stays a single argument, so an empty value
+ * is still an argument for test. Functions are defined as the script is
+ * compiled, so they can be called above their definitions.
+ */
+#define SCRIPT_ARENA_SIZE ( 256 * 1024 )
+#define SCRIPT_MAX_CALL_DEPTH 1024
+#define SCRIPT_NONE UINT32_MAX
+#define SCRIPT_SYNTAX_ERROR 2
+
+typedef enum script_opcode_t
+{
+  // Runs the command of the template, setting the status.
+  SCRIPT_OP_RUN,
+  // Calls the function target with the arguments of the template.
+  SCRIPT_OP_CALL,
+  // Sets the variable named by the first word of the template to its second word.
+  SCRIPT_OP_ASSIGN,
+  SCRIPT_OP_NOT,
+  SCRIPT_OP_JUMP,
+  SCRIPT_OP_JUMP_IF_FAILED,
+  SCRIPT_OP_JUMP_IF_SUCCEEDED,
+  // Starts a loop over the words of the template.
+  SCRIPT_OP_FOR_INIT,
+  // Sets the variable of the template to the next word of the loop, or jumps to target after the last one.
+  SCRIPT_OP_FOR_NEXT,
+  SCRIPT_OP_FOR_END,
+  // Both take the status from the template, if there is one.
+  SCRIPT_OP_RETURN,
+  SCRIPT_OP_EXIT
+} script_opcode_t;
+
+typedef struct script_instruction_t
+{
+  uint8_t opcode;
+  uint32_t template_index;
+  uint32_t target;
+} script_instruction_t;
+
+// Words of a command as argv: the ones without variables are there since
+// the compilation, the others are expanded into it every time it runs.
+typedef struct script_template_t
+{
+  char ** words;
+  char ** argv;
+  bool * has_variables;
+  size_t words_count;
+  size_t line;
+  // The command's words end at input_start, a here-string takes the words after it.
+  input_redirection_t input_redirection;
+  size_t input_start;
+  char * here_document;
+  bool here_document_has_variables;
+} script_template_t;
+
+typedef struct script_function_t
+{
+  char * name;
+  uint32_t entry;
+} script_function_t;
+
+typedef struct script_t
+{
+  const char * filename;
+  script_instruction_t * code;
+  size_t code_count;
+  size_t code_capacity;
+  script_template_t * templates;
+  size_t templates_count;
+  size_t templates_capacity;
+  script_function_t * functions;
+  size_t functions_count;
+} script_t;
+
+// Commands of the script as they are written, split by newlines and ';'.
+typedef struct script_command_t
+{
+  char ** words;
+  size_t words_count;
+  size_t line;
+  // The body of its here-document, taken from the lines after it.
+  char * here_document;
+} script_command_t;
+
+typedef struct script_parser_t
+{
+  script_t * script;
+  script_command_t * commands;
+  size_t commands_count;
+  // The word to parse next, keywords like "then" or "do" can be followed
+  // by a command in the same one.
+  size_t icommand;
+  size_t iword;
+  // Jumps of break in the innermost loop are chained through their targets.
+  uint32_t loop_continue_target;
+  uint32_t loop_breaks;
+  bool in_loop;
+} script_parser_t;
+
+static void free_script_commands( script_command_t * commands, size_t commands_count )
+{
+  size_t icommand;
+  for ( icommand = 0; icommand < commands_count; icommand++ )
+  {
+    size_t iword;
+    for ( iword = 0; iword < commands[icommand].words_count; iword++ )
+    {
+      free( commands[icommand].words[iword] );
+    }
+    free( commands[icommand].words );
+    free( commands[icommand].here_document );
+  }
+  free( commands );
+}
+
+// Splits the script into commands, returns false if it can't be read.
+static bool read_script_commands( const char * filename,
+                                  script_command_t ** commands,
+                                  size_t * commands_count )
+{
+  FILE * f = fopen( filename, "r" );
+  if ( f == NULL )
+  {
+    ERROR( "msh: %s: %s", filename, strerror( errno ) );
+    return false;
+  }
+  *commands = NULL;
+  *commands_count = 0;
+  size_t commands_capacity = 0;
+  size_t words_capacity = 0;
+  bool command_started = false;
+  char * line = NULL;
+  size_t line_capacity = 0;
+  size_t line_number = 0;
+  while ( getline( &line, &line_capacity, f ) != -1 )
+  {
+    line_number++;
+    size_t line_first_command = *commands_count;
+    char * position = line;
+    while ( true )
+    {
+      position += strspn( position, " \t\r\n" );
+      if ( *position == '\0' || *position == '#' || *position == ';' )
+      {
+        // The command ends here.
+        command_started = false;
+        words_capacity = 0;
+        if ( *position != ';' )
+        {
+          break;
+        }
+        position++;
+        continue;
+      }
+
+      if ( !command_started )
+      {
+        if ( *commands_count == commands_capacity )
+        {
+          commands_capacity = commands_capacity ? commands_capacity * 2 : 64;
+          *commands =
+              (script_command_t *)realloc( *commands, commands_capacity * sizeof( script_command_t ) );
+        }
+        script_command_t * command = &( *commands )[( *commands_count )++];
+        command->words = NULL;
+        command->words_count = 0;
+        command->line = line_number;
+        command->here_document = NULL;
+        command_started = true;
+      }
+      script_command_t * command = &( *commands )[*commands_count - 1];
+      if ( command->words_count == words_capacity )
+      {
+        words_capacity = words_capacity ? words_capacity * 2 : 8;
+        command->words = (char **)realloc( command->words, words_capacity * sizeof( char * ) );
+      }
+      size_t word_len = strcspn( position, " \t\r\n;" );
+      command->words[command->words_count++] = strndup( position, word_len );
+      position += word_len;
+    }
+
+    // Bodies of the line's here-documents follow it.
+    size_t icommand;
+    for ( icommand = line_first_command; icommand < *commands_count; icommand++ )
+    {
+      script_command_t * command = &( *commands )[icommand];
+      size_t start = 0;
+      size_t end = 0;
+      const char * delimiter = NULL;
+      if ( find_input_redirection( command->words, command->words_count, &start, &end, &delimiter ) !=
+           INPUT_REDIRECTION_HERE_DOCUMENT )
+      {
+        continue;
+      }
+      size_t body_len = 0;
+      command->here_document = strdup( "" );
+      bool body_read = false;
+      while ( !body_read && getline( &line, &line_capacity, f ) != -1 )
+      {
+        line_number++;
+        body_read = !add_here_document_line( &command->here_document, &body_len, line, delimiter );
+      }
+    }
+  }
+  free( line );
+  fclose( f );
+  return true;
+}
+
+static void script_syntax_error( script_parser_t * parser, const char * message, const char * word )
+{
+  // At the end of the script, the error is on its last line.
+  size_t icommand = parser->icommand < parser->commands_count ? parser->icommand : parser->commands_count - 1;
+  size_t line = parser->commands_count > 0 ? parser->commands[icommand].line : 0;
+  ERROR( "%s:%lu: %s%s", parser->script->filename, line, message, word ? word : "" );
+  free_and_exit( SCRIPT_SYNTAX_ERROR );
+}
+
+static uint32_t emit_script_instruction( script_t * script,
+                                         script_opcode_t opcode,
+                                         uint32_t template_index,
+                                         uint32_t target )
+{
+  if ( script->code_count == script->code_capacity )
+  {
+    script->code_capacity = script->code_capacity ? script->code_capacity * 2 : 256;
+    script->code = (script_instruction_t *)realloc( script->code,
+                                                    script->code_capacity * sizeof( script_instruction_t ) );
+  }
+  script_instruction_t * instruction = &script->code[script->code_count];
+  instruction->opcode = (uint8_t)opcode;
+  instruction->template_index = template_index;
+  instruction->target = target;
+  return (uint32_t)script->code_count++;
+}
+
+static uint32_t add_script_template( script_t * script, char ** words, size_t words_count, size_t line )
+{
+  if ( script->templates_count == script->templates_capacity )
+  {
+    script->templates_capacity = script->templates_capacity ? script->templates_capacity * 2 : 64;
+    script->templates =
+        (script_template_t *)realloc( script->templates,
+                                      script->templates_capacity * sizeof( script_template_t ) );
+  }
+  script_template_t * template = &script->templates[script->templates_count];
+  template->words = (char **)malloc( words_count * sizeof( char * ) );
+  template->argv = (char **)malloc( ( words_count + 1 ) * sizeof( char * ) );
+  template->has_variables = (bool *)malloc( words_count * sizeof( bool ) );
+  template->words_count = words_count;
+  template->line = line;
+  size_t iword;
+  for ( iword = 0; iword < words_count; iword++ )
+  {
+    template->words[iword] = strdup( words[iword] );
+    template->argv[iword] = template->words[iword];
+    template->has_variables[iword] = strchr( words[iword], '$' ) != NULL;
+  }
+  template->argv[words_count] = NULL;
+  template->input_redirection = INPUT_REDIRECTION_NONE;
+  template->input_start = words_count;
+  template->here_document = NULL;
+  template->here_document_has_variables = false;
+  return (uint32_t)script->templates_count++;
+}
+
+static void free_script( script_t * script )
+{
+  size_t itemplate;
+  for ( itemplate = 0; itemplate < script->templates_count; itemplate++ )
+  {
+    script_template_t * template = &script->templates[itemplate];
+    size_t iword;
+    for ( iword = 0; iword < template->words_count; iword++ )
+    {
+      free( template->words[iword] );
+    }
+    free( template->words );
+    free( template->argv );
+    free( template->has_variables );
+    free( template->here_document );
+  }
+  free( script->templates );
+  size_t ifunction;
+  for ( ifunction = 0; ifunction < script->functions_count; ifunction++ )
+  {
+    free( script->functions[ifunction].name );
+  }
+  free( script->functions );
+  free( script->code );
+}
+
+// The word to parse next, NULL at the end of the script.
+static const char * peek_script_word( script_parser_t * parser )
+{
+  if ( parser->icommand == parser->commands_count )
+  {
+    return NULL;
+  }
+  return parser->commands[parser->icommand].words[parser->iword];
+}
+
+static void skip_script_word( script_parser_t * parser )
+{
+  parser->iword++;
+  if ( parser->iword == parser->commands[parser->icommand].words_count )
+  {
+    parser->icommand++;
+    parser->iword = 0;
+  }
+}
+
+static void expect_script_word( script_parser_t * parser, const char * keyword )
+{
+  const char * word = peek_script_word( parser );
+  if ( word == NULL || strcmp( word, keyword ) != 0 )
+  {
+    script_syntax_error( parser, "expected ", keyword );
+  }
+  skip_script_word( parser );
+}
+
+// Takes the rest of the command icommand as a template, SCRIPT_NONE if nothing is left of it.
+static uint32_t take_script_template( script_parser_t * parser, size_t icommand )
+{
+  if ( parser->icommand != icommand )
+  {
+    return SCRIPT_NONE;
+  }
+  script_command_t * command = &parser->commands[parser->icommand];
+  uint32_t template_index = add_script_template(
+      parser->script, command->words + parser->iword, command->words_count - parser->iword, command->line );
+  script_template_t * template = &parser->script->templates[template_index];
+  size_t start = 0;
+  size_t end = 0;
+  const char * delimiter = NULL;
+  template->input_redirection =
+      find_input_redirection( template->words, template->words_count, &start, &end, &delimiter );
+  switch ( template->input_redirection )
+  {
+    case INPUT_REDIRECTION_NONE:
+      break;
+    case INPUT_REDIRECTION_HERE_STRING:
+      // The "<<<" ends the command's argv for good, the words after it are still expanded.
+      template->input_start = start;
+      template->argv[start] = NULL;
+      break;
+    case INPUT_REDIRECTION_HERE_DOCUMENT:
+    {
+      size_t iword;
+      for ( iword = start; iword < end; iword++ )
+      {
+        free( template->words[iword] );
+      }
+      size_t moved_count = template->words_count - end;
+      memmove( template->words + start, template->words + end, moved_count * sizeof( char * ) );
+      memmove( template->argv + start, template->argv + end, ( moved_count + 1 ) * sizeof( char * ) );
+      memmove( template->has_variables + start, template->has_variables + end, moved_count * sizeof( bool ) );
+      template->words_count -= end - start;
+      template->input_start = template->words_count;
+      template->here_document = command->here_document;
+      template->here_document_has_variables = strchr( command->here_document, '$' ) != NULL;
+      command->here_document = NULL;
+      break;
+    }
+    case INPUT_REDIRECTION_INVALID:
+      script_syntax_error( parser, "a here-document needs a delimiter, and only one input is allowed", NULL );
+      break;
+  }
+  if ( template->input_start == 0 )
+  {
+    script_syntax_error( parser, "command expected before its input", NULL );
+  }
+  parser->icommand++;
+  parser->iword = 0;
+  return template_index;
+}
+
+// The same, for a command after a keyword like "if" taken already.
+static uint32_t take_script_command( script_parser_t * parser, size_t icommand, const char * keyword )
+{
+  uint32_t template_index = take_script_template( parser, icommand );
+  if ( template_index == SCRIPT_NONE )
+  {
+    script_syntax_error( parser, "command expected after ", keyword );
+  }
+  return template_index;
+}
+
+static bool is_script_word_in( const char * word, const char * const * words )
+{
+  for ( ; *words; words++ )
+  {
+    if ( strcmp( word, *words ) == 0 )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void parse_script_statement( script_parser_t * parser );
+
+// Parses statements until one of the terminators, which is left to the caller.
+static void parse_script_block( script_parser_t * parser, const char * const * terminators )
+{
+  const char * word;
+  while ( ( word = peek_script_word( parser ) ) != NULL && !is_script_word_in( word, terminators ) )
+  {
+    parse_script_statement( parser );
+  }
+  if ( word == NULL && terminators[0] != NULL )
+  {
+    // The last terminator is the one closing the block, like "fi" after "elif" and "else".
+    size_t iterminator = 0;
+    while ( terminators[iterminator + 1] != NULL )
+    {
+      iterminator++;
+    }
+    script_syntax_error( parser, "unexpected end of script, expected ", terminators[iterminator] );
+  }
+}
+
+// Runs the condition after "if", "elif", "while" or "until", taken from the command icommand already.
+static void parse_script_condition( script_parser_t * parser, size_t icommand, const char * keyword )
+{
+  bool negated = parser->icommand == icommand && strcmp( peek_script_word( parser ), "!" ) == 0;
+  if ( negated )
+  {
+    skip_script_word( parser );
+  }
+  emit_script_instruction(
+      parser->script, SCRIPT_OP_RUN, take_script_command( parser, icommand, keyword ), SCRIPT_NONE );
+  if ( negated )
+  {
+    emit_script_instruction( parser->script, SCRIPT_OP_NOT, SCRIPT_NONE, SCRIPT_NONE );
+  }
+}
+
+static void set_script_jump_target( script_parser_t * parser, uint32_t jump, uint32_t target )
+{
+  parser->script->code[jump].target = target;
+}
+
+static void parse_script_if( script_parser_t * parser )
+{
+  static const char * const branch_terminators[] = { "elif", "else", "fi", NULL };
+  static const char * const else_terminators[] = { "fi", NULL };
+  script_t * script = parser->script;
+  // Jumps to the end from the ends of the branches, chained through their targets.
+  uint32_t end_jumps = SCRIPT_NONE;
+  const char * keyword = "if";
+  while ( true )
+  {
+    size_t icommand = parser->icommand;
+    skip_script_word( parser );
+    parse_script_condition( parser, icommand, keyword );
+    uint32_t next_branch_jump =
+        emit_script_instruction( script, SCRIPT_OP_JUMP_IF_FAILED, SCRIPT_NONE, SCRIPT_NONE );
+    expect_script_word( parser, "then" );
+    parse_script_block( parser, branch_terminators );
+    keyword = peek_script_word( parser );
+    if ( strcmp( keyword, "fi" ) == 0 )
+    {
+      set_script_jump_target( parser, next_branch_jump, (uint32_t)script->code_count );
+      break;
+    }
+    end_jumps = emit_script_instruction( script, SCRIPT_OP_JUMP, SCRIPT_NONE, end_jumps );
+    set_script_jump_target( parser, next_branch_jump, (uint32_t)script->code_count );
+    if ( strcmp( keyword, "else" ) == 0 )
+    {
+      skip_script_word( parser );
+      parse_script_block( parser, else_terminators );
+      break;
+    }
+  }
+  skip_script_word( parser );
+  while ( end_jumps != SCRIPT_NONE )
+  {
+    uint32_t next_jump = script->code[end_jumps].target;
+    set_script_jump_target( parser, end_jumps, (uint32_t)script->code_count );
+    end_jumps = next_jump;
+  }
+}
+
+// Parses the body of a loop, from "do" to "done", with continue going to continue_target.
+// Returns the chain of its breaks.
+static uint32_t parse_script_loop_body( script_parser_t * parser, uint32_t continue_target )
+{
+  static const char * const body_terminators[] = { "done", NULL };
+  uint32_t outer_continue_target = parser->loop_continue_target;
+  uint32_t outer_breaks = parser->loop_breaks;
+  bool outer_in_loop = parser->in_loop;
+  parser->loop_continue_target = continue_target;
+  parser->loop_breaks = SCRIPT_NONE;
+  parser->in_loop = true;
+
+  expect_script_word( parser, "do" );
+  parse_script_block( parser, body_terminators );
+  skip_script_word( parser );
+  emit_script_instruction( parser->script, SCRIPT_OP_JUMP, SCRIPT_NONE, continue_target );
+
+  uint32_t breaks = parser->loop_breaks;
+  parser->loop_continue_target = outer_continue_target;
+  parser->loop_breaks = outer_breaks;
+  parser->in_loop = outer_in_loop;
+  return breaks;
+}
+
+static void set_script_breaks_target( script_parser_t * parser, uint32_t breaks, uint32_t target )
+{
+  while ( breaks != SCRIPT_NONE )
+  {
+    uint32_t next_break = parser->script->code[breaks].target;
+    set_script_jump_target( parser, breaks, target );
+    breaks = next_break;
+  }
+}
+
+static void parse_script_while( script_parser_t * parser, bool until )
+{
+  script_t * script = parser->script;
+  uint32_t start = (uint32_t)script->code_count;
+  size_t icommand = parser->icommand;
+  skip_script_word( parser );
+  parse_script_condition( parser, icommand, until ? "until" : "while" );
+  uint32_t end_jump = emit_script_instruction(
+      script, until ? SCRIPT_OP_JUMP_IF_SUCCEEDED : SCRIPT_OP_JUMP_IF_FAILED, SCRIPT_NONE, SCRIPT_NONE );
+  uint32_t breaks = parse_script_loop_body( parser, start );
+  set_script_jump_target( parser, end_jump, (uint32_t)script->code_count );
+  set_script_breaks_target( parser, breaks, (uint32_t)script->code_count );
+}
+
+static void parse_script_for( script_parser_t * parser )
+{
+  script_t * script = parser->script;
+  size_t icommand = parser->icommand;
+  script_command_t * command = &parser->commands[icommand];
+  size_t iname = parser->iword + 1;
+  if ( iname + 1 >= command->words_count || strcmp( command->words[iname + 1], "in" ) != 0 ||
+       !is_valid_variable_name( command->words[iname] ) )
+  {
+    script_syntax_error( parser, "usage: for NAME in words", NULL );
+  }
+  uint32_t name_template = add_script_template( script, command->words + iname, 1, command->line );
+  skip_script_word( parser );
+  skip_script_word( parser );
+  skip_script_word( parser );
+  uint32_t words_template = take_script_template( parser, icommand );
+  if ( words_template == SCRIPT_NONE )
+  {
+    // Nothing to loop over.
+    words_template = add_script_template( script, NULL, 0, command->line );
+  }
+
+  emit_script_instruction( script, SCRIPT_OP_FOR_INIT, words_template, SCRIPT_NONE );
+  uint32_t next = emit_script_instruction( script, SCRIPT_OP_FOR_NEXT, name_template, SCRIPT_NONE );
+  uint32_t breaks = parse_script_loop_body( parser, next );
+  uint32_t end = emit_script_instruction( script, SCRIPT_OP_FOR_END, SCRIPT_NONE, SCRIPT_NONE );
+  set_script_jump_target( parser, next, end );
+  set_script_breaks_target( parser, breaks, end );
+}
+
+static void parse_script_function( script_parser_t * parser )
+{
+  static const char * const body_terminators[] = { "}", NULL };
+  script_t * script = parser->script;
+  size_t icommand = parser->icommand;
+  if ( strcmp( peek_script_word( parser ), "function" ) == 0 )
+  {
+    skip_script_word( parser );
+    if ( parser->icommand != icommand )
+    {
+      script_syntax_error( parser, "function name expected", NULL );
+    }
+  }
+  const char * word = peek_script_word( parser );
+  size_t name_len = strlen( word );
+  if ( name_len > 2 && strcmp( word + name_len - 2, "()" ) == 0 )
+  {
+    name_len -= 2;
+  }
+  char * name = strndup( word, name_len );
+  if ( !is_valid_variable_name( name ) )
+  {
+    script_syntax_error( parser, "bad function name: ", name );
+  }
+  skip_script_word( parser );
+  expect_script_word( parser, "{" );
+
+  uint32_t skip_jump = emit_script_instruction( script, SCRIPT_OP_JUMP, SCRIPT_NONE, SCRIPT_NONE );
+  size_t ifunction;
+  for ( ifunction = 0;
+        ifunction < script->functions_count && strcmp( script->functions[ifunction].name, name ) != 0;
+        ifunction++ )
+    ;
+  if ( ifunction == script->functions_count )
+  {
+    script->functions = (script_function_t *)realloc(
+        script->functions, ( script->functions_count + 1 ) * sizeof( script_function_t ) );
+    script->functions[script->functions_count++].name = name;
+  }
+  else
+  {
+    // The last definition wins.
+    free( name );
+  }
+  script->functions[ifunction].entry = (uint32_t)script->code_count;
+
+  // Loops around the definition are not the function's ones.
+  bool outer_in_loop = parser->in_loop;
+  parser->in_loop = false;
+  parse_script_block( parser, body_terminators );
+  skip_script_word( parser );
+  parser->in_loop = outer_in_loop;
+  emit_script_instruction( script, SCRIPT_OP_RETURN, SCRIPT_NONE, SCRIPT_NONE );
+  set_script_jump_target( parser, skip_jump, (uint32_t)script->code_count );
+}
+
+static bool is_script_assignment( const char * word )
+{
+  const char * separator = strchr( word, '=' );
+  if ( separator == NULL || separator == word )
+  {
+    return false;
+  }
+  char * name = strndup( word, ( size_t )( separator - word ) );
+  bool valid = is_valid_variable_name( name );
+  free( name );
+  return valid;
+}
+
+static void parse_script_statement( script_parser_t * parser )
+{
+  static const char * const misplaced_keywords[] = {
+      "then", "elif", "else", "fi", "do", "done", "{", "}", "in", NULL };
+  script_t * script = parser->script;
+  const char * word = peek_script_word( parser );
+  size_t icommand = parser->icommand;
+  script_command_t * command = &parser->commands[icommand];
+  size_t rest_count = command->words_count - parser->iword;
+  size_t word_len = strlen( word );
+
+  if ( strcmp( word, "if" ) == 0 )
+  {
+    parse_script_if( parser );
+  }
+  else if ( strcmp( word, "while" ) == 0 || strcmp( word, "until" ) == 0 )
+  {
+    parse_script_while( parser, strcmp( word, "until" ) == 0 );
+  }
+  else if ( strcmp( word, "for" ) == 0 )
+  {
+    parse_script_for( parser );
+  }
+  else if ( strcmp( word, "function" ) == 0 || ( word_len > 2 && strcmp( word + word_len - 2, "()" ) == 0 ) )
+  {
+    parse_script_function( parser );
+  }
+  else if ( strcmp( word, "break" ) == 0 || strcmp( word, "continue" ) == 0 )
+  {
+    if ( !parser->in_loop || rest_count != 1 )
+    {
+      script_syntax_error( parser, "unexpected ", word );
+    }
+    if ( strcmp( word, "break" ) == 0 )
+    {
+      parser->loop_breaks =
+          emit_script_instruction( script, SCRIPT_OP_JUMP, SCRIPT_NONE, parser->loop_breaks );
+    }
+    else
+    {
+      emit_script_instruction( script, SCRIPT_OP_JUMP, SCRIPT_NONE, parser->loop_continue_target );
+    }
+    skip_script_word( parser );
+  }
+  else if ( strcmp( word, "return" ) == 0 || strcmp( word, "exit" ) == 0 || strcmp( word, "quit" ) == 0 )
+  {
+    script_opcode_t opcode = strcmp( word, "return" ) == 0 ? SCRIPT_OP_RETURN : SCRIPT_OP_EXIT;
+    if ( rest_count > 2 )
+    {
+      script_syntax_error( parser, "too many arguments for ", word );
+    }
+    skip_script_word( parser );
+    emit_script_instruction( script, opcode, take_script_template( parser, icommand ), SCRIPT_NONE );
+  }
+  else if ( strcmp( word, "!" ) == 0 && rest_count > 1 )
+  {
+    skip_script_word( parser );
+    emit_script_instruction( script, SCRIPT_OP_RUN, take_script_template( parser, icommand ), SCRIPT_NONE );
+    emit_script_instruction( script, SCRIPT_OP_NOT, SCRIPT_NONE, SCRIPT_NONE );
+  }
+  else if ( is_script_word_in( word, misplaced_keywords ) )
+  {
+    script_syntax_error( parser, "unexpected ", word );
+  }
+  else if ( rest_count == 1 && is_script_assignment( word ) )
+  {
+    // The name and the value are the words of the template.
+    const char * separator = strchr( word, '=' );
+    char * assignment[2] = { strndup( word, ( size_t )( separator - word ) ), (char *)separator + 1 };
+    emit_script_instruction(
+        script, SCRIPT_OP_ASSIGN, add_script_template( script, assignment, 2, command->line ), SCRIPT_NONE );
+    free( assignment[0] );
+    skip_script_word( parser );
+  }
+  else
+  {
+    emit_script_instruction( script, SCRIPT_OP_RUN, take_script_template( parser, icommand ), SCRIPT_NONE );
+  }
+}
+
+// Commands named as functions become calls, as there is nothing to look up while running.
+static void link_script_calls( script_t * script )
+{
+  size_t pc;
+  for ( pc = 0; pc < script->code_count; pc++ )
+  {
+    script_instruction_t * instruction = &script->code[pc];
+    if ( instruction->opcode != SCRIPT_OP_RUN )
+    {
+      continue;
+    }
+    const script_template_t * template = &script->templates[instruction->template_index];
+    size_t ifunction;
+    for ( ifunction = 0; ifunction < script->functions_count && !template->has_variables[0]; ifunction++ )
+    {
+      if ( strcmp( template->words[0], script->functions[ifunction].name ) == 0 )
+      {
+        instruction->opcode = SCRIPT_OP_CALL;
+        instruction->target = (uint32_t)ifunction;
+        break;
+      }
+    }
+  }
+}
+
+static bool compile_script( script_t * script, const char * filename )
+{
+  memset( script, 0, sizeof( script_t ) );
+  script->filename = filename;
+  script_parser_t parser;
+  memset( &parser, 0, sizeof( parser ) );
+  parser.script = script;
+  parser.loop_breaks = SCRIPT_NONE;
+  if ( !read_script_commands( filename, &parser.commands, &parser.commands_count ) )
+  {
+    return false;
+  }
+  static const char * const no_terminators[] = { NULL };
+  parse_script_block( &parser, no_terminators );
+  emit_script_instruction( script, SCRIPT_OP_EXIT, SCRIPT_NONE, SCRIPT_NONE );
+  free_script_commands( parser.commands, parser.commands_count );
+  link_script_calls( script );
+  return true;
+}
+
+// Positional parameters of the script or of a function call.
+typedef struct script_frame_t
+{
+  // $0 and the arguments.
+  char ** args;
+  size_t args_count;
+  size_t return_pc;
+  // The caller's stdin, if the function has its own input.
+  int saved_stdin;
+  // Loops started before the call, the ones after it end on return.
+  size_t loops_count;
+} script_frame_t;
+
+typedef struct script_loop_t
+{
+  char ** items;
+  size_t items_count;
+  size_t next_item;
+} script_loop_t;
+
+// Expanded words live here until the next instruction.
+static char script_arena[SCRIPT_ARENA_SIZE];
+static size_t script_arena_len = 0;
+
+static const char * get_script_parameter( const char * name, size_t name_len, const script_frame_t * frame )
+{
+  char name_buf[MAX_COMMAND_SIZE];
+  if ( name_len == 0 || name_len >= sizeof( name_buf ) )
+  {
+    return "";
+  }
+  memcpy( name_buf, name, name_len );
+  name_buf[name_len] = '\0';
+  if ( strspn( name_buf, "0123456789" ) == name_len )
+  {
+    size_t index = (size_t)atoi( name_buf );
+    return index < frame->args_count ? frame->args[index] : "";
+  }
+  const char * value = get_variable( name_buf );
+  return value ? value : "";
+}
+
+// Expands the variables of the word into the arena, returns NULL if it is full.
+static char * expand_script_word( const char * word, const script_frame_t * frame, int status )
+{
+  char * expansion = script_arena + script_arena_len;
+  size_t capacity = SCRIPT_ARENA_SIZE - script_arena_len;
+  size_t len = 0;
+  const char * position = word;
+  while ( *position )
+  {
+    const char * value = NULL;
+    size_t value_len = 0;
+    char number[32];
+    if ( *position != '$' )
+    {
+      value = position;
+      value_len = strcspn( position, "$" );
+      position += value_len;
+    }
+    else if ( position[1] == '{' && strchr( position, '}' ) != NULL )
+    {
+      const char * name_end = strchr( position, '}' );
+      value = get_script_parameter( position + 2, ( size_t )( name_end - position - 2 ), frame );
+      position = name_end + 1;
+    }
+    else if ( isdigit( position[1] ) )
+    {
+      value = get_script_parameter( position + 1, 1, frame );
+      position += 2;
+    }
+    else if ( isalpha( position[1] ) || position[1] == '_' )
+    {
+      size_t name_len = 1;
+      while ( isalnum( position[1 + name_len] ) || position[1 + name_len] == '_' )
+      {
+        name_len++;
+      }
+      value = get_script_parameter( position + 1, name_len, frame );
+      position += 1 + name_len;
+    }
+    else if ( position[1] == '?' || position[1] == '#' || position[1] == '$' )
+    {
+      long number_value = (long)getpid();
+      if ( position[1] == '?' )
+      {
+        number_value = status;
+      }
+      else if ( position[1] == '#' )
+      {
+        number_value = (long)frame->args_count - 1;
+      }
+      snprintf( number, sizeof( number ), "%ld", number_value );
+      value = number;
+      position += 2;
+    }
+    else if ( position[1] == '@' || position[1] == '*' )
+    {
+      size_t iarg;
+      for ( iarg = 1; iarg < frame->args_count; iarg++ )
+      {
+        size_t arg_len = strlen( frame->args[iarg] );
+        if ( len + arg_len + 1 >= capacity )
+        {
+          return NULL;
+        }
+        if ( iarg > 1 )
+        {
+          expansion[len++] = ' ';
+        }
+        memcpy( expansion + len, frame->args[iarg], arg_len );
+        len += arg_len;
+      }
+      position += 2;
+      continue;
+    }
+    else
+    {
+      // Nothing to expand, the '$' is just a character.
+      value = position;
+      value_len = 1;
+      position++;
+    }
+
+    if ( value_len == 0 )
+    {
+      value_len = strlen( value );
+    }
+    if ( len + value_len >= capacity )
+    {
+      return NULL;
+    }
+    memcpy( expansion + len, value, value_len );
+    len += value_len;
+  }
+  expansion[len] = '\0';
+  script_arena_len += len + 1;
+  return expansion;
+}
+
+// Fills in the template's argv with the words expanded, exits if they do not fit.
+static char ** expand_script_template( const script_t * script,
+                                       script_template_t * template,
+                                       const script_frame_t * frame,
+                                       int status )
+{
+  size_t iword;
+  for ( iword = 0; iword < template->words_count; iword++ )
+  {
+    if ( template->has_variables[iword] )
+    {
+      template->argv[iword] = expand_script_word( template->words[iword], frame, status );
+      if ( template->argv[iword] == NULL )
+      {
+        ERROR( "%s:%lu: the command is too long", script->filename, template->line );
+        free_and_exit( EXIT_FAILURE );
+      }
+    }
+  }
+  return template->argv;
+}
+
+// Content of the template's here-document or here-string, NULL if it has none.
+// The words of the template should be expanded already.
+static char * expand_script_input( const script_t * script,
+                                   const script_template_t * template,
+                                   const script_frame_t * frame,
+                                   int status,
+                                   size_t * len )
+{
+  if ( template->input_redirection == INPUT_REDIRECTION_HERE_STRING )
+  {
+    size_t start = template->input_start + 1;
+    return join_here_string( template->argv + start, template->words_count - start, len );
+  }
+  if ( template->input_redirection != INPUT_REDIRECTION_HERE_DOCUMENT )
+  {
+    return NULL;
+  }
+  const char * body = template->here_document;
+  if ( template->here_document_has_variables )
+  {
+    body = expand_script_word( body, frame, status );
+    if ( body == NULL )
+    {
+      ERROR( "%s:%lu: the here-document is too long", script->filename, template->line );
+      free_and_exit( EXIT_FAILURE );
+    }
+  }
+  *len = strlen( body );
+  return strdup( body );
+}
+
+// Assigning keeps the variable in the environment, if it is there.
+static void assign_script_variable( const char * name, const char * value )
+{
+  variable_t * variable = find_variable( name );
+  set_variable( name, value, variable != NULL && variable->exported );
+}
+
+// cd, export and unset change msh's own state, so they run in place.
+static int run_script_state_builtin( char ** argv, size_t argc )
+{
+  const char * command = argv[0];
+  if ( strcmp( command, "cd" ) == 0 )
+  {
+    const char * directory = argc > 1 ? argv[1] : get_variable( "HOME" );
+    if ( argc > 2 || directory == NULL )
+    {
+      ERROR( argc > 2 ? "cd: Too many arguments, must be one" : "cd: HOME variable not set" );
+      return EXIT_FAILURE;
+    }
+    return try_change_directory( directory ) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if ( strcmp( command, "export" ) == 0 || strcmp( command, "unset" ) == 0 )
+  {
+    int status = EXIT_SUCCESS;
+    size_t iarg;
+    for ( iarg = 1; iarg < argc; iarg++ )
+    {
+      char * separator = strchr( argv[iarg], '=' );
+      char * name =
+          separator ? strndup( argv[iarg], ( size_t )( separator - argv[iarg] ) ) : strdup( argv[iarg] );
+      if ( !is_valid_variable_name( name ) )
+      {
+        ERROR( "%s: %s: not a valid identifier", command, argv[iarg] );
+        status = EXIT_FAILURE;
+      }
+      else if ( strcmp( command, "unset" ) == 0 )
+      {
+        unset_variable( name );
+      }
+      else if ( separator != NULL || get_variable( name ) != NULL )
+      {
+        set_variable( name, separator ? separator + 1 : get_variable( name ), true );
+      }
+      free( name );
+    }
+    if ( strcmp( command, "export" ) == 0 && argc == 1 )
+    {
+      char ** entry;
+      for ( entry = get_envp(); *entry; entry++ )
+      {
+        printf( "export %s\n", *entry );
+      }
+    }
+    return status;
+  }
+  if ( strcmp( command, "bg" ) == 0 )
+  {
+    ERROR( "bg: no job control" );
+    return EXIT_FAILURE;
+  }
+  // Exit in a condition, still an exit.
+  free_and_exit( argc > 1 ? atoi( argv[1] ) & 0xff : EXIT_SUCCESS );
+  return EXIT_SUCCESS;
+}
+
+// Runs a command of the script, forking only for the ones msh can't run in place.
+// The in-process commands do not read their input, the others get it as their stdin.
+static int run_script_command( char ** argv, size_t argc, const char * input, size_t input_len )
+{
+  if ( is_fast_builtin( argv[0] ) )
+  {
+    return run_fast_builtin( argv );
+  }
+  if ( is_state_builtin( argv[0] ) )
+  {
+    return run_script_state_builtin( argv, argc );
+  }
+
+  // Whatever is buffered goes before the command's output.
+  fflush( stdout );
+  METRICS_ADD( forks, 1 );
+  pid_t child_pid = fork();
+  if ( child_pid == -1 )
+  {
+    ERROR( "%s: fork failed: %s", argv[0], strerror( errno ) );
+    return EXIT_FAILURE;
+  }
+  if ( child_pid == 0 )
+  {
+    trace_process_started( "worker" );
+    log_process_started();
+    signal( SIGCONT, SIG_DFL );
+    signal( SIGCHLD, SIG_DFL );
+    signal( SIGTERM, SIG_DFL );
+    set_event_signals_blocked( false );
+    my_process_type = PROCESS_TYPE_WORKER;
+    if ( input != NULL && !redirect_input_document( input, input_len ) )
+    {
+      free_and_exit( EXIT_FAILURE );
+    }
+    if ( argc <= MAX_NUM_ARGUMENTS )
+    {
+      // Builtins and fan-outs take their words from tokens.
+      size_t iarg;
+      for ( iarg = 0; iarg < argc; iarg++ )
+      {
+        tokens[iarg] = strdup( argv[iarg] );
+      }
+      tokens[argc] = NULL;
+      run_worker();
+    }
+    if ( is_fan_out( argv ) )
+    {
+      tokens[0] = join_fan_out_words( argv, argc );
+      tokens[1] = NULL;
+      run_worker();
+    }
+    free_and_exit( exec_external_command( argv ) );
+  }
+
+  int status = 0;
+  while ( waitpid( child_pid, &status, 0 ) == -1 && errno == EINTR )
+    ;
+  return WIFSIGNALED( status ) ? 128 + WTERMSIG( status ) : WEXITSTATUS( status );
+}
+
+// Words of a for loop are split by spaces, and the ones with wildcards are globbed.
+static void start_script_loop( script_loop_t * loop, char ** words, size_t words_count )
+{
+  size_t items_capacity = words_count + 8;
+  loop->items = (char **)malloc( items_capacity * sizeof( char * ) );
+  loop->items_count = 0;
+  loop->next_item = 0;
+  size_t iword;
+  for ( iword = 0; iword < words_count; iword++ )
+  {
+    char * saveptr = NULL;
+    char * field;
+    for ( field = strtok_r( words[iword], " \t\n", &saveptr ); field != NULL;
+          field = strtok_r( NULL, " \t\n", &saveptr ) )
+    {
+      glob_t matches;
+      memset( &matches, 0, sizeof( matches ) );
+      bool globbed = strpbrk( field, "*?[" ) != NULL && glob( field, GLOB_NOCHECK, NULL, &matches ) == 0;
+      size_t matches_count = globbed ? matches.gl_pathc : 1;
+      if ( loop->items_count + matches_count > items_capacity )
+      {
+        items_capacity = ( loop->items_count + matches_count ) * 2;
+        loop->items = (char **)realloc( loop->items, items_capacity * sizeof( char * ) );
+      }
+      size_t imatch;
+      for ( imatch = 0; imatch < matches_count; imatch++ )
+      {
+        loop->items[loop->items_count++] = strdup( globbed ? matches.gl_pathv[imatch] : field );
+      }
+      globfree( &matches );
+    }
+  }
+}
+
+static void end_script_loop( script_loop_t * loop )
+{
+  size_t iitem;
+  for ( iitem = 0; iitem < loop->items_count; iitem++ )
+  {
+    free( loop->items[iitem] );
+  }
+  free( loop->items );
+}
+
+static void free_script_frame_args( script_frame_t * frame )
+{
+  size_t iarg;
+  for ( iarg = 0; iarg < frame->args_count; iarg++ )
+  {
+    free( frame->args[iarg] );
+  }
+  free( frame->args );
+  if ( frame->saved_stdin != -1 )
+  {
+    dup2( frame->saved_stdin, STDIN_FILENO );
+    close( frame->saved_stdin );
+  }
+}
+
+// Status from the only word of the template, or the current one without it.
+static int get_script_exit_status( const script_t * script,
+                                   uint32_t template_index,
+                                   const script_frame_t * frame,
+                                   int status )
+{
+  if ( template_index == SCRIPT_NONE )
+  {
+    return status;
+  }
+  char ** argv = expand_script_template( script, &script->templates[template_index], frame, status );
+  return atoi( argv[0] ) & 0xff;
+}
+
+// Runs the compiled script, returns its exit status.
+static int run_script_code( script_t * script, size_t args_count, char ** args )
+{
+  static script_frame_t frames[SCRIPT_MAX_CALL_DEPTH];
+  size_t frames_count = 1;
+  frames[0].args = (char **)malloc( args_count * sizeof( char * ) );
+  frames[0].args_count = args_count;
+  size_t iarg;
+  for ( iarg = 0; iarg < args_count; iarg++ )
+  {
+    frames[0].args[iarg] = strdup( args[iarg] );
+  }
+  frames[0].loops_count = 0;
+  frames[0].saved_stdin = -1;
+
+  script_loop_t * loops = NULL;
+  size_t loops_count = 0;
+  size_t loops_capacity = 0;
+  int status = EXIT_SUCCESS;
+  size_t pc = 0;
+  bool running = true;
+  while ( running )
+  {
+    const script_instruction_t * instruction = &script->code[pc++];
+    script_frame_t * frame = &frames[frames_count - 1];
+    script_template_t * template =
+        instruction->template_index != SCRIPT_NONE ? &script->templates[instruction->template_index] : NULL;
+    script_arena_len = 0;
+    switch ( (script_opcode_t)instruction->opcode )
+    {
+      case SCRIPT_OP_RUN:
+      {
+        char ** argv = expand_script_template( script, template, frame, status );
+        size_t input_len = 0;
+        char * input = expand_script_input( script, template, frame, status, &input_len );
+        status = run_script_command( argv, template->input_start, input, input_len );
+        free( input );
+        break;
+      }
+      case SCRIPT_OP_CALL:
+      {
+        if ( frames_count == SCRIPT_MAX_CALL_DEPTH )
+        {
+          ERROR( "%s:%lu: %s: too deep recursion", script->filename, template->line, template->words[0] );
+          free_and_exit( EXIT_FAILURE );
+        }
+        char ** argv = expand_script_template( script, template, frame, status );
+        script_frame_t * callee = &frames[frames_count++];
+        callee->args = (char **)malloc( template->input_start * sizeof( char * ) );
+        callee->args_count = template->input_start;
+        // $0 stays the script's name.
+        callee->args[0] = strdup( frames[0].args[0] );
+        for ( iarg = 1; iarg < template->input_start; iarg++ )
+        {
+          callee->args[iarg] = strdup( argv[iarg] );
+        }
+        callee->return_pc = pc;
+        callee->loops_count = loops_count;
+        callee->saved_stdin = -1;
+        size_t input_len = 0;
+        char * input = expand_script_input( script, template, frame, status, &input_len );
+        if ( input != NULL )
+        {
+          // The function's commands read its input, until it returns.
+          callee->saved_stdin = fcntl( STDIN_FILENO, F_DUPFD_CLOEXEC, 0 );
+          if ( callee->saved_stdin == -1 || !redirect_input_document( input, input_len ) )
+          {
+            ERROR( "%s:%lu: %s: no input: %s", script->filename, template->line, argv[0], strerror( errno ) );
+            free_and_exit( EXIT_FAILURE );
+          }
+          free( input );
+        }
+        pc = script->functions[instruction->target].entry;
+        break;
+      }
+      case SCRIPT_OP_ASSIGN:
+      {
+        char ** argv = expand_script_template( script, template, frame, status );
+        assign_script_variable( argv[0], argv[1] );
+        status = EXIT_SUCCESS;
+        break;
+      }
+      case SCRIPT_OP_NOT:
+        status = status == EXIT_SUCCESS ? EXIT_FAILURE : EXIT_SUCCESS;
+        break;
+      case SCRIPT_OP_JUMP:
+        pc = instruction->target;
+        break;
+      case SCRIPT_OP_JUMP_IF_FAILED:
+        pc = status != EXIT_SUCCESS ? instruction->target : pc;
+        break;
+      case SCRIPT_OP_JUMP_IF_SUCCEEDED:
+        pc = status == EXIT_SUCCESS ? instruction->target : pc;
+        break;
+      case SCRIPT_OP_FOR_INIT:
+        if ( loops_count == loops_capacity )
+        {
+          loops_capacity = loops_capacity ? loops_capacity * 2 : 16;
+          loops = (script_loop_t *)realloc( loops, loops_capacity * sizeof( script_loop_t ) );
+        }
+        start_script_loop( &loops[loops_count++],
+                           expand_script_template( script, template, frame, status ),
+                           template->input_start );
+        break;
+      case SCRIPT_OP_FOR_NEXT:
+      {
+        script_loop_t * loop = &loops[loops_count - 1];
+        if ( loop->next_item == loop->items_count )
+        {
+          pc = instruction->target;
+        }
+        else
+        {
+          assign_script_variable( template->words[0], loop->items[loop->next_item++] );
+        }
+        break;
+      }
+      case SCRIPT_OP_FOR_END:
+        end_script_loop( &loops[--loops_count] );
+        break;
+      case SCRIPT_OP_RETURN:
+        status = get_script_exit_status( script, instruction->template_index, frame, status );
+        if ( frames_count == 1 )
+        {
+          // Outside of functions, the same as exit.
+          running = false;
+          break;
+        }
+        for ( ; loops_count > frame->loops_count; loops_count-- )
+        {
+          end_script_loop( &loops[loops_count - 1] );
+        }
+        pc = frame->return_pc;
+        free_script_frame_args( frame );
+        frames_count--;
+        break;
+      case SCRIPT_OP_EXIT:
+        status = get_script_exit_status( script, instruction->template_index, frame, status );
+        running = false;
+        break;
+    }
+  }
+
+  for ( ; loops_count > 0; loops_count-- )
+  {
+    end_script_loop( &loops[loops_count - 1] );
+  }
+  free( loops );
+  for ( ; frames_count > 0; frames_count-- )
+  {
+    free_script_frame_args( &frames[frames_count - 1] );
+  }
+  return status;
+}
 
-// Should initialize by zero as they are in static memory.
-static char * tokens[MAX_NUM_ARGUMENTS + 1];
+// msh FILE [arguments]: compiles and runs the script, with the same process
+// setup msh -c has. Exits with the status of the script.
+static void run_script( const char * filename, size_t args_count, char ** args )
+{
+  my_process_type = PROCESS_TYPE_LINER;
+  one_shot_mode = true;
+  signal( SIGCHLD, sigchld_handler_for_liner );
+  set_event_signals_blocked( true );
 
-// Free current set of tokens for current process.
-static void free_tokens()
+  script_t script;
+  if ( !compile_script( &script, filename ) )
+  {
+    free_and_exit( EXIT_COMMAND_NOT_FOUND );
+  }
+  LOG( "Compiled %s into %lu instructions", filename, script.code_count );
+  int status = run_script_code( &script, args_count, args );
+  free_script( &script );
+  free_and_exit( status );
+}
+
+// Command server mode (msh --serve <socket> [max_jobs]).
+// Other local processes connect to the unix socket and send a request:
+//   cwd <directory>          (optional)
+//   env <NAME>=<value>       (optional, any number of them)
+//   run <command line>       (the last line of the request)
+// The line is run the same way msh -c does, while its output is streamed back
+// as frames "out <length>\n<data>" and "err <length>\n<data>", and the last
+// frame is "exit <status>\n". At most max_jobs requests are run at once,
+// others wait in the socket's backlog.
+#define SERVE_DEFAULT_MAX_JOBS 4
+#define SERVE_MAX_REQUEST_ENV 256
+
+typedef struct serve_request_t
 {
-  char ** token;
-  for ( token = tokens; *token; token++ )
+  char * cwd;
+  char * env[SERVE_MAX_REQUEST_ENV];
+  size_t env_count;
+  char * command_line;
+} serve_request_t;
+
+static void free_serve_request( serve_request_t * request )
+{
+  free( request->cwd );
+  size_t ienv;
+  for ( ienv = 0; ienv < request->env_count; ienv++ )
   {
-    free( *token );
-    *token = NULL;
+    free( request->env[ienv] );
   }
+  free( request->command_line );
 }
 
-// Free resources used in current command line input iteration.
-// We only need to take of variables created with malloc().
-static void free_current_input_resources()
+// Returns 0 on success, -1 if the request is malformed or the client has gone.
+static int read_serve_request( FILE * client, serve_request_t * request )
 {
-  free_tokens();
-  free( cmd_line );
-  cmd_line = NULL;
+  memset( request, 0, sizeof( serve_request_t ) );
+  char * line = NULL;
+  size_t line_capacity = 0;
+  ssize_t line_len;
+  int result = -1;
+  while ( ( line_len = getline( &line, &line_capacity, client ) ) > 0 )
+  {
+    if ( line[line_len - 1] == '\n' )
+    {
+      line[--line_len] = '\0';
+    }
+
+    if ( strncmp( line, "cwd ", 4 ) == 0 )
+    {
+      free( request->cwd );
+      request->cwd = strdup( line + 4 );
+    }
+    else if ( strncmp( line, "env ", 4 ) == 0 && strchr( line + 4, '=' ) != NULL &&
+              request->env_count < SERVE_MAX_REQUEST_ENV )
+    {
+      request->env[request->env_count++] = strdup( line + 4 );
+    }
+    else if ( strncmp( line, "run ", 4 ) == 0 )
+    {
+      request->command_line = strdup( line + 4 );
+      result = 0;
+      break;
+    }
+    else
+    {
+      LOG( "serve: bad request line: %s", line );
+      break;
+    }
+  }
+  free( line );
+  return result;
 }
 
-// This enum tells us in which state worker process
-// (the one that runs a single command) is in.
-// There also could be some WORKER_STATE_FINISHED,
-// but we are removing worker info as soon as it finishes,
-// So, WORKER_STATE_FINISHED would not be used anywhere.
-typedef enum worker_state_t
+// Write the whole buffer, returns -1 if the client has gone.
+static int write_fully( int fd, const char * buf, size_t len )
 {
-  WORKER_STATE_ACTIVE,
-  WORKER_STATE_SUSPENDED,
-  WORKER_STATE_BACKGROUND
-} worker_state_t;
+  while ( len > 0 )
+  {
+    ssize_t written = write( fd, buf, len );
+    if ( written == -1 )
+    {
+      if ( errno == EINTR )
+      {
+        continue;
+      }
+      return -1;
+    }
+    buf += written;
+    len -= ( size_t )written;
+  }
+  return 0;
+}
 
-// We are saving our current liner child's pid to be able to resume it,
-// when msh user asks for putting this liner's command into the background.
-static pid_t liner_child_pid = -1;
-typedef struct liner_job_t
+static int write_serve_frame( int client_fd, const char * frame_name, const char * data, size_t len )
 {
-  pid_t pid;
-  pid_t pgid;
-  worker_state_t state;
-} liner_job_t;
+  char header[32];
+  int header_len = snprintf( header, sizeof( header ), "%s %lu\n", frame_name, len );
+  if ( write_fully( client_fd, header, ( size_t )header_len ) == -1 )
+  {
+    return -1;
+  }
+  return write_fully( client_fd, data, len );
+}
 
-typedef struct liner_list_item_t
+// Run a single request of the connected client, in a separate process.
+static void serve_client( int client_fd )
 {
-  // next_liner_list_item points at the liner,
-  // which was added before current liner_list.
-  struct liner_list_item_t * next_liner_list_item;
+  FILE * client = fdopen( dup( client_fd ), "r" );
+  serve_request_t request;
+  if ( client == NULL || read_serve_request( client, &request ) == -1 )
+  {
+    const char * error_message = "msh: bad request\n";
+    write_serve_frame( client_fd, "err", error_message, strlen( error_message ) );
+    write_fully( client_fd, "exit 2\n", strlen( "exit 2\n" ) );
+    exit( EXIT_FAILURE );
+  }
+  fclose( client );
 
-  // Stored liner job's info.
-  liner_job_t * liner_job;
-} liner_list_item_t;
+  int out_pipe[2], err_pipe[2];
+  if ( pipe( out_pipe ) == -1 || pipe( err_pipe ) == -1 )
+  {
+    ERROR( "serve: failed to create pipes" );
+    exit( EXIT_FAILURE );
+  }
 
-// Pointer to the first liner in the list to be traversed.
-// By design, it is the last liner added.
-static liner_list_item_t * liner;
+  pid_t runner_pid = fork();
+  if ( runner_pid == -1 )
+  {
+    char error_message[128];
+    int error_message_len =
+        snprintf( error_message, sizeof( error_message ), "msh: fork failed: %s\n", strerror( errno ) );
+    write_serve_frame( client_fd, "err", error_message, ( size_t )error_message_len );
+    write_fully( client_fd, "exit 1\n", strlen( "exit 1\n" ) );
+    exit( EXIT_FAILURE );
+  }
+  if ( runner_pid == 0 )
+  {
+    // The server ignores SIGPIPE for itself, the commands get it as usual:
+    // an ignored signal stays ignored through exec().
+    signal( SIGPIPE, SIG_DFL );
+    int null_fd = open( "/dev/null", O_RDONLY );
+    dup2( null_fd, STDIN_FILENO );
+    dup2( out_pipe[1], STDOUT_FILENO );
+    dup2( err_pipe[1], STDERR_FILENO );
+    close( null_fd );
+    close( out_pipe[0] );
+    close( out_pipe[1] );
+    close( err_pipe[0] );
+    close( err_pipe[1] );
+    close( client_fd );
+
+    if ( request.cwd != NULL && chdir( request.cwd ) == -1 )
+    {
+      ERROR( "cd: %s: %s", request.cwd, strerror( errno ) );
+      exit( EXIT_FAILURE );
+    }
+    size_t ienv;
+    for ( ienv = 0; ienv < request.env_count; ienv++ )
+    {
+      char * separator = strchr( request.env[ienv], '=' );
+      *separator = '\0';
+      if ( is_valid_variable_name( request.env[ienv] ) )
+      {
+        set_variable( request.env[ienv], separator + 1, true );
+      }
+    }
+    char * command_line = strdup( request.command_line );
+    free_serve_request( &request );
+    run_one_shot( command_line );
+  }
+  close( out_pipe[1] );
+  close( err_pipe[1] );
+
+  // Stream both outputs until the command line closes them.
+  struct pollfd output_fds[2] = { { out_pipe[0], POLLIN, 0 }, { err_pipe[0], POLLIN, 0 } };
+  const char * frame_names[2] = { "out", "err" };
+  size_t open_count = 2;
+  bool client_gone = false;
+  while ( open_count > 0 )
+  {
+    if ( poll( output_fds, 2, -1 ) == -1 )
+    {
+      if ( errno == EINTR )
+      {
+        continue;
+      }
+      break;
+    }
 
-// Create new liner job and put it into our liners list.
-static liner_job_t * add_liner_list_item( pid_t liner_pid )
+    size_t ifd;
+    for ( ifd = 0; ifd < 2; ifd++ )
+    {
+      if ( output_fds[ifd].fd == -1 || output_fds[ifd].revents == 0 )
+      {
+        continue;
+      }
+      char buf[4096];
+      ssize_t read_len = read( output_fds[ifd].fd, buf, sizeof( buf ) );
+      if ( read_len > 0 )
+      {
+        if ( !client_gone &&
+             write_serve_frame( client_fd, frame_names[ifd], buf, ( size_t )read_len ) == -1 )
+        {
+          // Keep draining the pipes, so the command is not blocked forever.
+          client_gone = true;
+        }
+      }
+      else if ( read_len == 0 || errno != EINTR )
+      {
+        close( output_fds[ifd].fd );
+        output_fds[ifd].fd = -1;
+        open_count--;
+      }
+    }
+  }
+
+  int runner_status = 0;
+  while ( waitpid( runner_pid, &runner_status, 0 ) == -1 && errno == EINTR )
+    ;
+  int exit_status = WIFEXITED( runner_status ) ? WEXITSTATUS( runner_status ) :
+                                                 128 + WTERMSIG( runner_status );
+  char exit_frame[32];
+  int exit_frame_len = snprintf( exit_frame, sizeof( exit_frame ), "exit %d\n", exit_status );
+  if ( !client_gone )
+  {
+    write_fully( client_fd, exit_frame, ( size_t )exit_frame_len );
+  }
+  free_serve_request( &request );
+  exit( EXIT_SUCCESS );
+}
+
+// Accept clients on socket_path forever, serving up to max_jobs of them at once.
+static int run_server( const char * socket_path, int max_jobs )
 {
-  LOG( "Adding new_liner_list_item, pid %d", liner_pid );
-  assert( my_process_type == PROCESS_TYPE_SHELL );
+  struct sockaddr_un address;
+  memset( &address, 0, sizeof( address ) );
+  address.sun_family = AF_UNIX;
+  if ( strlen( socket_path ) >= sizeof( address.sun_path ) )
+  {
+    ERROR( "serve: socket path is too long: %s", socket_path );
+    return EXIT_FAILURE;
+  }
+  strcpy( address.sun_path, socket_path );
 
-  liner_job_t * new_liner_job = (liner_job_t *)malloc( sizeof( liner_job_t ) );
-  new_liner_job->pid = liner_pid;
-  new_liner_job->pgid = getpgrp();
-  new_liner_job->state = WORKER_STATE_ACTIVE;
+  // A socket left by a previous server is replaced.
+  struct stat socket_stat;
+  if ( stat( socket_path, &socket_stat ) == 0 && S_ISSOCK( socket_stat.st_mode ) )
+  {
+    unlink( socket_path );
+  }
 
-  liner_list_item_t * new_liner_list_item =
-      (liner_list_item_t *)malloc( sizeof( liner_list_item_t ) );
-  new_liner_list_item->next_liner_list_item = liner;
-  new_liner_list_item->liner_job = new_liner_job;
-  liner = new_liner_list_item;
+  int server_fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+  if ( server_fd == -1 || bind( server_fd, (struct sockaddr *)&address, sizeof( address ) ) == -1 ||
+       listen( server_fd, 64 ) == -1 )
+  {
+    ERROR( "serve: failed to listen on %s: %s", socket_path, strerror( errno ) );
+    return EXIT_FAILURE;
+  }
+  // Clients going away must not kill the server's processes.
+  signal( SIGPIPE, SIG_IGN );
+  LOG( "Serving on %s with %d jobs at most", socket_path, max_jobs );
 
-  return new_liner_job;
+  int running_jobs = 0;
+  while ( true )
+  {
+    // Reap finished handlers, waiting for one if the pool is full.
+    pid_t handler_pid;
+    while ( running_jobs > 0 &&
+            ( handler_pid = waitpid( -1, NULL, running_jobs >= max_jobs ? 0 : WNOHANG ) ) > 0 )
+    {
+      running_jobs--;
+    }
+
+    int client_fd = accept4( server_fd, NULL, NULL, SOCK_CLOEXEC );
+    if ( client_fd == -1 )
+    {
+      if ( errno != EINTR )
+      {
+        ERROR( "serve: accept failed: %s", strerror( errno ) );
+      }
+      continue;
+    }
+
+    handler_pid = fork();
+    if ( handler_pid == 0 )
+    {
+      close( server_fd );
+      serve_client( client_fd );
+    }
+    else if ( handler_pid == -1 )
+    {
+      ERROR( "serve: fork failed: %s", strerror( errno ) );
+    }
+    else
+    {
+      running_jobs++;
+    }
+    close( client_fd );
+  }
 }
 
-// Remove a liner info from list when its process finished.
-static void remove_liner_list_item( pid_t liner_pid )
+// Shell's event loop. While the shell waits for the user's input or for its
+// foreground liner, it reacts to the file descriptors registered here.
+typedef struct watched_fd_t
 {
-  LOG( "Removing liner with pid %d", liner_pid );
-  liner_list_item_t * current_item = liner;
+  struct watched_fd_t * next_watched_fd;
+  // -1 after the descriptor is unwatched, the structure is freed later,
+  // as it can still be referred to by events already received.
+  int fd;
+  fd_event_handler_t handler;
+  void * data;
+} watched_fd_t;
+
+static int shell_epoll_fd = -1;
+static watched_fd_t * watched_fds = NULL;
+
+static void watch_fd( int fd, uint32_t events, fd_event_handler_t handler, void * data )
+{
+  if ( shell_epoll_fd == -1 )
+  {
+    shell_epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+  }
 
-  // previous_item preserves the liner_list_item which points at our
-  // liner_list_item to be deleted. We have to update next element links,
-  // when removing an item from a list.
-  liner_list_item_t * previous_item = NULL;
+  watched_fd_t * watched_fd = (watched_fd_t *)malloc( sizeof( watched_fd_t ) );
+  watched_fd->fd = fd;
+  watched_fd->handler = handler;
+  watched_fd->data = data;
+  watched_fd->next_watched_fd = watched_fds;
+  watched_fds = watched_fd;
+
+  struct epoll_event event;
+  memset( &event, 0, sizeof( event ) );
+  event.events = events;
+  event.data.ptr = watched_fd;
+  if ( epoll_ctl( shell_epoll_fd, EPOLL_CTL_ADD, fd, &event ) == -1 )
+  {
+    ERROR( "Failed to watch descriptor %d: %s", fd, strerror( errno ) );
+    watched_fd->fd = -1;
+  }
+}
+
+static void unwatch_fd( int fd )
+{
+  watched_fd_t * watched_fd;
+  for ( watched_fd = watched_fds; watched_fd; watched_fd = watched_fd->next_watched_fd )
+  {
+    if ( watched_fd->fd == fd )
+    {
+      epoll_ctl( shell_epoll_fd, EPOLL_CTL_DEL, fd, NULL );
+      watched_fd->fd = -1;
+    }
+  }
+}
+
+// Free structures of unwatched descriptors.
+static void collect_unwatched_fds()
+{
+  watched_fd_t ** link = &watched_fds;
+  while ( *link != NULL )
+  {
+    watched_fd_t * watched_fd = *link;
+    if ( watched_fd->fd == -1 )
+    {
+      *link = watched_fd->next_watched_fd;
+      free( watched_fd );
+    }
+    else
+    {
+      link = &watched_fd->next_watched_fd;
+    }
+  }
+}
+
+// Wait up to timeout_ms (-1 is forever) for events and handle them.
+// Signals interrupt waiting as well, and this is the only place
+// SIGCHLD and SIGUSR1 are delivered (see set_event_signals_blocked()).
+static void poll_shell_events( int timeout_ms )
+{
+  if ( shell_epoll_fd == -1 )
+  {
+    // Nothing is watched, but waiting for signals works the same way.
+    shell_epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+  }
+
+  sigset_t wait_signals;
+  sigprocmask( SIG_SETMASK, NULL, &wait_signals );
+  sigdelset( &wait_signals, SIGCHLD );
+  sigdelset( &wait_signals, SIGUSR1 );
+  struct epoll_event events[16];
+  int events_count = epoll_pwait( shell_epoll_fd, events, 16, timeout_ms, &wait_signals );
+
+  // epoll_pwait() returns without delivering the signals when a descriptor is ready
+  // already, so with one always ready (typeahead, say) a job would never be reaped.
+  sigset_t pending_signals;
+  sigpending( &pending_signals );
+  if ( sigismember( &pending_signals, SIGCHLD ) || sigismember( &pending_signals, SIGUSR1 ) )
+  {
+    set_event_signals_blocked( false );
+    set_event_signals_blocked( true );
+  }
+
+  int ievent;
+  for ( ievent = 0; ievent < events_count; ievent++ )
+  {
+    watched_fd_t * watched_fd = (watched_fd_t *)events[ievent].data.ptr;
+    if ( watched_fd->fd != -1 )
+    {
+      watched_fd->handler( watched_fd->fd, events[ievent].events, watched_fd->data );
+    }
+  }
+  collect_unwatched_fds();
+}
+
+// On exit the data of descriptors still watched is freed as well,
+// so it should be allocated with malloc() or be NULL.
+static void free_watched_fds()
+{
+  while ( watched_fds != NULL )
+  {
+    watched_fd_t * watched_fd = watched_fds;
+    watched_fds = watched_fd->next_watched_fd;
+    if ( watched_fd->fd != -1 )
+    {
+      free( watched_fd->data );
+    }
+    free( watched_fd );
+  }
+  if ( shell_epoll_fd != -1 )
+  {
+    close( shell_epoll_fd );
+    shell_epoll_fd = -1;
+  }
+}
+
+// The terminal is watched while a line is read, so the shell keeps handling
+// events while the user is typing.
+static bool terminal_input_ready = false;
+
+static void handle_terminal_input( int fd, uint32_t events, void * data )
+{
+  (void)fd;
+  (void)events;
+  (void)data;
+  terminal_input_ready = true;
+}
+
+static void wait_for_terminal_input()
+{
+  while ( shell_epoll_fd != -1 && !terminal_input_ready )
+  {
+    poll_shell_events( -1 );
+  }
+  terminal_input_ready = false;
+}
+
+// Prompt format. MSH_PROMPT may have these segments, other characters are printed as is:
+//   %~  the current directory, with $HOME shown as ~
+//   %c  the last component of the current directory
+//   %b  the git branch (or the short commit, when detached), nothing outside of a repository
+//   %?  the status of the last line
+//   %j  the number of jobs in the background or suspended
+//   %%  the % itself
+// Looking for the git branch can take a while on a slow file system, so it is
+// done by a helper process answering through a pipe. The prompt is printed right
+// away with the last known branch, and is redrawn in place if the answer differs.
+// The branch is looked for again after the directory has changed or a job has run.
+#define GIT_BRANCH_SIZE 128
+#define GIT_SHORT_COMMIT_SIZE 7
+
+static char git_branch[GIT_BRANCH_SIZE] = "";
+// The directory git_branch was looked for in.
+static char * git_branch_cwd = NULL;
+
+static int prompt_helper_fd = -1;
+static char prompt_helper_answer[GIT_BRANCH_SIZE];
+static size_t prompt_helper_answer_len = 0;
+
+// Reads the first line of the file, returns false if there is none.
+static bool read_first_line( const char * path, char * line, size_t line_size )
+{
+  FILE * f = fopen( path, "r" );
+  if ( f == NULL )
+  {
+    return false;
+  }
+  bool line_read = fgets( line, (int)line_size, f ) != NULL;
+  fclose( f );
+  if ( line_read )
+  {
+    line[strcspn( line, "\n" )] = '\0';
+  }
+  return line_read;
+}
+
+// Finds the branch of the repository dir is in, the same way git does:
+// the closest .git up the tree, which is a directory or a "gitdir: <path>" file.
+static bool find_git_branch( const char * dir, char * branch, size_t branch_size )
+{
+  char path[PATH_MAX];
+  char head[PATH_MAX];
+  size_t dir_len = strlen( dir );
+  while ( true )
+  {
+    // The paths are too long to be a repository then, as for git itself.
+    if ( ( size_t )snprintf( path, sizeof( path ), "%.*s/.git", (int)dir_len, dir ) >= sizeof( path ) )
+    {
+      return false;
+    }
+    struct stat git_stat;
+    if ( stat( path, &git_stat ) == 0 )
+    {
+      char git_dir[PATH_MAX];
+      int git_dir_len;
+      if ( S_ISDIR( git_stat.st_mode ) )
+      {
+        git_dir_len = snprintf( git_dir, sizeof( git_dir ), "%s", path );
+      }
+      else if ( read_first_line( path, head, sizeof( head ) ) && strncmp( head, "gitdir: ", 8 ) == 0 )
+      {
+        // Worktrees and submodules, the path can be relative to the directory.
+        if ( head[8] == '/' )
+        {
+          git_dir_len = snprintf( git_dir, sizeof( git_dir ), "%s", head + 8 );
+        }
+        else
+        {
+          git_dir_len = snprintf( git_dir, sizeof( git_dir ), "%.*s/%s", (int)dir_len, dir, head + 8 );
+        }
+      }
+      else
+      {
+        return false;
+      }
 
-  // Traversing the list, trying to find item with liner_job->pid = liner_pid.
-  while ( current_item != NULL )
-  {
-    liner_job_t * liner_job = current_item->liner_job;
-    if ( liner_job->pid == liner_pid )
-    {
-      if ( previous_item != NULL )
+      if ( ( size_t )git_dir_len >= sizeof( git_dir )
+           || ( size_t )snprintf( path, sizeof( path ), "%s/HEAD", git_dir ) >= sizeof( path )
+           || !read_first_line( path, head, sizeof( head ) ) )
       {
-        previous_item->next_liner_list_item = current_item->next_liner_list_item;
+        return false;
+      }
+      const char * name = head;
+      size_t name_len;
+      if ( strncmp( head, "ref: refs/heads/", 16 ) == 0 )
+      {
+        name += 16;
+        name_len = strlen( name );
+      }
+      else if ( strncmp( head, "ref: ", 5 ) == 0 )
+      {
+        name += 5;
+        name_len = strlen( name );
       }
       else
       {
-        assert( current_item == liner );
-        liner = current_item->next_liner_list_item;
+        name_len = strnlen( head, GIT_SHORT_COMMIT_SIZE );
+      }
+      // A branch name cut to fit would look like another branch, so there is none then.
+      if ( name_len >= branch_size )
+      {
+        return false;
       }
+      memcpy( branch, name, name_len );
+      branch[name_len] = '\0';
+      return true;
+    }
 
-      free( liner_job );
-      free( current_item );
+    // Going up, until the root is checked.
+    if ( dir_len <= 1 )
+    {
+      return false;
+    }
+    while ( dir_len > 0 && dir[dir_len - 1] != '/' )
+    {
+      dir_len--;
+    }
+    if ( dir_len > 1 )
+    {
+      dir_len--;
+    }
+  }
+}
 
+static void handle_prompt_helper_answer( int fd, uint32_t events, void * data )
+{
+  (void)events;
+  (void)data;
+  ssize_t read_result = read( fd,
+                              prompt_helper_answer + prompt_helper_answer_len,
+                              sizeof( prompt_helper_answer ) - 1 - prompt_helper_answer_len );
+  if ( read_result > 0 )
+  {
+    prompt_helper_answer_len += ( size_t )read_result;
+    if ( prompt_helper_answer_len < sizeof( prompt_helper_answer ) - 1 )
+    {
       return;
     }
+  }
+  else if ( read_result == -1 && errno == EINTR )
+  {
+    return;
+  }
 
-    previous_item = current_item;
-    current_item = current_item->next_liner_list_item;
+  unwatch_fd( fd );
+  close( fd );
+  prompt_helper_fd = -1;
+  prompt_helper_answer[prompt_helper_answer_len] = '\0';
+  if ( strcmp( git_branch, prompt_helper_answer ) == 0 )
+  {
+    return;
   }
+  snprintf( git_branch, sizeof( git_branch ), "%s", prompt_helper_answer );
 
-  ERROR( "Not found liner with pid %d", liner_pid );
+  // The prompt being shown has the branch outdated.
+  if ( edited_line != NULL )
+  {
+    clear_edited_line();
+    print_prompt();
+    write_string( edited_line );
+  }
 }
 
-// Free the whole list of liners info structures.
-// To be called on msh's exit.
-static void free_liner_list()
+static void start_prompt_helper( const char * cwd )
 {
-  liner_list_item_t * current_item = liner;
-  // Traversing the list, trying to find item with liner_job->pid = liner_pid.
-  // No need in previous_item here, as we are not modifying the list.
-
-  while ( current_item != NULL )
+  int helper_pipe[2];
+  if ( pipe2( helper_pipe, O_CLOEXEC ) == -1 )
   {
-    liner_list_item_t * next_item = current_item->next_liner_list_item;
-    liner_job_t * liner_job = current_item->liner_job;
-
-    // When the item found, send some stopping signal to him
-    // and free resources associated with it.
-    if ( my_process_type == PROCESS_TYPE_SHELL )
-    {
-      // Kill our liners - suspended and the ones put to the background.
-      kill( liner_job->pid, SIGKILL );
-    }
-
-    free( liner_job );
-    free( current_item );
-    current_item = next_item;
+    LOG( "Failed to create a pipe for the prompt helper: %s", strerror( errno ) );
+    return;
+  }
+  METRICS_ADD( forks, 1 );
+  pid_t helper_pid = fork();
+  if ( helper_pid == 0 )
+  {
+    // The helper has nothing to free or to save, it only answers.
+    close( helper_pipe[0] );
+    char branch[GIT_BRANCH_SIZE] = "";
+    find_git_branch( cwd, branch, sizeof( branch ) );
+    ssize_t written = write( helper_pipe[1], branch, strlen( branch ) );
+    _exit( written == -1 ? EXIT_FAILURE : EXIT_SUCCESS );
+  }
+  close( helper_pipe[1] );
+  if ( helper_pid == -1 )
+  {
+    LOG( "Failed to start the prompt helper: %s", strerror( errno ) );
+    close( helper_pipe[0] );
+    return;
   }
 
-  liner = NULL;
+  prompt_helper_pid = helper_pid;
+  prompt_helper_fd = helper_pipe[0];
+  prompt_helper_answer_len = 0;
+  free( git_branch_cwd );
+  git_branch_cwd = strdup( cwd );
+  prompt_branch_stale = false;
+  watch_fd( prompt_helper_fd, EPOLLIN, handle_prompt_helper_answer, NULL );
 }
 
-// Find an item in liners list and return the liner job stored inside, or NULL on failure.
-static liner_job_t * get_liner_job_with_pid( pid_t liner_pid )
+static void append_to_prompt( char * rendered, size_t * rendered_len, const char * str )
 {
-  liner_list_item_t * current_item = liner;
-  while ( current_item != NULL )
+  int appended_len = snprintf( rendered + *rendered_len, PROMPT_SIZE - *rendered_len, "%s", str );
+  *rendered_len += (size_t)appended_len < PROMPT_SIZE - *rendered_len ? (size_t)appended_len :
+                                                                       PROMPT_SIZE - 1 - *rendered_len;
+}
+
+static void render_prompt( const char * format, const char * cwd, char * rendered )
+{
+  size_t rendered_len = 0;
+  rendered[0] = '\0';
+  const char * c;
+  for ( c = format; *c; c++ )
   {
-    liner_job_t * liner_job = current_item->liner_job;
-    if ( liner_job->pid == liner_pid )
+    char segment[PATH_MAX];
+    if ( *c != '%' || c[1] == '\0' )
     {
-      return liner_job;
+      snprintf( segment, sizeof( segment ), "%c", *c );
+      append_to_prompt( rendered, &rendered_len, segment );
+      continue;
     }
-    current_item = current_item->next_liner_list_item;
+
+    c++;
+    const char * home = get_variable( "HOME" );
+    size_t home_len = home != NULL ? strlen( home ) : 0;
+    liner_list_item_t * current_item;
+    int jobs_count = 0;
+    switch ( *c )
+    {
+      case '~':
+        if ( home_len > 1 && strncmp( cwd, home, home_len ) == 0 &&
+             ( cwd[home_len] == '/' || cwd[home_len] == '\0' ) )
+        {
+          snprintf( segment, sizeof( segment ), "~%s", cwd + home_len );
+        }
+        else
+        {
+          snprintf( segment, sizeof( segment ), "%s", cwd );
+        }
+        break;
+      case 'c':
+        snprintf( segment, sizeof( segment ), "%s", strrchr( cwd, '/' )[1] ? strrchr( cwd, '/' ) + 1 : cwd );
+        break;
+      case 'b':
+        snprintf( segment, sizeof( segment ), "%s", git_branch );
+        break;
+      case '?':
+        snprintf( segment, sizeof( segment ), "%d", last_line_status );
+        break;
+      case 'j':
+        for ( current_item = liner; current_item; current_item = current_item->next_liner_list_item )
+        {
+          jobs_count++;
+        }
+        snprintf( segment, sizeof( segment ), "%d", jobs_count );
+        break;
+      case '%':
+        snprintf( segment, sizeof( segment ), "%%" );
+        break;
+      default:
+        // Unknown segments are printed as they are.
+        snprintf( segment, sizeof( segment ), "%%%c", *c );
+        break;
+    }
+    append_to_prompt( rendered, &rendered_len, segment );
   }
-  LOG( "Not found liner with pid %d", liner_pid );
-  return NULL;
 }
 
-static liner_job_t * get_liner_job_with_state( worker_state_t state )
+static void print_prompt()
 {
-  liner_list_item_t * current_item = liner;
-  while ( current_item != NULL )
+  const char * format = get_variable( "MSH_PROMPT" );
+  if ( format == NULL || format[0] == '\0' )
   {
-    liner_job_t * liner_job = current_item->liner_job;
-    if ( liner_job->state == state )
+    snprintf( prompt, sizeof( prompt ), "%s", DEFAULT_PROMPT );
+  }
+  else
+  {
+    char * cwd = get_current_dir_name();
+    if ( cwd != NULL )
     {
-      return liner_job;
+      bool cwd_changed = git_branch_cwd == NULL || strcmp( cwd, git_branch_cwd ) != 0;
+      if ( strstr( format, "%b" ) != NULL && ( cwd_changed || prompt_branch_stale ) &&
+           prompt_helper_fd == -1 && prompt_helper_pid == -1 )
+      {
+        start_prompt_helper( cwd );
+      }
+      render_prompt( format, cwd, prompt );
+      free( cwd );
     }
-    current_item = current_item->next_liner_list_item;
   }
-  LOG( "Not found liner with state %d", (int)state );
-  return NULL;
+  write_string( prompt );
 }
 
-// Frees all resources that could be allocated anywhere by malloc and not freed for sure.
-static void free_all_resources()
+// Output multiplexer. If MSH_MUX is set to 1, stdout and stderr of every job started
+// in the background go through pipes the shell drains. Jobs started in the foreground
+// keep the terminal, as pagers, editors and colors depend on isatty(), and their
+// descriptors cannot be swapped for pipes later, when they are put into the background.
+// While a multiplexed job is in the foreground (after fg), its output is passed as is;
+// otherwise it is written by whole lines prefixed with "[pid] ", one write() per line,
+// so lines of concurrent jobs never interleave. Every stream is buffered up to
+// JOB_OUTPUT_BUFFER_SIZE: a longer line is cut, and the shell does not read
+// from a full buffer, so a chatty job blocks on its pipe instead of growing us.
+#define JOB_OUTPUT_BUFFER_SIZE 4096
+
+typedef struct job_output_t
 {
-  free_liner_list();
-  free_current_input_resources();
-}
-
-static void free_and_exit( int retcode )
+  pid_t liner_pid;
+  // Where the output goes: STDOUT_FILENO or STDERR_FILENO.
+  int target_fd;
+  // Remembered for the moment when the job is gone but its output is not.
+  bool foreground;
+  char buffer[JOB_OUTPUT_BUFFER_SIZE];
+  size_t buffer_len;
+} job_output_t;
+
+static bool is_output_multiplexed()
 {
-  LOG( "Exiting with code: %d\n", retcode );
-  free_all_resources();
-  exit( retcode );
+  const char * mux_value = get_variable( "MSH_MUX" );
+  return mux_value != NULL && strcmp( mux_value, "1" ) == 0;
 }
 
-// Returns filename, where the liner with pid=liner_pid saves the list of the pids
-// of the workers spawned with fork().
-// returned string should be freed after usage with free().
-static char * get_pid_storage_filename( pid_t liner_pid )
+// Write the first line_len bytes of the buffer as a prefixed line.
+static void write_job_output_line( job_output_t * job_output, size_t line_len )
 {
-  char * pid_storage_filename = (char *)malloc( PID_STORAGE_FILENAME_SIZE );
-  memset( pid_storage_filename, 0, PID_STORAGE_FILENAME_SIZE );
-  snprintf( pid_storage_filename,
-            PID_STORAGE_FILENAME_SIZE,
-            "%s_%d",
-            pid_storage_suffix,
-            liner_pid );
-  return pid_storage_filename;
+  char line[JOB_OUTPUT_BUFFER_SIZE + 32];
+  int prefix_len = snprintf( line, sizeof( line ), "[%d] ", job_output->liner_pid );
+  memcpy( line + prefix_len, job_output->buffer, line_len );
+  size_t total_len = ( size_t )prefix_len + line_len;
+  if ( line[total_len - 1] != '\n' )
+  {
+    line[total_len++] = '\n';
+  }
+
+  clear_edited_line();
+  write_fully( job_output->target_fd, line, total_len );
+  redraw_edited_line();
+
+  job_output->buffer_len -= line_len;
+  memmove( job_output->buffer, job_output->buffer + line_len, job_output->buffer_len );
 }
 
-// Save currently spawned worker's pid.
-static void save_worker_pid_with_liner( pid_t child_pid )
+// Pass buffered output further: foreground output as is, background one by whole lines.
+// If at_end is true, the incomplete last line is written as well.
+static void flush_job_output( job_output_t * job_output, bool at_end )
 {
-  assert( my_process_type == PROCESS_TYPE_LINER );
-  char * pid_storage_filename = get_pid_storage_filename( getpid() );
+  liner_job_t * liner_job = get_liner_job_with_pid( job_output->liner_pid );
+  if ( liner_job != NULL )
+  {
+    job_output->foreground = liner_job->state == WORKER_STATE_ACTIVE;
+  }
 
-  LOG( "Saving pid of worker: %d to %s", child_pid, pid_storage_filename );
-  FILE * f = fopen( pid_storage_filename, "a" );
-  if ( f == NULL )
+  if ( job_output->foreground )
   {
-    LOG( "Failed to open pid_storage_filename \"%s\" for writing", pid_storage_filename )
+    write_fully( job_output->target_fd, job_output->buffer, job_output->buffer_len );
+    job_output->buffer_len = 0;
+    return;
   }
-  else
+
+  while ( job_output->buffer_len > 0 )
   {
-    fprintf( f, "%d\n", child_pid );
-    fclose( f );
+    char * newline = (char *)memchr( job_output->buffer, '\n', job_output->buffer_len );
+    if ( newline != NULL )
+    {
+      write_job_output_line( job_output, ( size_t )( newline - job_output->buffer ) + 1 );
+    }
+    else if ( at_end || job_output->buffer_len == JOB_OUTPUT_BUFFER_SIZE )
+    {
+      write_job_output_line( job_output, job_output->buffer_len );
+    }
+    else
+    {
+      break;
+    }
   }
-  free( pid_storage_filename );
 }
 
-static void save_liner_pids_with_shell( pid_t liner_pid )
+static void handle_job_output( int fd, uint32_t events, void * data )
 {
-  assert( my_process_type == PROCESS_TYPE_SHELL );
-  char * pid_storage_filename = get_pid_storage_filename( liner_pid );
-
-  LOG( "opening file with pids of liner %d and pid_storage_filename = %s",
-       liner_pid,
-       pid_storage_filename );
-  FILE * f = fopen( pid_storage_filename, "r" );
-  if ( f == NULL )
+  (void)events;
+  job_output_t * job_output = (job_output_t *)data;
+  ssize_t read_len;
+  while ( ( read_len = read( fd,
+                             job_output->buffer + job_output->buffer_len,
+                             JOB_OUTPUT_BUFFER_SIZE - job_output->buffer_len ) ) > 0 )
   {
-    // Maybe there is no workers spawned.
-    // There are some commands running without a need of workers.
-    LOG( "Failed to open pid_storage_filename \"%s\" for reading", pid_storage_filename )
+    job_output->buffer_len += ( size_t )read_len;
+    flush_job_output( job_output, false );
   }
-  else
+
+  if ( read_len == 0 || ( errno != EAGAIN && errno != EINTR ) )
   {
-    pid_t worker_pid = 0;
-    while ( f != NULL && fscanf( f, "%d\n", &worker_pid ) != EOF )
-    {
-      LOG( "In the past liner %d spawned a worker with pid %d ", liner_pid, worker_pid );
-      if ( worker_pid != 0 && worker_pid != 0 )
-      {
-        add_pid_to_history( worker_pid );
-      }
-    }
-    fclose( f );
+    // All the job's processes have closed the pipe.
+    flush_job_output( job_output, true );
+    unwatch_fd( fd );
+    close( fd );
+    free( job_output );
   }
-  free( pid_storage_filename );
 }
 
-// All the operations we need to do in the shell,
-// when the liner with pid=liner_pid is closing.
-static void take_leave_of_liner( pid_t liner_pid )
+// Create pipes for the job's stdout and stderr, job_pipes gets 4 descriptors:
+// reading and writing ends for stdout, then for stderr.
+static int create_job_output_pipes( int job_pipes[4] )
 {
-  assert( my_process_type == PROCESS_TYPE_SHELL );
-
-  if ( liner && liner->liner_job->pid == liner_pid )
+  if ( pipe2( job_pipes, O_CLOEXEC ) == -1 )
   {
-    last_liner_exited = true;
+    return -1;
   }
-
-  // Saving workers' pids which were spawned by the liner.
-  save_liner_pids_with_shell( liner_pid );
-
-  // Removing liner from liners list in order to keep memory usage low.
-  remove_liner_list_item( liner_pid );
+  if ( pipe2( job_pipes + 2, O_CLOEXEC ) == -1 )
+  {
+    close( job_pipes[0] );
+    close( job_pipes[1] );
+    return -1;
+  }
+  return 0;
 }
 
-typedef void ( *sighandler_t )( int );
-
-// Invariant here: at any moment we can only have one active child.
-static void sigchld_handler( int signal_num )
+// In the liner: use the writing ends as stdout and stderr.
+static void redirect_job_output( int job_pipes[4] )
 {
-  LOG( "handling SIGCHLD in Shell" );
-  assert( signal_num == SIGCHLD );
-  assert( my_process_type == PROCESS_TYPE_SHELL );
-
-  int child_status;
-  pid_t child_pid = waitpid( -1, &child_status, WUNTRACED | WCONTINUED );
-  LOG( "child_status: %d, child_pid: %d", child_status, child_pid );
-  update_cwd();
-  if ( child_pid == -1 )
+  dup2( job_pipes[1], STDOUT_FILENO );
+  dup2( job_pipes[3], STDERR_FILENO );
+  int ipipe;
+  for ( ipipe = 0; ipipe < 4; ipipe++ )
   {
-    ERROR( "Some error when changing liner state %d, Resuming...", errno );
-    return;
+    close( job_pipes[ipipe] );
   }
+}
 
-  liner_job_t * liner_job = get_liner_job_with_pid( child_pid );
-  if ( liner_job == NULL )
+// In the shell: start draining the reading ends of the job's pipes.
+static void watch_job_output( pid_t liner_pid, int job_pipes[4] )
+{
+  close( job_pipes[1] );
+  close( job_pipes[3] );
+
+  int istream;
+  for ( istream = 0; istream < 2; istream++ )
   {
-    // It can happen if the liner fired a signal or ended
-    // before we added a liner job for it.
-    LOG( "Unstable state: liner with pid %d not found...", child_pid );
-    liner_job = add_liner_list_item( child_pid );
+    int read_fd = job_pipes[2 * istream];
+    fcntl( read_fd, F_SETFL, fcntl( read_fd, F_GETFL ) | O_NONBLOCK );
+
+    job_output_t * job_output = (job_output_t *)malloc( sizeof( job_output_t ) );
+    job_output->liner_pid = liner_pid;
+    job_output->target_fd = istream == 0 ? STDOUT_FILENO : STDERR_FILENO;
+    job_output->foreground = true;
+    job_output->buffer_len = 0;
+    watch_fd( read_fd, EPOLLIN, handle_job_output, job_output );
   }
+}
 
-  if ( WIFCONTINUED( child_status ) )
+// Foreground liner has finished or stopped: pass what it has written so far,
+// so it appears before the next prompt.
+static void drain_job_output( pid_t liner_pid )
+{
+  watched_fd_t * watched_fd;
+  for ( watched_fd = watched_fds; watched_fd; watched_fd = watched_fd->next_watched_fd )
   {
-    LOG( "Child %d continued", child_pid );
-    // Someone just continued our child through sending signal manually,
-    // assuming it's us. In the assignment there is not
-    // `put back to the foreground option, so we
-    // should put our child into background right away.
-
-    if ( liner_job->state != WORKER_STATE_SUSPENDED )
+    if ( watched_fd->fd != -1 && watched_fd->handler == handle_job_output &&
+         ( (job_output_t *)watched_fd->data )->liner_pid == liner_pid )
     {
-      LOG( "Bad apriori status (%d) for child %d", (int)liner_job->state, child_pid );
+      handle_job_output( watched_fd->fd, EPOLLIN, watched_fd->data );
     }
-    liner_job->state = WORKER_STATE_BACKGROUND;
   }
-  else if ( WIFEXITED( child_status ) )
+  collect_unwatched_fds();
+}
+
+// Checks if the liner is still running in the foreground.
+static bool is_liner_in_foreground( pid_t liner_pid )
+{
+  if ( last_liner_exited )
   {
-    // Child exited and we can react on that.
-    int child_exit_code = WEXITSTATUS( child_status );
-    LOG( "Child returned with exit code: %d", child_exit_code );
+    return false;
+  }
+  liner_job_t * liner_job = get_liner_job_with_pid( liner_pid );
+  return liner_job != NULL && liner_job->state == WORKER_STATE_ACTIVE;
+}
+
+// Deadlines of commands run with timeout. The liner asks the shell to watch
+// the deadline of its command by sigqueue() with SIGUSR1, passing the duration
+// in milliseconds (0 cancels it). All deadlines share one timerfd in the shell's
+// event loop, armed for the earliest of them. Without the shell (msh -c)
+// the liner keeps the deadline of its worker the same way.
+#define DEFAULT_TIMEOUT_KILL_AFTER_MS 5000
+
+static int deadline_timer_fd = -1;
+
+// The worker's deadline, when the liner has no shell to ask.
+static job_deadline_t worker_deadline;
+
+static void add_milliseconds( struct timespec * time, unsigned long milliseconds )
+{
+  time->tv_sec += milliseconds / 1000;
+  time->tv_nsec += ( milliseconds % 1000 ) * 1000000;
+  if ( time->tv_nsec >= 1000000000 )
+  {
+    time->tv_sec++;
+    time->tv_nsec -= 1000000000;
+  }
+}
 
-    take_leave_of_liner( child_pid );
+static bool is_earlier( const struct timespec * left, const struct timespec * right )
+{
+  return left->tv_sec < right->tv_sec ||
+         ( left->tv_sec == right->tv_sec && left->tv_nsec < right->tv_nsec );
+}
 
-    if ( child_exit_code == MSH_EXIT_ALL )
-    {
-      free_and_exit( EXIT_SUCCESS );
-    }
-    else if ( child_exit_code == MSH_EXIT_BG )
-    {
-      // Find first suspended job and put it to the background.
-      liner_job_t * liner_job = get_liner_job_with_state( WORKER_STATE_SUSPENDED );
-      if ( liner_job )
-      {
-        LOG( "Continuing job with pid %d", liner_job->pid );
-        kill( liner_job->pid, SIGCONT );
-      }
-      else
-      {
-        ERROR( "Did not found any job to continue" );
-      }
-    }
-    else if ( child_exit_code == EXIT_SUCCESS )
+static void set_deadline( job_deadline_t * deadline, pid_t pgid, unsigned long duration_ms )
+{
+  // How long the job has after SIGTERM is the session's setting.
+  const char * kill_after = get_variable( "MSH_TIMEOUT_KILL_AFTER" );
+  if ( kill_after == NULL || !parse_duration_ms( kill_after, &deadline->kill_after_ms ) )
+  {
+    deadline->kill_after_ms = DEFAULT_TIMEOUT_KILL_AFTER_MS;
+  }
+  clock_gettime( CLOCK_MONOTONIC, &deadline->expires );
+  add_milliseconds( &deadline->expires, duration_ms );
+  deadline->pgid = pgid;
+  deadline->stage = DEADLINE_TERM;
+  deadline->timed_out = false;
+}
+
+// Signals the job, if its deadline has expired, and moves the deadline
+// to its next stage. Then updates earliest with the deadline's time.
+static void check_deadline( job_deadline_t * deadline,
+                            const struct timespec * now,
+                            struct timespec * earliest )
+{
+  if ( deadline->stage != DEADLINE_NONE && !is_earlier( now, &deadline->expires ) )
+  {
+    if ( deadline->stage == DEADLINE_TERM )
     {
-      LOG( "Doing nothing, returning to the main loop after sleep() call" );
+      LOG( "Deadline of process group %d expired, terminating it", deadline->pgid );
+      deadline->timed_out = true;
+      kill( -deadline->pgid, SIGTERM );
+      // A suspended job would not notice SIGTERM otherwise.
+      kill( -deadline->pgid, SIGCONT );
+      deadline->stage = DEADLINE_KILL;
+      deadline->expires = *now;
+      add_milliseconds( &deadline->expires, deadline->kill_after_ms );
     }
     else
     {
-      LOG( "Unexpected exit code from liner: %d", child_exit_code );
+      LOG( "Process group %d outlived SIGTERM, killing it", deadline->pgid );
+      kill( -deadline->pgid, SIGKILL );
+      deadline->stage = DEADLINE_NONE;
     }
   }
-  else if ( WIFSIGNALED( child_status ) || WIFSTOPPED( child_status ) )
+
+  if ( deadline->stage != DEADLINE_NONE &&
+       ( ( earliest->tv_sec == 0 && earliest->tv_nsec == 0 ) ||
+         is_earlier( &deadline->expires, earliest ) ) )
   {
-    int child_signal =
-        WIFSIGNALED( child_status ) ? WTERMSIG( child_status ) : WSTOPSIG( child_status );
-    switch ( child_signal )
-    {
-      case SIGCONT:
-        if ( liner_job->state != WORKER_STATE_SUSPENDED )
-        {
-          LOG( "Bad apriori status (%d) for child %d", (int)liner_job->state, child_pid );
-        }
-        liner_job->state = WORKER_STATE_BACKGROUND;
-        break;
-      case SIGTSTP:
-        if ( liner_job->state != WORKER_STATE_ACTIVE )
-        {
-          LOG( "Bad apriori status (%d) for child %d", (int)liner_job->state, child_pid );
-        }
-        liner_job->state = WORKER_STATE_SUSPENDED;
-        break;
-      case SIGKILL:
-      case SIGINT:
-        // Removing the child from our liners list,
-        // as it wont signal us anymore.
-        take_leave_of_liner( child_pid );
+    *earliest = deadline->expires;
+  }
+}
 
-        break;
-      default:
-        // We don't know how to react to that signal sent to liner,
-        // let's just kill it.
-        ERROR( "Unexpected signal %d to child, killing it... %d", child_signal, child_pid );
-        kill( child_pid, SIGKILL );
-        take_leave_of_liner( child_pid );
-        break;
-    }
+// Signals the jobs with expired deadlines and rearms the timer for the rest.
+// Called from the SIGUSR1 handler as well, so only async-signal-safe calls here.
+static void check_deadlines()
+{
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  struct itimerspec timer;
+  memset( &timer, 0, sizeof( timer ) );
+  if ( one_shot_mode )
+  {
+    check_deadline( &worker_deadline, &now, &timer.it_value );
   }
   else
   {
-    LOG( "Unexpected liner's state change, resuming..." );
+    liner_list_item_t * current_item;
+    for ( current_item = liner; current_item; current_item = current_item->next_liner_list_item )
+    {
+      check_deadline( &current_item->liner_job->deadline, &now, &timer.it_value );
+    }
   }
 
-  // Returning shell to the foreground - helps very well, if we run msh inside msh.
-  tcsetpgrp( STDIN_FILENO, msh_pgid );
+  // Zero it_value disarms the timer.
+  if ( timerfd_settime( deadline_timer_fd, TFD_TIMER_ABSTIME, &timer, NULL ) == -1 )
+  {
+    ERROR( "Failed to set the deadline timer: %s", strerror( errno ) );
+  }
 }
 
-// Liner should react on signals coming from his worker.
-// Unfortunately, there is a lot of code duplication,
-// but that is for clarity and simplicity.
-static void sigchld_handler_for_liner( int signal_num )
+static void handle_deadline_timer( int fd, uint32_t events, void * data )
 {
-  LOG( "handling SIGCHLD in Liner" );
-  assert( signal_num == SIGCHLD );
-  assert( my_process_type == PROCESS_TYPE_LINER );
+  (void)events;
+  (void)data;
+  uint64_t expirations;
+  if ( read( fd, &expirations, sizeof( expirations ) ) == sizeof( expirations ) )
+  {
+    check_deadlines();
+  }
+}
 
-  int child_status;
-  pid_t child_pid = wait( &child_status );
-  LOG( "child_status: %d", child_status );
-  update_cwd();
-  if ( child_pid == -1 )
+static void watch_deadline_timer()
+{
+  if ( deadline_timer_fd != -1 )
   {
-    ERROR( "Some error when changing worker state %d, Exiting...", errno );
-    free_and_exit( EXIT_FAILURE );
     return;
   }
-
-  // Child exited and we can react on that.
-  if ( WIFEXITED( child_status ) )
+  deadline_timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+  if ( deadline_timer_fd == -1 )
   {
-    // Removing liner from liners list in order to keep memory usage low.
-    int child_exit_code = WEXITSTATUS( child_status );
-    LOG( "Child returned with exit code: %d", child_exit_code );
+    ERROR( "Failed to create the deadline timer: %s", strerror( errno ) );
+    return;
+  }
+  watch_fd( deadline_timer_fd, EPOLLIN, handle_deadline_timer, NULL );
+}
 
-    last_worker_exited = true;
+// Shell's side of the liner's request for a deadline.
+static void deadline_request_handler( int signal_num, siginfo_t * info, void * context )
+{
+  (void)context;
+  assert( signal_num == SIGUSR1 );
+  assert( my_process_type == PROCESS_TYPE_SHELL );
 
-    switch ( child_exit_code )
-    {
-      case MSH_EXIT_BG:
-      case MSH_EXIT_ALL:
-        // Special exit codes should be passed over to the shell.
-        free_and_exit( child_exit_code );
-        break;
-      case EXIT_SUCCESS:
-        // Doing nothing, going to the next child
-        break;
-      default:
-        // Should fail the whole line.
-        free_and_exit( EXIT_FAILURE );
-        break;
-    }
+  // Only our liners are listened to, the ones not reaped yet.
+  siginfo_t child_info;
+  if ( info->si_code != SI_QUEUE ||
+       waitid( P_PID, info->si_pid, &child_info, WEXITED | WNOHANG | WNOWAIT ) == -1 )
+  {
+    LOG( "Ignoring SIGUSR1 from %d", info->si_pid );
+    return;
   }
-  else if ( WIFSIGNALED( child_status ) || WIFSTOPPED( child_status ) )
+
+  liner_job_t * liner_job = get_liner_job_with_pid( info->si_pid );
+  if ( liner_job == NULL )
   {
-    int child_signal =
-        WIFSIGNALED( child_status ) ? WTERMSIG( child_status ) :
-                                      WSTOPSIG( child_status );
-    switch ( child_signal )
-    {
-      case SIGCONT:
-        LOG( "Child received SIGCONT" );
-        break;
-      case SIGTSTP:
-        LOG( "Child received SIGTSTP, doing nothing..." );
-        break;
-      default:
-        // We don't know how to react to that signal sent to worker.
-        ERROR( "Unexpected signal %d to child, killing it... %d", child_signal, child_pid );
-        kill( child_pid, SIGKILL );
-        free_and_exit( EXIT_FAILURE );
-        break;
-    }
+    // The liner could ask before we added a liner job for it.
+    LOG( "Unstable state: liner with pid %d not found...", info->si_pid );
+    liner_job = add_liner_list_item( info->si_pid );
+  }
+
+  int duration_ms = info->si_value.sival_int;
+  LOG( "Liner %d asks for a deadline in %d ms", info->si_pid, duration_ms );
+  if ( duration_ms > 0 )
+  {
+    set_deadline( &liner_job->deadline, liner_job->pgid, (unsigned long)duration_ms );
   }
   else
   {
-    LOG( "Unexpected worker's state change, exiting..." );
-    free_and_exit( EXIT_FAILURE );
+    liner_job->deadline.stage = DEADLINE_NONE;
   }
+  check_deadlines();
 }
 
-// SIGCONT handler for liner.
-static void sigcont_handler( int signal_num )
+// The liner's side: the worker has just started with command_timeout_ms to run.
+static void start_command_deadline( pid_t worker_pid )
 {
   assert( my_process_type == PROCESS_TYPE_LINER );
-  LOG( "sigcont_handler for liner." );
+  if ( one_shot_mode )
+  {
+    // The worker may not have moved to its own group yet.
+    setpgid( worker_pid, worker_pid );
+    set_deadline( &worker_deadline, worker_pid, command_timeout_ms );
+    watch_deadline_timer();
+    check_deadlines();
+    return;
+  }
 
-  // Continue in background, putting ourselves into a separate group.
-  int pgid = getpid();
-  if ( setpgid( pgid, pgid ) == -1 )
+  // The liner is in the job's process group as well, it outlives SIGTERM
+  // to report the timeout, and SIGKILL takes it down only if the worker stays.
+  // Its own copy of the deadline, taken before the shell's one, tells a timeout
+  // from the worker killed by someone else.
+  signal( SIGTERM, SIG_IGN );
+  set_deadline( &worker_deadline, worker_pid, command_timeout_ms );
+  union sigval value;
+  value.sival_int = (int)command_timeout_ms;
+  if ( sigqueue( getppid(), SIGUSR1, value ) == -1 )
   {
-    ERROR( "Failed to create a separate process group" );
-    free_and_exit( EXIT_FAILURE );
+    ERROR( "Failed to set the deadline: %s", strerror( errno ) );
   }
-  kill( liner_child_pid, SIGCONT );
 }
 
-// Run a single command from semicolon-delimited line.
-void run_worker()
+static void cancel_command_deadline()
 {
-  assert( my_process_type == PROCESS_TYPE_WORKER );
-  LOG( "Entering worker" );
-  size_t tokens_count;
-  for ( tokens_count = 0; tokens[tokens_count]; tokens_count++ )
-    ;
-
-  if ( tokens_count == 0 )
+  assert( my_process_type == PROCESS_TYPE_LINER );
+  worker_deadline.stage = DEADLINE_NONE;
+  if ( one_shot_mode )
   {
-    LOG( "Liner: command is empty, skipping..." );
+    check_deadlines();
     return;
   }
 
-  char * command = tokens[0];
-  if ( command == NULL )
+  union sigval value;
+  value.sival_int = 0;
+  sigqueue( getppid(), SIGUSR1, value );
+  signal( SIGTERM, SIG_DFL );
+}
+
+// Without the shell, the liner itself knows if its worker was killed on the deadline.
+// With the shell, the worker could be killed on the deadline only after it has expired.
+static bool is_command_timed_out()
+{
+  if ( one_shot_mode )
   {
-    ERROR( "Something bad happened while tokens processing" );
-    free_and_exit( EXIT_FAILURE );
+    return worker_deadline.timed_out;
   }
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return worker_deadline.stage != DEADLINE_NONE && !is_earlier( &now, &worker_deadline.expires );
+}
 
-  LOG( "Running worker, command %s", command );
+// Job queue. "submit [-p priority] command" puts the command into the queue
+// instead of running it, and queued jobs are started in the background one by one,
+// higher priority first, while the machine is not loaded: CPU and memory pressure
+// (avg10 of /proc/pressure, in percents) stay below MSH_MAX_CPU_PRESSURE and
+// MSH_MAX_MEMORY_PRESSURE, the load average below MSH_MAX_LOAD, and less than
+// MSH_MAX_QUEUE_JOBS queued jobs are running. The queue is checked every
+// QUEUE_CHECK_INTERVAL_MS, and at most one job is started at a time, so the pressure
+// caused by it is seen before the next one. "queue" shows and reorders the queue.
+#define QUEUE_CHECK_INTERVAL_MS 1000
+#define DEFAULT_MAX_CPU_PRESSURE 50.0
+#define DEFAULT_MAX_MEMORY_PRESSURE 10.0
+
+typedef struct queued_job_t
+{
+  struct queued_job_t * next_queued_job;
+  int id;
+  int priority;
+  time_t submit_time;
+  char * line;
+} queued_job_t;
 
-  if ( strcmp( command, "cd" ) == 0 )
+// Sorted by priority, then by id.
+static queued_job_t * queued_jobs = NULL;
+static int last_queued_job_id = 0;
+static int queue_timer_fd = -1;
+
+static pid_t start_liner_job( bool foreground );
+
+static bool is_queue_builtin( const char * command )
+{
+  return strcmp( command, "submit" ) == 0 || strcmp( command, "queue" ) == 0;
+}
+
+static void free_job_queue()
+{
+  while ( queued_jobs != NULL )
   {
-    bool cd_succeded = true;
-    if ( tokens_count == 1 )
-    {
-      char * home_value = getenv( "HOME" );
-      if ( home_value == NULL )
-      {
-        ERROR( "cd: HOME variable not set\n" );
-        cd_succeded = false;
-      }
-      else
-      {
-        cd_succeded = try_change_directory( home_value ) == 0;
-      }
-    }
-    else if ( tokens_count > 2 )
-    {
-      ERROR( "cd: Too many arguments, must be one\n" );
-      cd_succeded = false;
-    }
-    else
-    {
-      char * dest = tokens[1];
-      cd_succeded = try_change_directory( dest ) == 0;
-    }
-    if ( !cd_succeded )
-    {
-      LOG( "cd failed!" );
-      free_and_exit( EXIT_FAILURE );
-    }
+    queued_job_t * queued_job = queued_jobs;
+    queued_jobs = queued_job->next_queued_job;
+    free( queued_job->line );
+    free( queued_job );
   }
-  else if ( strcmp( command, "exit" ) == 0 || strcmp( command, "quit" ) == 0 )
+}
+
+static void insert_queued_job( queued_job_t * queued_job )
+{
+  queued_job_t ** link = &queued_jobs;
+  while ( *link != NULL && ( ( *link )->priority > queued_job->priority ||
+                             ( ( *link )->priority == queued_job->priority &&
+                               ( *link )->id < queued_job->id ) ) )
   {
-    free_and_exit( MSH_EXIT_ALL );
+    link = &( *link )->next_queued_job;
   }
-  else if ( strcmp( command, "bg" ) == 0 )
+  queued_job->next_queued_job = *link;
+  *link = queued_job;
+}
+
+// Unlinks the queued job from the queue and returns it, or NULL if there is no such job.
+static queued_job_t * take_queued_job( int id )
+{
+  queued_job_t ** link;
+  for ( link = &queued_jobs; *link != NULL; link = &( *link )->next_queued_job )
   {
-    free_and_exit( MSH_EXIT_BG );
+    queued_job_t * queued_job = *link;
+    if ( queued_job->id == id )
+    {
+      *link = queued_job->next_queued_job;
+      return queued_job;
+    }
   }
-  else if ( strcmp( command, "history" ) == 0 )
+  return NULL;
+}
+
+// Reads "some avg10" of a /proc/pressure file. Returns false if there is no PSI.
+static bool read_pressure( const char * filename, double * pressure )
+{
+  FILE * f = fopen( filename, "r" );
+  if ( f == NULL )
   {
-    // Traversing command history starting from the oldest element.
-    // As we stated earlier, command_history_finish index is for the earliest element.
-    // Then the first non-zero element found in the circular buffer will be indexed
-    // "0: " in output for user.
-    size_t icmd = command_history_finish;
+    return false;
+  }
+  bool read = fscanf( f, "some avg10=%lf", pressure ) == 1;
+  fclose( f );
+  return read;
+}
 
-    // Numbered index for current command output
-    // is icmd_printed, icmd is index for command_history.
-    size_t icmd_printed = MAX_COMMANDS_HISTORY_SIZE;
+static double get_queue_threshold( const char * name, double default_value )
+{
+  const char * value = get_variable( name );
+  char * end;
+  double threshold = value != NULL ? strtod( value, &end ) : default_value;
+  return value != NULL && ( end == value || *end != '\0' ) ? default_value : threshold;
+}
 
-    do
-    {
-      if ( strlen( command_history[icmd] ) > 0 )
-      {
-        if ( icmd_printed == MAX_COMMANDS_HISTORY_SIZE )
-        {
-          icmd_printed = 0;
-        }
-        printf( "%lu: %s\n", icmd_printed + 1, command_history[icmd] );
-        icmd_printed++;
-      }
-      icmd = ( icmd + 1 ) % MAX_COMMANDS_HISTORY_SIZE;
-    } while ( icmd != command_history_finish );
+static size_t count_running_queued_jobs()
+{
+  size_t running_count = 0;
+  liner_list_item_t * current_item;
+  for ( current_item = liner; current_item; current_item = current_item->next_liner_list_item )
+  {
+    running_count += current_item->liner_job->queue_id != 0;
   }
-  else if ( strcmp( command, "listpids" ) == 0 || strcmp( command, "showpids" ) == 0 )
+  return running_count;
+}
+
+// Checks the thresholds. Returns false and the reason, if no job can be started now.
+static bool can_start_queued_job( char * reason, size_t reason_size )
+{
+  double processors_count = (double)sysconf( _SC_NPROCESSORS_ONLN );
+  double max_jobs = get_queue_threshold( "MSH_MAX_QUEUE_JOBS", processors_count );
+  double max_load = get_queue_threshold( "MSH_MAX_LOAD", processors_count );
+  double max_cpu_pressure = get_queue_threshold( "MSH_MAX_CPU_PRESSURE", DEFAULT_MAX_CPU_PRESSURE );
+  double max_memory_pressure =
+      get_queue_threshold( "MSH_MAX_MEMORY_PRESSURE", DEFAULT_MAX_MEMORY_PRESSURE );
+
+  size_t running_count = count_running_queued_jobs();
+  double load = 0;
+  double cpu_pressure = 0;
+  double memory_pressure = 0;
+  FILE * f = fopen( "/proc/loadavg", "r" );
+  if ( f != NULL )
   {
-    size_t ipid = pids_history_finish;
-    // ipid_printed will set to the first valid pid.
-    // So, currently it is set to invalid value, that it can never take,
-    // while being needed to print.
-    size_t ipid_printed = MAX_PIDS_HISTORY_SIZE;
-    do
+    if ( fscanf( f, "%lf", &load ) != 1 )
     {
-      if ( pids_history[ipid] != 0 )
-      {
-        if ( ipid_printed == MAX_PIDS_HISTORY_SIZE )
-        {
-          ipid_printed = 0;
-        }
-        printf( "%lu: %d\n", ipid_printed, pids_history[ipid] );
-        ipid_printed++;
-      }
-      LOG( "ipid %lu, ipid_printed %lu, pid %d", ipid, ipid_printed, pids_history[ipid] );
-      ipid = ( ipid + 1 ) % MAX_PIDS_HISTORY_SIZE;
-    } while ( ipid != pids_history_finish );
+      load = 0;
+    }
+    fclose( f );
+  }
+  read_pressure( "/proc/pressure/cpu", &cpu_pressure );
+  read_pressure( "/proc/pressure/memory", &memory_pressure );
+
+  if ( running_count >= max_jobs )
+  {
+    snprintf( reason, reason_size, "%lu queued jobs running", running_count );
+  }
+  else if ( load >= max_load )
+  {
+    snprintf( reason, reason_size, "load %.2f >= %.2f", load, max_load );
+  }
+  else if ( cpu_pressure >= max_cpu_pressure )
+  {
+    snprintf( reason, reason_size, "CPU pressure %.2f%% >= %.2f%%", cpu_pressure, max_cpu_pressure );
+  }
+  else if ( memory_pressure >= max_memory_pressure )
+  {
+    snprintf( reason,
+              reason_size,
+              "memory pressure %.2f%% >= %.2f%%",
+              memory_pressure,
+              max_memory_pressure );
   }
   else
   {
-    // Preparing to run external command with exec().
-    char * cwd = get_current_dir_name();
-    LOG( "Add current working directory \"%s\"to the PATH of command", cwd );
-    char * env_path =
-        (char *)malloc( strlen( "PATH=" ) + strlen( cwd ) + strlen( SEARCH_PATH_SUFFIX ) + 1 );
-    strcpy( env_path, "PATH=" );
-    strcat( env_path, cwd );
-    free( cwd );
-    strcat( env_path, SEARCH_PATH_SUFFIX );
+    snprintf( reason,
+              reason_size,
+              "load %.2f, CPU pressure %.2f%%, memory pressure %.2f%%",
+              load,
+              cpu_pressure,
+              memory_pressure );
+    return true;
+  }
+  return false;
+}
 
-    // I've tried to pass PATH environmental variable with execvpe,
-    // but it didn't work - execvpe used PATH value from worker process,
-    // even printing `env` output as we specify but underhood switching to
-    if ( putenv( env_path ) )
-    {
-      ERROR( "Failed to put PATH variable into environment" );
-    }
-    else
+// Starts the first queued job, if the machine allows, and keeps the timer
+// armed while there are jobs in the queue.
+static void start_queued_jobs()
+{
+  char reason[128];
+  if ( queued_jobs != NULL && can_start_queued_job( reason, sizeof( reason ) ) )
+  {
+    queued_job_t * queued_job = queued_jobs;
+    queued_jobs = queued_job->next_queued_job;
+
+    // The job's line takes the place of the current one just for the fork.
+    char * current_line = cmd_line;
+    cmd_line = queued_job->line;
+    pid_t liner_pid = start_liner_job( false );
+    cmd_line = current_line;
+    liner_job_t * liner_job = get_liner_job_with_pid( liner_pid );
+    if ( liner_job != NULL )
     {
-      int return_code = execvp( tokens[0], tokens );
-      if ( return_code == -1 )
-      {
-        switch ( errno )
-        {
-          case ENOENT:
-            ERROR( "%s: Command not found.", command );
-            break;
-          default:
-            ERROR( "Error (%d) while trying to execute command: %s\n", errno, command );
-            break;
-        }
-        free_and_exit( EXIT_FAILURE );
-      }
+      liner_job->queue_id = queued_job->id;
     }
+    // The timer can start a job while the user is editing a line.
+    clear_edited_line();
+    printf( "[%d] started %d: %s\n", queued_job->id, liner_pid, queued_job->line );
+    fflush( stdout );
+    redraw_edited_line();
+    free( queued_job->line );
+    free( queued_job );
   }
 
-  free_and_exit( EXIT_SUCCESS );
+  struct itimerspec timer;
+  memset( &timer, 0, sizeof( timer ) );
+  if ( queued_jobs != NULL )
+  {
+    timer.it_value.tv_sec = QUEUE_CHECK_INTERVAL_MS / 1000;
+    timer.it_value.tv_nsec = ( QUEUE_CHECK_INTERVAL_MS % 1000 ) * 1000000;
+    timer.it_interval = timer.it_value;
+  }
+  timerfd_settime( queue_timer_fd, 0, &timer, NULL );
 }
 
-// Starts worker with current set of tokens.
-void start_worker()
+static void handle_queue_timer( int fd, uint32_t events, void * data )
 {
-  assert( my_process_type == PROCESS_TYPE_LINER );
-
-  last_worker_exited = false;
-  liner_child_pid = fork();
-  if ( liner_child_pid == 0 )
+  (void)events;
+  (void)data;
+  uint64_t expirations;
+  if ( read( fd, &expirations, sizeof( expirations ) ) == sizeof( expirations ) )
   {
-    // Initializing worker.
-    // Setting SIGCONT and SIGCHLD signals to default handlers,
-    // as we are not going to follow the worker's children,
-    // and default SIGCONT is fine with us.
-    signal( SIGCONT, SIG_DFL );
-    signal( SIGCHLD, SIG_DFL );
-    my_process_type = PROCESS_TYPE_WORKER;
-    run_worker();
+    start_queued_jobs();
   }
-  else
-  {
-    LOG( "Forked a new child worker with pid %d", liner_child_pid );
+}
 
-    // Store pid, so the shell process will be able to read it afterwards.
-    save_worker_pid_with_liner( liner_child_pid );
+static void print_job_queue()
+{
+  char reason[128];
+  bool can_start = can_start_queued_job( reason, sizeof( reason ) );
+  printf( "%s: %s\n", can_start ? "admitting" : "waiting", reason );
 
-    // Pause, waiting for any change in the currently forked worker's state.
-    // Flag last_worker_exited tells us if it is still alive.
-    while ( !last_worker_exited )
+  liner_list_item_t * current_item;
+  for ( current_item = liner; current_item; current_item = current_item->next_liner_list_item )
+  {
+    if ( current_item->liner_job->queue_id != 0 )
     {
-      pause();
+      printf( "[%d] running %d\n", current_item->liner_job->queue_id, current_item->liner_job->pid );
     }
   }
+
+  time_t now = time( NULL );
+  queued_job_t * queued_job;
+  for ( queued_job = queued_jobs; queued_job; queued_job = queued_job->next_queued_job )
+  {
+    printf( "[%d] priority %d, queued %lds: %s\n",
+            queued_job->id,
+            queued_job->priority,
+            (long)( now - queued_job->submit_time ),
+            queued_job->line );
+  }
 }
 
-/*
- * run_liner takes null-terminated cmd_line,
- * with only spaces and semicolons allowed between tokens
- * Tries to extract tokens sequences consisting one command to run.
- * All commands in the input sequence cmd_line are separated by ' ; '.
- */
-void run_liner()
+// submit [-p priority] command [arguments]
+// queue [-p id priority | -r id]
+// Both are run by the shell itself. Returns the exit status.
+static int run_queue_builtin( size_t tokens_count )
 {
-  assert( my_process_type == PROCESS_TYPE_LINER );
-  size_t cmd_len = strlen( cmd_line );
-  LOG( "Entering liner, cmd_line = \"%s\", cmd_len = %lu", cmd_line, cmd_len );
+  if ( queue_timer_fd == -1 )
+  {
+    queue_timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    watch_fd( queue_timer_fd, EPOLLIN, handle_queue_timer, NULL );
+  }
 
-  size_t i;
-  size_t tokens_count = 0;
-  for ( i = 0; i < cmd_len; i++ )
+  if ( strcmp( tokens[0], "submit" ) == 0 )
   {
-    if ( cmd_line[i] == ' ' )
+    size_t command_index = 1;
+    int priority = 0;
+    if ( tokens_count > 2 && strcmp( tokens[1], "-p" ) == 0 )
     {
-      continue;
+      priority = atoi( tokens[2] );
+      command_index = 3;
     }
-
-    if ( cmd_line[i] == ';' )
+    if ( command_index >= tokens_count )
     {
-      // The command currently parsed is finished.
+      ERROR( "submit: usage: submit [-p priority] command [arguments]" );
+      return EXIT_FAILURE;
+    }
 
-      // That is for the format for passing arguments to exec().
-      tokens[tokens_count++] = NULL;
+    size_t line_size = 1;
+    size_t itoken;
+    for ( itoken = command_index; itoken < tokens_count; itoken++ )
+    {
+      line_size += strlen( tokens[itoken] ) + 1;
+    }
+    queued_job_t * queued_job = (queued_job_t *)malloc( sizeof( queued_job_t ) );
+    queued_job->id = ++last_queued_job_id;
+    queued_job->priority = priority;
+    queued_job->submit_time = time( NULL );
+    queued_job->line = (char *)malloc( line_size );
+    queued_job->line[0] = '\0';
+    for ( itoken = command_index; itoken < tokens_count; itoken++ )
+    {
+      if ( itoken > command_index )
+      {
+        strcat( queued_job->line, " " );
+      }
+      strcat( queued_job->line, tokens[itoken] );
+    }
+    insert_queued_job( queued_job );
+    printf( "[%d] queued\n", queued_job->id );
+    start_queued_jobs();
+    return EXIT_SUCCESS;
+  }
 
-      // It's time to send current tokens sequence to execution.
-      start_worker();
+  if ( tokens_count == 1 )
+  {
+    print_job_queue();
+    return EXIT_SUCCESS;
+  }
+  if ( tokens_count == 4 && strcmp( tokens[1], "-p" ) == 0 )
+  {
+    queued_job_t * queued_job = take_queued_job( atoi( tokens[2] ) );
+    if ( queued_job == NULL )
+    {
+      ERROR( "queue: %s: no such queued job", tokens[2] );
+      return EXIT_FAILURE;
+    }
+    queued_job->priority = atoi( tokens[3] );
+    insert_queued_job( queued_job );
+    return EXIT_SUCCESS;
+  }
+  if ( tokens_count == 3 && strcmp( tokens[1], "-r" ) == 0 )
+  {
+    queued_job_t * queued_job = take_queued_job( atoi( tokens[2] ) );
+    if ( queued_job == NULL )
+    {
+      ERROR( "queue: %s: no such queued job", tokens[2] );
+      return EXIT_FAILURE;
+    }
+    free( queued_job->line );
+    free( queued_job );
+    start_queued_jobs();
+    return EXIT_SUCCESS;
+  }
+  ERROR( "queue: usage: queue [-p id priority | -r id]" );
+  return EXIT_FAILURE;
+}
 
-      // Free tokens expecting the other command coming after ';'
-      free_tokens();
+// Forks a liner for cmd_line. A foreground job gets the terminal,
+// a background one reads from /dev/null instead.
+static pid_t start_liner_job( bool foreground )
+{
+  int job_pipes[4];
+  bool multiplexed = !foreground && is_output_multiplexed();
+  if ( multiplexed && create_job_output_pipes( job_pipes ) == -1 )
+  {
+    ERROR( "Failed to create pipes for job output" );
+    multiplexed = false;
+  }
 
-      tokens_count = 0;
+  if ( foreground )
+  {
+    last_liner_exited = false;
+  }
+  // Lines read ahead from a file are given back to it: otherwise exit()
+  // of the child would move the shared offset back to the current line
+  // and the shell would read the following lines again.
+  if ( !isatty( STDIN_FILENO ) )
+  {
+    fflush( stdin );
+  }
+  TRACE_BEGIN( "fork", "liner" );
+  METRICS_ADD( forks, 1 );
+  pid_t child_pid = fork();
+  if ( child_pid == 0 )
+  {
+    trace_process_started( "liner" );
+    log_process_started();
 
-      // Increment, so the next value after cmd_line[i] is
-      // definitely a token symbol or the end.
-      i++;
+    // Every job gets its own process group, so the signals for the job
+    // from the terminal or on its deadline reach all its processes, but not the shell.
+    setpgid( 0, 0 );
+    if ( foreground && isatty( STDIN_FILENO ) )
+    {
+      tcsetpgrp( STDIN_FILENO, getpid() );
     }
-    else
+    else if ( !foreground )
     {
-      assert( cmd_line[i] != ' ' && cmd_line[i] != ';' );
-      size_t token_start = i;
-      while ( i < cmd_len && cmd_line[i] != ' ' )
+      int null_fd = open( "/dev/null", O_RDONLY );
+      if ( null_fd != -1 )
       {
-        assert( cmd_line[i] != ';' );
-        i++;
+        dup2( null_fd, STDIN_FILENO );
+        close( null_fd );
       }
+    }
 
-      size_t token_len = i - token_start;
-
-      // allocate space for new token, don't forget about null-terminating byte
-      char * new_token = (char *)malloc( token_len + 1 );
-      memcpy( new_token, cmd_line + token_start, token_len );
-      new_token[token_len] = '\0';
-      if ( tokens_count == MAX_NUM_ARGUMENTS )
-      {
-        ERROR( "liner: Too much tokens already" );
-        free_and_exit( EXIT_FAILURE );
-      }
-      tokens[tokens_count++] = new_token;
+    // The shell's event loop stays with the shell.
+    free_watched_fds();
+    close( deadline_timer_fd );
+    deadline_timer_fd = -1;
+    close( queue_timer_fd );
+    queue_timer_fd = -1;
+    if ( multiplexed )
+    {
+      redirect_job_output( job_pipes );
     }
+    // Initializing liner job.
+    my_process_type = PROCESS_TYPE_LINER;
+
+    // We don't need shell's liners list, as we are liner,
+    // and we don't controll our siblings.
+    free_liner_list();
+    signal( SIGINT, SIG_DFL );
+    signal( SIGTSTP, SIG_DFL );
+    signal( SIGCONT, sigcont_handler );
+    signal( SIGCHLD, sigchld_handler_for_liner );
+    signal( SIGTTIN, SIG_DFL );
+    signal( SIGTTOU, SIG_DFL );
+    signal( SIGUSR1, SIG_DFL );
+    run_liner();
+    // Should exit from inside run_liner.
+    assert( false );
+  }
+
+  TRACE_END( "fork" );
+  TRACE_ASYNC_BEGIN( "job", child_pid, cmd_line );
+  LOG( "Forked a new liner with pid %d", child_pid );
+  // The same as in the liner, whoever is first.
+  setpgid( child_pid, child_pid );
+  if ( foreground && isatty( STDIN_FILENO ) )
+  {
+    tcsetpgrp( STDIN_FILENO, child_pid );
+  }
+  // Saving currently spawned liner's pid to history.
+  add_pid_to_history( child_pid );
+
+  // So, we are in the shell here, saving our liner job.
+  assert( my_process_type == PROCESS_TYPE_SHELL );
+
+  liner_job_t * liner_job = get_liner_job_with_pid( child_pid );
+  if ( liner_job != NULL )
+  {
+    LOG( "Already created liner with pid: %d", child_pid );
+  }
+  else
+  {
+    liner_job = add_liner_list_item( child_pid );
+  }
+  if ( !foreground )
+  {
+    liner_job->state = WORKER_STATE_BACKGROUND;
+  }
+
+  if ( multiplexed )
+  {
+    watch_job_output( child_pid, job_pipes );
   }
+  publish_job_metrics();
+  return child_pid;
+}
 
-  // We ended up traversing line, and there are still some tokens left ->
-  // have to run one more command.
-  if ( tokens_count > 0 )
+// Lines made of the in-process utilities and the job queue's builtins only
+// are run by the shell itself, without a liner. A failed command ends the line,
+// as in the liner.
+static bool is_fast_line( const char * line, size_t line_len )
+{
+  size_t position = 0;
+  bool fast = true;
+  while ( fast && position < line_len )
   {
-    tokens[tokens_count++] = NULL;
-    start_worker();
+    int tokens_count = tokenize_next_command( line, line_len, &position, tokens );
+    fast = tokens_count != -1 &&
+           ( tokens_count == 0 ||
+             ( !is_fan_out( tokens ) && !has_input_redirection( tokens ) &&
+               ( is_fast_builtin( tokens[0] ) || is_queue_builtin( tokens[0] ) ) ) );
     free_tokens();
   }
+  return fast;
+}
 
-  free_and_exit( EXIT_SUCCESS );
+static void run_fast_line( const char * line, size_t line_len )
+{
+  TRACE_BEGIN( "builtins", line );
+  size_t position = 0;
+  int status = EXIT_SUCCESS;
+  while ( status == EXIT_SUCCESS && position < line_len )
+  {
+    int tokens_count = tokenize_next_command( line, line_len, &position, tokens );
+    if ( tokens_count > 0 )
+    {
+      status = is_queue_builtin( tokens[0] ) ? run_queue_builtin( (size_t)tokens_count ) :
+                                               run_fast_builtin( tokens );
+    }
+    free_tokens();
+  }
+  fflush( stdout );
+  last_line_status = status;
+  TRACE_END( "builtins" );
 }
 
 // Initializing procedure for our shell,
@@ -995,6 +9857,7 @@ void start_shell()
   // Declare an interceptor for callback after child changes its state.
   sighandler_t previous_sigchld_handler = signal( SIGCHLD, sigchld_handler );
   assert( previous_sigchld_handler == SIG_DFL );
+  set_event_signals_blocked( true );
 
   // Ignore certain types of signals, as requested.
   signal( SIGINT, SIG_IGN );
@@ -1024,6 +9887,17 @@ void start_shell()
   // Setting auxiliary variables for msh.c's flow.
   my_process_type = PROCESS_TYPE_SHELL;
 
+  // Saving terminal settings, line editing switches them temporarily.
+  tcgetattr( STDIN_FILENO, &saved_termios );
+
+  // Liners ask for deadlines of their commands.
+  watch_deadline_timer();
+  struct sigaction deadline_request_action;
+  memset( &deadline_request_action, 0, sizeof( deadline_request_action ) );
+  deadline_request_action.sa_sigaction = deadline_request_handler;
+  deadline_request_action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigaction( SIGUSR1, &deadline_request_action, NULL );
+
   // Initializing our file for storing current working directory -
   // as an easy way to transfer PWD between msh's processs.
   char * cwd = get_current_dir_name();
@@ -1041,14 +9915,83 @@ void start_shell()
   // for passing worker's pid between liner and shell.
   strcat( pid_storage_suffix, pid_string_buf );
 
+  // The same for the log of changed variables.
+  strcat( variables_log_filename, pid_string_buf );
+
+  // Before the first fork(), so every process of ours gets the segment.
+  metrics_init();
+
   LOG( "Finished initializing shell" );
 }
 
-int main()
+int main( int argc, char ** argv )
 {
-  size_t i;
+  // Developer modes for checking and measuring the lexer on stdin.
+  // They take MSH_LEXER from the environment as well.
+  if ( argc >= 2 && strncmp( argv[1], "--lex", 5 ) == 0 )
+  {
+    init_variables();
+  }
+  if ( argc >= 2 && strcmp( argv[1], "--lex" ) == 0 )
+  {
+    return run_lexer_dump();
+  }
+  if ( argc >= 2 && strcmp( argv[1], "--lex-diff" ) == 0 )
+  {
+    return run_lexer_diff();
+  }
+  if ( argc >= 2 && strcmp( argv[1], "--lex-bench" ) == 0 )
+  {
+    int passes = argc >= 3 ? atoi( argv[2] ) : 1000;
+    if ( passes <= 0 )
+    {
+      ERROR( "msh: --lex-bench: the count of passes should be positive" );
+      return 2;
+    }
+    return run_lexer_bench( passes );
+  }
+
+  // The viewer of the metrics the shells publish.
+  bool top_link = strcmp( basename( argv[0] ), "mshtop" ) == 0;
+  if ( top_link || ( argc >= 2 && strcmp( argv[1], "--top" ) == 0 ) )
+  {
+    int first_arg = top_link ? 1 : 2;
+    int interval_ms = argc > first_arg ? atoi( argv[first_arg] ) : TOP_DEFAULT_INTERVAL_MS;
+    return run_top( interval_ms > 0 ? interval_ms : TOP_DEFAULT_INTERVAL_MS,
+                    argc > first_arg + 1 ? atoi( argv[first_arg + 1] ) : 0 );
+  }
+
   LOG( "Starting msh with pid %d", getpid() );
 
+  init_variables();
+  init_log_level( get_variable( "MSH_LOG_LEVEL" ) );
+  trace_init( get_variable( "MSH_TRACE" ) );
+
+  if ( argc >= 2 && strcmp( argv[1], "-c" ) == 0 )
+  {
+    if ( argc < 3 )
+    {
+      ERROR( "msh: -c: option requires an argument" );
+      return 2;
+    }
+    run_one_shot( argv[2] );
+  }
+  if ( argc >= 2 && strcmp( argv[1], "--serve" ) == 0 )
+  {
+    if ( argc < 3 )
+    {
+      ERROR( "msh: --serve: socket path is required" );
+      return 2;
+    }
+    int max_jobs = argc >= 4 ? atoi( argv[3] ) : SERVE_DEFAULT_MAX_JOBS;
+    return run_server( argv[2], max_jobs > 0 ? max_jobs : SERVE_DEFAULT_MAX_JOBS );
+  }
+
+  if ( argc >= 2 && argv[1][0] != '-' )
+  {
+    run_script( argv[1], ( size_t )( argc - 1 ), argv + 1 );
+  }
+
   start_shell();
 
   LOG( "Starting main loop" );
@@ -1058,175 +10001,118 @@ int main()
     char cmd_str[MAX_COMMAND_SIZE];
     size_t cmd_str_len;
     // Print out the msh prompt
+    TRACE_BEGIN( "read line", NULL );
     print_prompt();
 
     // Read the command from the commandline.  The
     // maximum command that will be read is MAX_COMMAND_SIZE
-    // This while command will wait here until the user
-    // inputs something since fgets returns NULL when there
-    // is no input
-    while ( !fgets( cmd_str, MAX_COMMAND_SIZE, stdin ) )
+    // This call will wait here until the user inputs something,
+    // and the end of input means the same as "exit".
+    if ( !read_command_line( cmd_str, MAX_COMMAND_SIZE ) )
     {
+      break;
     }
+    TRACE_END( "read line" );
+    TRACE_BEGIN( "parse", NULL );
 
     // in order to make a clean string cmd_line,
     // we have to reserve some place for spaces between tokens.
-    // as we use single space to separate tokens,
-    // it is maximum that 1 space will correspond to one symbol
-    // (for some crazy shell when a lot of commands names have one symbol)
     // IMPORTANT Can't use continue for while (1) as we have to free cmd_line memory.
     cmd_str_len = strlen( cmd_str );
-    cmd_line = (char *)malloc( 2 * cmd_str_len );
-    memset( cmd_line, 0, 2 * cmd_str_len );
-    size_t cmd_line_len = 0;
-
-    bool is_first_token = true;
-    for ( i = 0; i < cmd_str_len; i++ )
-    {
-      char c = cmd_str[i];
-
-      if ( isspace( c ) )
-      {
-        continue;
-      }
-
-      if ( is_first_token )
-      {
-        is_first_token = false;
-      }
-      else
-      {
-        cmd_line[cmd_line_len++] = ' ';
-      }
-
-      LOG( "i = %lu, c = %c", i, c );
-
-      if ( c == ';' )
-      {
-        cmd_line[cmd_line_len++] = ';';
-      }
-      else
-      {
-        while ( i < cmd_str_len && !isspace( cmd_str[i] ) && cmd_str[i] != ';' )
-        {
-          // put current token fully to cmd_line and wait for the next non-token symbol.
-          cmd_line[cmd_line_len++] = cmd_str[i++];
-        }
-
-        if ( i < cmd_str_len && cmd_str[i] == ';' )
-        {
-          cmd_line[cmd_line_len++] = ' ';
-          cmd_line[cmd_line_len++] = ';';
-        }
-      }
-
-      cmd_line[cmd_line_len] = '\0';
-    }
+    cmd_line = (char *)malloc( NORMALIZED_LINE_SIZE( cmd_str_len ) );
+    size_t cmd_line_len = normalize_command_line( cmd_str, cmd_str_len, cmd_line );
 
     LOG( "cmd_line = \"%s\"", cmd_line );
 
     // Check if cmd_line is !n and swap with command from history.
-    // Checking for command !n, where is n is a number from 1 to 15 included.
-    if ( cmd_line_len >= 2 && cmd_line_len <= 3 && cmd_line[0] == '!' )
+    size_t num = parse_history_reference( cmd_line, cmd_line_len );
+    if ( num == 0 )
     {
-      size_t num = 0;
-      if ( cmd_line_len == 2 && isdigit( cmd_line[1] ) )
+      if ( cmd_line[0] == '!' )
       {
-        num = ( size_t )( cmd_line[1] - '0' );
+        LOG( "!n: Failed to parse a number: %s", cmd_line + 1 );
       }
-      if ( cmd_line_len == 3 && isdigit( cmd_line[1] ) && isdigit( cmd_line[1] ) )
+    }
+    else
+    {
+      // Find the earliest command in history.
+      size_t icmd = command_history_finish;
+      size_t checked_count = 0;
+      while ( strlen( command_history[icmd] ) == 0 && checked_count < MAX_COMMANDS_HISTORY_SIZE )
       {
-        num = ( size_t )( ( cmd_line[1] - '0' ) * 10 + ( cmd_line[2] - '0' ) );
+        icmd = ( icmd + 1 ) % MAX_COMMANDS_HISTORY_SIZE;
+        checked_count++;
       }
 
-      if ( num == 0 )
-      {
-        LOG( "!n: Failed to parse a number: %s", cmd_line + 1 );
-      }
-      else
+      // Shift index to the index n of !n command.
+      // Mind that the number from user starts from 1,
+      // then we have to make it 0-based,
+      // as we store history commands in a usual array.
+      num--;
+
+      icmd = ( icmd + num ) % MAX_COMMANDS_HISTORY_SIZE;
+      free( cmd_line );
+      cmd_line = strdup( num < MAX_COMMANDS_HISTORY_SIZE ? command_history[icmd] : "" );
+      cmd_line_len = strlen( cmd_line );
+      if ( cmd_line_len == 0 )
       {
-        // Find the earliest command in history.
-        size_t icmd = command_history_finish;
-        while ( strlen( command_history[icmd] ) == 0 )
-        {
-          icmd = ( icmd + 1 ) % MAX_COMMANDS_HISTORY_SIZE;
-        }
-
-        // Shift index to the index n of !n command.
-        // Mind that the number from user can be from 1 to 15,
-        // then we have to make it 0-based,
-        // as we store history commands in a usual array.
-        num--;
-
-        icmd = ( icmd + num ) % MAX_COMMANDS_HISTORY_SIZE;
-        free( cmd_line );
-        cmd_line = strdup( command_history[icmd] );
-        cmd_line_len = strlen( cmd_line );
-        if ( cmd_line_len == 0 )
-        {
-          ERROR( "Command not in history" );
-        }
+        ERROR( "Command not in history" );
       }
     }
 
+    TRACE_END( "parse" );
+
+    // Even a line from history gets the lines of its here-documents anew.
+    read_here_documents( cmd_line, cmd_line_len );
+
     if ( cmd_line_len > 0 )
     {
       // Save current command line to history.
       memset( command_history[command_history_finish], 0, MAX_COMMAND_SIZE );
       strcpy( command_history[command_history_finish], cmd_line );
       command_history_finish = ( command_history_finish + 1 ) % MAX_COMMANDS_HISTORY_SIZE;
+      history_lines_count++;
+      METRICS_ADD( lines, 1 );
+      METRICS_SET( history_size,
+                   history_lines_count < MAX_COMMANDS_HISTORY_SIZE ? history_lines_count :
+                                                                     MAX_COMMANDS_HISTORY_SIZE );
+    }
 
-      last_liner_exited = false;
-      int child_pid = fork();
-      if ( child_pid == 0 )
-      {
-        // Initializing foreground liner job.
-        my_process_type = PROCESS_TYPE_LINER;
-
-        // We don't need shell's liners list, as we are liner,
-        // and we don't controll our siblings.
-        free_liner_list();
-        signal( SIGINT, SIG_DFL );
-        signal( SIGTSTP, SIG_DFL );
-        signal( SIGCONT, sigcont_handler );
-        signal( SIGCHLD, sigchld_handler_for_liner );
-        signal( SIGTTIN, SIG_DFL );
-        signal( SIGTTOU, SIG_DFL );
-        run_liner();
-        // Should exit from inside run_liner.
-        assert( false );
-      }
-      else
-      {
-        LOG( "Forked a new liner with pid %d", child_pid );
-        // Saving currently spawned liner's pid to history.
-        add_pid_to_history( child_pid );
-
-        // So, we are in the shell here, saving our liner job.
-        assert( my_process_type == PROCESS_TYPE_SHELL );
+    if ( cmd_line_len > 0 )
+    {
+      learn_command_line( cmd_line, cmd_line_len );
+    }
 
-        if ( liner != NULL && liner->liner_job->pid == child_pid )
-        {
-          LOG( "Already created liner with pid: %d", child_pid );
-        }
-        else
-        {
-          add_liner_list_item( child_pid );
-        }
+    if ( cmd_line_len > 0 && is_fast_line( cmd_line, cmd_line_len ) )
+    {
+      run_fast_line( cmd_line, cmd_line_len );
+      // While the user is typing the next line.
+      prefetch_next_command();
+    }
+    else if ( cmd_line_len > 0 )
+    {
+      pid_t child_pid = start_liner_job( true );
 
-        if ( !last_liner_exited )
-        {
-          pause();
-        }
+      // While the job is running.
+      prefetch_next_command();
 
-        LOG( "Shell: Resuming main loop" );
+      // Handle events until the liner finishes or leaves the foreground.
+      while ( is_liner_in_foreground( child_pid ) )
+      {
+        poll_shell_events( -1 );
       }
+      drain_job_output( child_pid );
+
+      // Returning shell to the foreground - helps very well, if we run msh inside msh.
+      tcsetpgrp( STDIN_FILENO, msh_pgid );
+      LOG( "Shell: Resuming main loop" );
     }
 
     free_current_input_resources();
+    trace_flush();
   }
 
-  // No way we could get here.
+  // We get here only when the input is over.
   LOG( "We are out of input, Exiting..." );
   free_and_exit( EXIT_SUCCESS );
 }
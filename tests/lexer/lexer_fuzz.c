@@ -0,0 +1,57 @@
+// Fuzz target for the lexer of msh: every lexer the CPU supports must give
+// the same normalized line as the scalar one, and tokenizing it must not
+// crash or leak. Built with libFuzzer only, the shell itself does not need it:
+//
+//   clang -g -O1 -fsanitize=fuzzer,address,undefined tests/lexer/lexer_fuzz.c -o /tmp/msh_lexer_fuzz
+//   mkdir -p /tmp/msh_lexer_corpus && /tmp/msh_lexer_fuzz /tmp/msh_lexer_corpus tests/lexer
+//
+// The golden output of the lexer is checked without a fuzzer:
+//
+//   msh --lex < tests/lexer/corpus.txt | diff - tests/lexer/corpus.expected
+//   msh --lex-diff < tests/lexer/corpus.txt
+
+// The shell's own main() is not the entry point here.
+#define main msh_main
+#include "../../msh.c"
+#undef main
+
+int LLVMFuzzerTestOneInput( const uint8_t * data, size_t size )
+{
+  const char * cmd_str = (const char *)data;
+  char * expected_line = (char *)malloc( NORMALIZED_LINE_SIZE( size ) );
+  char * normalized_line = (char *)malloc( NORMALIZED_LINE_SIZE( size ) );
+  size_t expected_len = normalize_command_line_scalar( cmd_str, size, expected_line );
+  assert( expected_len < NORMALIZED_LINE_SIZE( size ) && expected_line[expected_len] == '\0' );
+
+  size_t ilexer;
+  for ( ilexer = 1; ilexer < LEXERS_COUNT; ilexer++ )
+  {
+    if ( !lexers[ilexer].is_supported() )
+    {
+      continue;
+    }
+    size_t normalized_len = lexers[ilexer].normalize( cmd_str, size, normalized_line );
+    if ( normalized_len != expected_len || memcmp( normalized_line, expected_line, expected_len + 1 ) != 0 )
+    {
+      fprintf( stderr, "%s differs:\n> %s\n< %s\n", lexers[ilexer].name, expected_line, normalized_line );
+      abort();
+    }
+  }
+
+  parse_history_reference( expected_line, expected_len );
+  char * command_tokens[MAX_NUM_ARGUMENTS + 1];
+  size_t position = 0;
+  while ( position < expected_len )
+  {
+    int tokens_count = tokenize_next_command( expected_line, expected_len, &position, command_tokens );
+    int itoken;
+    for ( itoken = 0; itoken < tokens_count; itoken++ )
+    {
+      free( command_tokens[itoken] );
+    }
+  }
+
+  free( expected_line );
+  free( normalized_line );
+  return 0;
+}
@@ -0,0 +1,527 @@
+/*
+ * Soak test of msh. Drives an interactive msh through a pty for many lines
+ * of builtins, external commands, failures, Ctrl-Z with bg, !n history references
+ * and lines typed ahead while a command runs. Every report_lines lines it prints
+ * the throughput and the shell's RSS, open descriptors, zombie children and
+ * temporary files, and it fails if any of them has grown since the warm-up,
+ * if the shell keeps the CPU busy while a command runs, or if the shell leaves
+ * its files behind on exit. Not a part of the shell:
+ *
+ *   gcc -Wall -Wextra -O2 msh.c -o msh
+ *   gcc -Wall -Wextra -O2 tests/soak/msh_soak.c -o /tmp/msh_soak
+ *   /tmp/msh_soak ./msh [lines]
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ERROR( format, ... ) fprintf( stderr, format "\n", ##__VA_ARGS__ )
+
+#define SOAK_DEFAULT_LINES 200000
+#define SOAK_REPORT_LINES 10000
+#define SOAK_WARM_UP_LINES 1000
+#define SOAK_PROMPT "msh-soak> "
+#define SOAK_PROMPT_TIMEOUT_MS 10000
+// Every so many lines a command is suspended with Ctrl-Z and resumed with bg.
+#define SOAK_SUSPEND_PERIOD 97
+#define SOAK_SUSPENDED_COMMAND "sleep 0.2"
+// Every so many lines the next line is typed while a command still runs.
+// Waiting for the command should take the shell next to no CPU time, a tenth at most.
+#define SOAK_TYPEAHEAD_PERIOD 89
+#define SOAK_TYPEAHEAD_COMMAND "sleep 0.5"
+#define SOAK_TYPEAHEAD_COMMAND_MS 500
+// printf joins the words, so the output is told from the echo of the typed line.
+#define SOAK_TYPEAHEAD_LINE "printf %s_%s\\n typed ahead"
+#define SOAK_TYPEAHEAD_OUTPUT "typed_ahead"
+// Longer than the suspended command, so samples are taken with no jobs left.
+#define SOAK_SETTLE_MS 300
+// The allocator may keep a bit more memory as it goes, that is not a leak.
+#define SOAK_RSS_SLACK_KB 256
+
+// Lines of the soak test, taken in turn.
+static const char * const soak_lines[] = {
+    "echo soak",
+    "true ; false ; echo not printed",
+    "ls /dev/null",
+    "cd /tmp",
+    "pwd ; cd /",
+    "no_such_command_in_soak",
+    "cat /dev/null ; printf %s\\n printed",
+    "export SOAK_VARIABLE=1",
+    "unset SOAK_VARIABLE",
+    "listpids",
+    "!3",
+    "history",
+    NULL };
+
+static double elapsed_seconds( const struct timespec * start, const struct timespec * finish )
+{
+  return (double)( finish->tv_sec - start->tv_sec ) + (double)( finish->tv_nsec - start->tv_nsec ) / 1e9;
+}
+
+// Write the whole buffer, returns -1 if the shell has gone.
+static int write_fully( int fd, const char * buf, size_t len )
+{
+  while ( len > 0 )
+  {
+    ssize_t written = write( fd, buf, len );
+    if ( written == -1 )
+    {
+      if ( errno == EINTR )
+      {
+        continue;
+      }
+      return -1;
+    }
+    buf += written;
+    len -= ( size_t )written;
+  }
+  return 0;
+}
+
+typedef struct soak_sample_t
+{
+  long rss_kb;
+  size_t fds;
+  size_t zombies;
+  size_t temporary_files;
+} soak_sample_t;
+
+static size_t count_directory_entries( const char * path )
+{
+  DIR * dir = opendir( path );
+  if ( dir == NULL )
+  {
+    return 0;
+  }
+  size_t entries_count = 0;
+  struct dirent * entry;
+  while ( ( entry = readdir( dir ) ) != NULL )
+  {
+    entries_count += entry->d_name[0] != '.';
+  }
+  closedir( dir );
+  return entries_count;
+}
+
+// Counts msh_cwd_<pid>, msh_env_<pid> and msh_pid_<pid>_<liner pid> of the shell in /tmp.
+static size_t count_shell_temporary_files( pid_t shell_pid )
+{
+  DIR * dir = opendir( "/tmp" );
+  if ( dir == NULL )
+  {
+    return 0;
+  }
+  char pid_string[16];
+  size_t pid_len = (size_t)snprintf( pid_string, sizeof( pid_string ), "%d", shell_pid );
+  size_t files_count = 0;
+  struct dirent * entry;
+  while ( ( entry = readdir( dir ) ) != NULL )
+  {
+    // The pid goes after "msh_cwd_", "msh_env_" or "msh_pid_".
+    const char * name = entry->d_name;
+    if ( strncmp( name, "msh_", 4 ) == 0 && strlen( name ) > 8 &&
+         strncmp( name + 8, pid_string, pid_len ) == 0 &&
+         ( name[8 + pid_len] == '\0' || name[8 + pid_len] == '_' ) )
+    {
+      files_count++;
+    }
+  }
+  closedir( dir );
+  return files_count;
+}
+
+static size_t count_zombie_children( pid_t parent_pid )
+{
+  DIR * proc_dir = opendir( "/proc" );
+  if ( proc_dir == NULL )
+  {
+    return 0;
+  }
+  size_t zombies_count = 0;
+  struct dirent * entry;
+  while ( ( entry = readdir( proc_dir ) ) != NULL )
+  {
+    if ( !isdigit( entry->d_name[0] ) )
+    {
+      continue;
+    }
+    char stat_filename[sizeof( "/proc//stat" ) + sizeof( entry->d_name )];
+    snprintf( stat_filename, sizeof( stat_filename ), "/proc/%s/stat", entry->d_name );
+    FILE * stat_file = fopen( stat_filename, "r" );
+    if ( stat_file == NULL )
+    {
+      continue;
+    }
+    char stat_line[512];
+    if ( fgets( stat_line, sizeof( stat_line ), stat_file ) != NULL )
+    {
+      // The command name can have anything in it, the fields go after its ')'.
+      char state = '\0';
+      int ppid = 0;
+      const char * fields = strrchr( stat_line, ')' );
+      if ( fields != NULL && sscanf( fields + 1, " %c %d", &state, &ppid ) == 2 && state == 'Z' &&
+           ppid == parent_pid )
+      {
+        zombies_count++;
+      }
+    }
+    fclose( stat_file );
+  }
+  closedir( proc_dir );
+  return zombies_count;
+}
+
+static void take_soak_sample( pid_t shell_pid, soak_sample_t * sample )
+{
+  char path[64];
+  snprintf( path, sizeof( path ), "/proc/%d/statm", shell_pid );
+  FILE * statm_file = fopen( path, "r" );
+  long total_pages = 0;
+  long resident_pages = 0;
+  if ( statm_file != NULL )
+  {
+    if ( fscanf( statm_file, "%ld %ld", &total_pages, &resident_pages ) != 2 )
+    {
+      resident_pages = 0;
+    }
+    fclose( statm_file );
+  }
+  sample->rss_kb = resident_pages * ( sysconf( _SC_PAGESIZE ) / 1024 );
+  snprintf( path, sizeof( path ), "/proc/%d/fd", shell_pid );
+  sample->fds = count_directory_entries( path );
+  sample->zombies = count_zombie_children( shell_pid );
+  sample->temporary_files = count_shell_temporary_files( shell_pid );
+}
+
+// Reads the shell's output until expected, returns false if it does not come in time.
+static bool wait_for_soak_output( int master_fd, const char * expected )
+{
+  size_t expected_len = strlen( expected );
+  // The expected text can come split between reads, so the end of the previous read is kept.
+  char buf[4096 + 64];
+  size_t kept_len = 0;
+  while ( true )
+  {
+    struct pollfd master_pollfd = { master_fd, POLLIN, 0 };
+    int poll_result = poll( &master_pollfd, 1, SOAK_PROMPT_TIMEOUT_MS );
+    if ( poll_result == -1 && errno == EINTR )
+    {
+      continue;
+    }
+    if ( poll_result <= 0 )
+    {
+      return false;
+    }
+    ssize_t read_result = read( master_fd, buf + kept_len, sizeof( buf ) - 1 - kept_len );
+    if ( read_result <= 0 )
+    {
+      return false;
+    }
+    size_t buf_len = kept_len + ( size_t )read_result;
+    buf[buf_len] = '\0';
+    if ( memmem( buf, buf_len, expected, expected_len ) != NULL )
+    {
+      return true;
+    }
+    kept_len = buf_len < expected_len ? buf_len : expected_len - 1;
+    memmove( buf, buf + buf_len - kept_len, kept_len );
+  }
+}
+
+static bool wait_for_soak_prompt( int master_fd )
+{
+  return wait_for_soak_output( master_fd, SOAK_PROMPT );
+}
+
+// Types the line into the shell and waits for the next prompt.
+static bool run_soak_line( int master_fd, const char * line )
+{
+  if ( write_fully( master_fd, line, strlen( line ) ) == -1 || write_fully( master_fd, "\n", 1 ) == -1 ||
+       !wait_for_soak_prompt( master_fd ) )
+  {
+    ERROR( "soak: no prompt after \"%s\"", line );
+    return false;
+  }
+  return true;
+}
+
+static void print_soak_sample( long lines_done, double lines_per_second, const soak_sample_t * sample )
+{
+  printf( "lines %ld, %.0f lines/s, rss %ld KiB, fds %lu, zombies %lu, temporary files %lu\n",
+          lines_done,
+          lines_per_second,
+          sample->rss_kb,
+          sample->fds,
+          sample->zombies,
+          sample->temporary_files );
+  fflush( stdout );
+}
+
+// Time the shell itself has spent on the CPU, in clock ticks.
+static long get_cpu_ticks( pid_t shell_pid )
+{
+  char path[64];
+  snprintf( path, sizeof( path ), "/proc/%d/stat", shell_pid );
+  FILE * stat_file = fopen( path, "r" );
+  if ( stat_file == NULL )
+  {
+    return 0;
+  }
+  char stat_line[512];
+  long user_ticks = 0;
+  long system_ticks = 0;
+  if ( fgets( stat_line, sizeof( stat_line ), stat_file ) != NULL )
+  {
+    // utime and stime are the 12th and the 13th fields after the command name.
+    const char * fields = strrchr( stat_line, ')' );
+    const char * format = " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld";
+    if ( fields == NULL || sscanf( fields + 1, format, &user_ticks, &system_ticks ) != 2 )
+    {
+      user_ticks = 0;
+      system_ticks = 0;
+    }
+  }
+  fclose( stat_file );
+  return user_ticks + system_ticks;
+}
+
+// Types a line while the command before it still runs: the shell should
+// neither busy-wait on the pending input nor stop reaping the command.
+static bool run_soak_typeahead( int master_fd, pid_t shell_pid )
+{
+  long start_ticks = get_cpu_ticks( shell_pid );
+  // Typed once the command has started, the line is pending on the terminal
+  // the whole time the command runs.
+  bool typed =
+      write_fully( master_fd, SOAK_TYPEAHEAD_COMMAND "\n", strlen( SOAK_TYPEAHEAD_COMMAND ) + 1 ) == 0;
+  usleep( 50 * 1000 );
+  typed = typed && write_fully( master_fd, SOAK_TYPEAHEAD_LINE "\n", strlen( SOAK_TYPEAHEAD_LINE ) + 1 ) == 0;
+  if ( !typed || !wait_for_soak_output( master_fd, SOAK_TYPEAHEAD_OUTPUT "\r\n" SOAK_PROMPT ) )
+  {
+    ERROR( "soak: no prompt after a line typed ahead" );
+    return false;
+  }
+  long busy_ticks = get_cpu_ticks( shell_pid ) - start_ticks;
+  if ( busy_ticks * 1000 / sysconf( _SC_CLK_TCK ) > SOAK_TYPEAHEAD_COMMAND_MS / 10 )
+  {
+    ERROR( "soak: the shell was busy for %ld ticks while a command ran", busy_ticks );
+    return false;
+  }
+  return true;
+}
+
+static int run_soak( const char * msh_path, long lines_count )
+{
+  int master_fd = posix_openpt( O_RDWR | O_NOCTTY | O_CLOEXEC );
+  if ( master_fd == -1 || grantpt( master_fd ) == -1 || unlockpt( master_fd ) == -1 )
+  {
+    ERROR( "soak: no pty: %s", strerror( errno ) );
+    return EXIT_FAILURE;
+  }
+  const char * slave_name = ptsname( master_fd );
+  // Kept open here as well, so the master does not see a hangup before the shell opens it.
+  int slave_fd = open( slave_name, O_RDWR | O_NOCTTY | O_CLOEXEC );
+  if ( slave_fd == -1 )
+  {
+    ERROR( "soak: %s: %s", slave_name, strerror( errno ) );
+    return EXIT_FAILURE;
+  }
+
+  // The shell can not lead the session, as it makes its own process group.
+  // A session leader owning the pty starts it, like a terminal emulator
+  // running a login shell, and tells the shell's pid through a pipe.
+  int pid_pipe[2];
+  if ( pipe2( pid_pipe, O_CLOEXEC ) == -1 )
+  {
+    ERROR( "soak: pipe failed: %s", strerror( errno ) );
+    return EXIT_FAILURE;
+  }
+  pid_t session_leader_pid = fork();
+  if ( session_leader_pid == -1 )
+  {
+    ERROR( "soak: fork failed: %s", strerror( errno ) );
+    return EXIT_FAILURE;
+  }
+  if ( session_leader_pid == 0 )
+  {
+    setsid();
+    close( slave_fd );
+    slave_fd = open( slave_name, O_RDWR );
+    if ( slave_fd == -1 || ioctl( slave_fd, TIOCSCTTY, 0 ) == -1 )
+    {
+      _exit( EXIT_FAILURE );
+    }
+    dup2( slave_fd, STDIN_FILENO );
+    dup2( slave_fd, STDOUT_FILENO );
+    dup2( slave_fd, STDERR_FILENO );
+    if ( slave_fd > STDERR_FILENO )
+    {
+      close( slave_fd );
+    }
+    pid_t child_pid = fork();
+    if ( child_pid == 0 )
+    {
+      setenv( "MSH_PROMPT", SOAK_PROMPT, 1 );
+      execl( msh_path, "msh", (char *)NULL );
+      _exit( 127 );
+    }
+    ssize_t written = write( pid_pipe[1], &child_pid, sizeof( child_pid ) );
+    int child_status = 0;
+    while ( written == sizeof( child_pid ) && waitpid( child_pid, &child_status, 0 ) == -1 && errno == EINTR )
+      ;
+    _exit( WIFEXITED( child_status ) ? WEXITSTATUS( child_status ) : EXIT_FAILURE );
+  }
+  close( pid_pipe[1] );
+  pid_t shell_pid = -1;
+  if ( read( pid_pipe[0], &shell_pid, sizeof( shell_pid ) ) != sizeof( shell_pid ) || shell_pid == -1 )
+  {
+    shell_pid = -1;
+  }
+  close( pid_pipe[0] );
+
+  bool passed = shell_pid != -1 && wait_for_soak_prompt( master_fd );
+  if ( !passed )
+  {
+    ERROR( "soak: the shell has not started" );
+  }
+  long warm_up_lines = lines_count / 10 < SOAK_WARM_UP_LINES ? lines_count / 10 : SOAK_WARM_UP_LINES;
+  long report_lines = lines_count / 10 < SOAK_REPORT_LINES ? lines_count / 10 : SOAK_REPORT_LINES;
+  report_lines = report_lines > 0 ? report_lines : 1;
+  soak_sample_t baseline;
+  memset( &baseline, 0, sizeof( baseline ) );
+  soak_sample_t sample;
+  struct timespec start_time;
+  clock_gettime( CLOCK_MONOTONIC, &start_time );
+  struct timespec report_time = start_time;
+  long report_lines_done = 0;
+  long lines_done = 0;
+  size_t iline = 0;
+  while ( passed && lines_done < lines_count )
+  {
+    if ( lines_done % SOAK_SUSPEND_PERIOD == SOAK_SUSPEND_PERIOD - 1 )
+    {
+      // Ctrl-Z reaches the command after it has started, otherwise it is ignored by the shell.
+      passed =
+          write_fully( master_fd, SOAK_SUSPENDED_COMMAND "\n", strlen( SOAK_SUSPENDED_COMMAND ) + 1 ) == 0;
+      usleep( 50 * 1000 );
+      passed = passed && write_fully( master_fd, "\x1a", 1 ) == 0 && wait_for_soak_prompt( master_fd ) &&
+               run_soak_line( master_fd, "bg" );
+      lines_done += 2;
+    }
+    else if ( lines_done % SOAK_TYPEAHEAD_PERIOD == SOAK_TYPEAHEAD_PERIOD - 1 )
+    {
+      passed = run_soak_typeahead( master_fd, shell_pid );
+      lines_done += 2;
+    }
+    else
+    {
+      passed = run_soak_line( master_fd, soak_lines[iline] );
+      iline = soak_lines[iline + 1] != NULL ? iline + 1 : 0;
+      lines_done++;
+    }
+
+    bool warmed_up = lines_done >= warm_up_lines && baseline.fds == 0;
+    bool report_due = lines_done - report_lines_done >= report_lines || lines_done >= lines_count;
+    if ( passed && ( warmed_up || report_due ) )
+    {
+      struct timespec now;
+      clock_gettime( CLOCK_MONOTONIC, &now );
+      double lines_per_second = ( lines_done - report_lines_done ) / elapsed_seconds( &report_time, &now );
+      usleep( SOAK_SETTLE_MS * 1000 );
+      take_soak_sample( shell_pid, &sample );
+      print_soak_sample( lines_done, lines_per_second, &sample );
+      if ( warmed_up )
+      {
+        baseline = sample;
+      }
+      report_lines_done = lines_done;
+      clock_gettime( CLOCK_MONOTONIC, &report_time );
+    }
+  }
+
+  struct timespec finish_time;
+  clock_gettime( CLOCK_MONOTONIC, &finish_time );
+  if ( passed )
+  {
+    if ( sample.rss_kb > baseline.rss_kb + SOAK_RSS_SLACK_KB )
+    {
+      ERROR( "soak: rss has grown from %ld KiB to %ld KiB", baseline.rss_kb, sample.rss_kb );
+      passed = false;
+    }
+    if ( sample.fds > baseline.fds )
+    {
+      ERROR( "soak: open descriptors have grown from %lu to %lu", baseline.fds, sample.fds );
+      passed = false;
+    }
+    if ( sample.zombies > 0 )
+    {
+      ERROR( "soak: %lu zombie children", sample.zombies );
+      passed = false;
+    }
+    if ( sample.temporary_files > baseline.temporary_files )
+    {
+      ERROR( "soak: temporary files have grown from %lu to %lu",
+             baseline.temporary_files,
+             sample.temporary_files );
+      passed = false;
+    }
+  }
+
+  // The shell has to clean up after itself, unless it is stuck already.
+  if ( !passed && shell_pid != -1 )
+  {
+    kill( shell_pid, SIGKILL );
+  }
+  write_fully( master_fd, "exit\n", 5 );
+  close( slave_fd );
+  char drain_buf[4096];
+  while ( read( master_fd, drain_buf, sizeof( drain_buf ) ) > 0 )
+    ;
+  int shell_status = 0;
+  waitpid( session_leader_pid, &shell_status, 0 );
+  close( master_fd );
+  size_t left_files_count = passed ? count_shell_temporary_files( shell_pid ) : 0;
+  if ( left_files_count > 0 )
+  {
+    ERROR( "soak: the shell has left %lu temporary files", left_files_count );
+    passed = false;
+  }
+
+  printf( "%s: %ld lines in %.1f s, %.0f lines/s\n",
+          passed ? "passed" : "failed",
+          lines_done,
+          elapsed_seconds( &start_time, &finish_time ),
+          lines_done / elapsed_seconds( &start_time, &finish_time ) );
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main( int argc, char ** argv )
+{
+  if ( argc < 2 )
+  {
+    ERROR( "usage: msh_soak <msh> [lines]" );
+    return 2;
+  }
+  long lines_count = argc >= 3 ? atol( argv[2] ) : SOAK_DEFAULT_LINES;
+  if ( lines_count <= 0 )
+  {
+    ERROR( "msh_soak: the count of lines should be positive" );
+    return 2;
+  }
+  return run_soak( argv[1], lines_count );
+}